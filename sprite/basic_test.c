@@ -6,7 +6,7 @@
 #include "sprite.c"
 
 #define SPRITE_DIR   "../assets"
-#define SPRITE_FILE  "male.json"
+#define SPRITE_FILE  "male.spb"
 
 #define BG_WIDTH		640
 #define BG_HEIGHT		480
@@ -53,8 +53,9 @@ int main(int argc, char **argv)
 		return -1;
 	}
 
-	/* Load image */
-	sprite = al_load_sprite(SPRITE_DIR, SPRITE_FILE);
+	/* Load image, body and pants layers drawn as one bitmap */
+	al_set_new_sprite_flags(ALLEGRO_SPRITE_FLATTEN);
+	sprite = al_load_sprite_binary(SPRITE_DIR, SPRITE_FILE);
 	if (!sprite) {
 		fprintf(stderr, "failed to load sprite "SPRITE_FILE"!\n");
 		return -1;
@@ -8,7 +8,9 @@
 #define FPS	60
 
 #define SPRITE_DIR   "../assets"
-#define SPRITE_FILE  "character.json"
+#define SPRITE_FILE  "character.spb"
+#define PAK_FILE     SPRITE_DIR"/assets.pak"
+#define IMAGE_CACHE  SPRITE_DIR"/.cache"
 
 #define BG_WIDTH		640
 #define BG_HEIGHT		480
@@ -26,19 +28,26 @@ static ALLEGRO_DISPLAY *display = NULL;
 static ALLEGRO_EVENT_QUEUE *eventq = NULL;
 static ALLEGRO_TIMER *timer = NULL;
 static ALLEGRO_SPRITE *sprite = NULL;
+static ALLEGRO_SPRITE_PAK *pak = NULL;
+static ALLEGRO_SPRITE_WATCHER *watcher = NULL;
+static ALLEGRO_SPRITE_QUEUE *queue = NULL;
+static ALLEGRO_BITMAP *background = NULL;
 static bool running = true;
 static bool redraw = true;
+static bool dirty_rects = false; /* -d, redraw only what changed */
 
 static int npc_count = 4;
 static const char *npc_file[4] = {
-		"bee.json",
-		"ghost.json",
-		"bigworm.json",
-		"eyeball.json"
+		"bee.spb",
+		"ghost.spb",
+		"bigworm.spb",
+		"eyeball.spb"
 };
 static ALLEGRO_SPRITE *npc[4] = {NULL, NULL, NULL, NULL};
 
 
+static int game_draw_map(void);
+
 static bool collision_check(int x1, int y1, int w1, int h1,
 			int x2, int y2, int w2, int h2)
 {
@@ -164,7 +173,7 @@ static int game_init_map(void)
 
 static int game_init_sprite(void)
 {
-	sprite = al_load_sprite(SPRITE_DIR, SPRITE_FILE);
+	sprite = al_load_sprite_binary(SPRITE_DIR, SPRITE_FILE);
 	if (!sprite) {
 		fprintf(stderr, "failed to load sprite "SPRITE_FILE"!\n");
 		return -1;
@@ -187,8 +196,10 @@ static int game_init_sprite(void)
 static int game_init_npc(void)
 {
 	int i;
+
+	/* Decode all NPCs in parallel */
+	al_load_sprites(SPRITE_DIR, npc_file, npc_count, npc);
 	for (i = 0; i < npc_count; i++) {
-		npc[i] = al_load_sprite(SPRITE_DIR, npc_file[i]);
 		if (!npc[i]) {
 			fprintf(stderr, "failed to load sprite %s!\n", npc_file[i]);
 			return -1;
@@ -213,6 +224,38 @@ static int game_init_npc(void)
 	return 0;
 }
 
+/* Player and NPCs are drawn together, sorted by foot position */
+static int game_init_queue(void)
+{
+	int i;
+
+	queue = al_create_sprite_queue();
+	if (!queue)
+		return -1;
+
+	if (al_sprite_queue_add(queue, sprite))
+		return -1;
+	for (i = 0; i < npc_count; i++) {
+		if (al_sprite_queue_add(queue, npc[i]))
+			return -1;
+	}
+
+	if (!dirty_rects)
+		return 0;
+
+	/* What sprites are drawn over, restored where they moved */
+	background = al_create_bitmap(BG_WIDTH, BG_HEIGHT);
+	if (!background)
+		return -1;
+	al_set_target_bitmap(background);
+	al_clear_to_color(BG_COLOR);
+	game_draw_map();
+	al_set_target_backbuffer(display);
+
+	al_set_sprite_queue_background(queue, background);
+	return 0;
+}
+
 static int game_init(void)
 {
 	/* Init allegro engine */
@@ -228,6 +271,12 @@ static int game_init(void)
 	/* Init image addon */
 	al_init_image_addon();
 
+	/* Dirty rectangles need the back buffer kept across flips */
+	if (dirty_rects) {
+		al_set_new_display_flags(ALLEGRO_GENERATE_EXPOSE_EVENTS);
+		al_set_new_display_option(ALLEGRO_SWAP_METHOD, 1, ALLEGRO_SUGGEST);
+	}
+
 	/* Create a window */
 	display = al_create_display(BG_WIDTH, BG_HEIGHT);
 	if (!display) {
@@ -235,6 +284,11 @@ static int game_init(void)
 		return -1;
 	}
 
+	if (dirty_rects && al_get_display_option(display, ALLEGRO_SWAP_METHOD) != 1) {
+		fprintf(stderr, "back buffer not kept, dirty rectangles disabled\n");
+		dirty_rects = false;
+	}
+
 	/* Create event queue */
 	eventq = al_create_event_queue();
 	if (!eventq) {
@@ -249,6 +303,18 @@ static int game_init(void)
 		return -1;
 	}
 
+	/* Skip PNG decoding on later starts */
+	al_set_sprite_image_cache(IMAGE_CACHE, 64 << 20);
+
+	/* Read assets from the archive when it was built, else pick up
+	 * edits of the loose files while running */
+	if (al_filename_exists(PAK_FILE)) {
+		pak = al_open_sprite_pak(PAK_FILE);
+		al_mount_sprite_pak(pak);
+	} else {
+		watcher = al_create_sprite_watcher(SPRITE_DIR);
+	}
+
 	if (game_init_map()) {
 		fprintf(stderr, "failed to init map!\n");
 		return -1;
@@ -264,6 +330,15 @@ static int game_init(void)
 		return -1;
 	}
 
+	if (game_init_queue()) {
+		fprintf(stderr, "failed to init render queue!\n");
+		return -1;
+	}
+
+	/* Pack all sprite sheets into one texture */
+	if (al_build_sprite_atlas(1024, 1024) < 0)
+		fprintf(stderr, "failed to build sprite atlas!\n");
+
 	/* Set window title */
 	al_set_window_title(display, "SPRITE!");
 
@@ -278,10 +353,16 @@ static int game_init(void)
 
 static void game_exit(void)
 {
+	if (watcher)
+		al_destroy_sprite_watcher(watcher);
 	if (display)
 		al_destroy_display(display);
 	if (timer)
 		al_destroy_timer(timer);
+	if (queue)
+		al_destroy_sprite_queue(queue);
+	if (background)
+		al_destroy_bitmap(background);
 	if (sprite)
 		al_destroy_sprite(sprite);
 	if (npc_count > 0) {
@@ -293,6 +374,8 @@ static void game_exit(void)
 	}
 	if (eventq)
 		al_destroy_event_queue(eventq);
+	if (pak)
+		al_close_sprite_pak(pak);
 
 	printf("Game Exit!\n");
 }
@@ -619,6 +702,10 @@ static void game_handle_event(ALLEGRO_EVENT *event)
 			if (event->keyboard.keycode == ALLEGRO_KEY_ESCAPE)
 				running = false;
 			break;
+		case ALLEGRO_EVENT_DISPLAY_EXPOSE:
+			al_invalidate_sprite_queue(queue);
+			redraw = true;
+			break;
 		case ALLEGRO_EVENT_DISPLAY_CLOSE:
 			running = false;
 			break;
@@ -632,27 +719,33 @@ static int game_draw_map(void)
 	return 0;
 }
 
-static int game_draw_sprite(void)
-{
-	al_draw_sprite(sprite);
-	return 0;
-}
-
-static int game_draw_npc(void)
+static int game_draw_sprites(void)
 {
-	int i;
-	for (i = 0; i < npc_count; i++)
-		al_draw_sprite(npc[i]);
+	al_draw_sprite_queue(queue);
 	return 0;
 }
 
 static int game_display_refresh(void)
 {
+	int x, y, w, h;
+
+	if (dirty_rects) {
+		redraw = false;
+		if (al_draw_sprite_queue(queue) <= 0)
+			return 0;
+		al_get_sprite_queue_damage(queue, &x, &y, &w, &h);
+		al_update_display_region(x, y, w, h);
+		al_update_sprite_memory();
+		return 0;
+	}
+
 	al_clear_to_color(BG_COLOR);
 	game_draw_map();
-	game_draw_npc();
-	game_draw_sprite();
+	al_hold_bitmap_drawing(true);
+	game_draw_sprites();
+	al_hold_bitmap_drawing(false);
 	al_flip_display();
+	al_update_sprite_memory();
 	redraw = false;
 	return 0;
 }
@@ -665,6 +758,10 @@ static void game_loop(void)
 
 	while (running) {
 		if (al_is_event_queue_empty(eventq)) {
+			if (watcher && al_update_sprite_watcher(watcher) > 0) {
+				al_invalidate_sprite_queue(queue);
+				redraw = true;
+			}
 			if (redraw)
 				game_display_refresh();
 			continue;
@@ -679,6 +776,9 @@ static void game_loop(void)
 
 int main(int argc, char **argv)
 {
+	if (argc > 1 && !strcmp(argv[1], "-d"))
+		dirty_rects = true;
+
 	if (!game_init()) {
 		game_loop();
 	}
@@ -1,8 +1,19 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#undef MAP_FILE /* Not used here, clashes with MAP_FILE of the tiled demos */
 #include <allegro5/allegro.h>
-#include <cJSON.h>
-#include <cJSON_Utils.h>
+#include <allegro5/allegro_memfile.h>
 
 #include "sprite.h"
 
@@ -17,12 +28,50 @@ typedef struct {
 	int y;
 } ALLEGRO_SPRITE_TILE;
 
+/* Skyline segment of an atlas page, free space starts at y */
+typedef struct {
+	int x;
+	int y;
+	int w;
+} ALLEGRO_SPRITE_SKYLINE;
+
+/* Texture atlas page, packed images are sub-bitmaps of it */
+typedef struct _ALLEGRO_SPRITE_ATLAS ALLEGRO_SPRITE_ATLAS;
+struct _ALLEGRO_SPRITE_ATLAS {
+	ALLEGRO_BITMAP *bitmap;
+	int width;
+	int height;
+
+	int node_count;
+	ALLEGRO_SPRITE_SKYLINE *nodes;
+
+	int refs; /* Images packed in this page */
+	ALLEGRO_SPRITE_ATLAS *next;
+};
+
+/* Decoded image, shared by every layer that uses the same file */
+typedef struct _ALLEGRO_SPRITE_IMAGE ALLEGRO_SPRITE_IMAGE;
+struct _ALLEGRO_SPRITE_IMAGE {
+	char *path; /* Resolved image file path, the cache key */
+	ALLEGRO_BITMAP *bitmap; /* NULL while evicted */
+	ALLEGRO_SPRITE_ATLAS *atlas; /* Page holding bitmap, NULL if standalone */
+	int refs;
+
+	/* Residency, see al_set_sprite_memory_budget() */
+	size_t size; /* Bytes of bitmap */
+	uint64_t last_use; /* Frame of the last draw */
+	int pins; /* Gathered by a running al_draw_sprites(), not evicted */
+	ALLEGRO_BITMAP *backup; /* Memory copy of an evicted bitmap, or NULL */
+
+	ALLEGRO_SPRITE_IMAGE *next;
+};
+
 typedef struct {
 	/* bitmap resource */
 	char *image_file;
 	int image_width;
 	int image_height;
-	ALLEGRO_BITMAP *bitmap;
+	ALLEGRO_SPRITE_IMAGE *image;
 
 	int tile_count;
 	int tile_width;
@@ -35,9 +84,36 @@ typedef struct {
 	ALLEGRO_SPRITE_TILE *tiles_left;  /*/pointer to tiles[tile_count * 3 / 4] */
 } ALLEGRO_SPRITE_TILE_LAYER;
 
+/* Screen rectangle, x2 and y2 excluded */
+typedef struct {
+	int x1, y1, x2, y2;
+} ALLEGRO_SPRITE_RECT;
+
+/* Source rectangle of one layer in one animation frame */
+typedef struct {
+	ALLEGRO_SPRITE_IMAGE *image;
+	float sx;
+	float sy;
+	float sw;
+	float sh;
+} ALLEGRO_SPRITE_FRAME;
+
+/* Action counters wrap here, divisible by every frame count up to 10 */
+#define ALLEGRO_SPRITE_COUNTER_MAX	2520
+
 typedef struct {
 	int layer_count;
 	ALLEGRO_SPRITE_TILE_LAYER *layers;
+	bool loaded; /* Layer images acquired */
+
+	/* Precomputed [direction][frame][layer] source rectangles */
+	int frame_count;
+	ALLEGRO_SPRITE_FRAME *frames;
+
+	/* Composited [direction][frame] rectangles, NULL flat if not flattened */
+	ALLEGRO_SPRITE_IMAGE *flat;
+	ALLEGRO_SPRITE_FRAME *flat_frames;
+	bool flatten_pending; /* Loaded off the display thread, flattened on it */
 } ALLEGRO_SPRITE_TILESET;
 
 typedef struct {
@@ -53,431 +129,4463 @@ typedef struct {
 	bool stopable; /* If action can be stopped. */
 } ALLEGRO_SPRITE_ACTION;
 
-#define MAX_ACTIONS	10
+#define MAX_ACTIONS	10
+
+/* Immutable sprite asset data, shared by all sprites created from it */
+struct _ALLEGRO_SPRITE_DEF {
+	/* JSON file directory */
+	char *dir;
+	char *file; /* Descriptor file in dir */
+
+	/* Mapped binary sprite file, tiles and image files point into it.
+	 * NULL if they point into a mounted archive instead. */
+	void *map_base;
+	size_t map_size;
+
+	/* Bitmap tilesets */
+	int tileset_count;
+	ALLEGRO_SPRITE_TILESET *tilesets;
+
+	int flags; /* ALLEGRO_SPRITE_FLATTEN, ALLEGRO_SPRITE_LAZY */
+
+	/* Owner count, the loader and every sprite instance hold one */
+	int refs;
+
+	/* Hot reload, see al_create_sprite_watcher() */
+	ALLEGRO_SPRITE_DEF *reloaded; /* Newer definition of the file, holds a ref */
+	ALLEGRO_SPRITE_DEF *next; /* Loaded definitions list */
+};
+
+/* Per entity state of a sprite */
+struct _ALLEGRO_SPRITE {
+	ALLEGRO_SPRITE_DEF *def;
+
+	/* The size of map that sprite is in */
+	int map_x;
+	int map_y;
+	int map_width;
+	int map_height;
+
+	/* Position in map. */
+	int x;
+	int y;
+
+	/* Current tile size, related to tileset. */
+	int w;
+	int h;
+
+	/* The direction sprite face to, tile selecting */
+	ALLEGRO_SPRITE_DIRECTION direction;
+
+	ALLEGRO_SPRITE_ACTION actions[MAX_ACTIONS];
+	ALLEGRO_SPRITE_ACTION *action; /* Selected action, pointer to actions[?] */
+	int action_count;
+};
+
+/***************************************************************************************/
+/********** Decoded Image Cache ********************************************************/
+/***************************************************************************************/
+
+/*
+ * Decoded images are kept on disk as raw premultiplied RGBA, so a warm
+ * start copies pixels from a mapping into a locked bitmap instead of
+ * inflating PNGs. Each source file has one cache file, named by the
+ * hash of its path, that is valid while the source's mtime and size
+ * match its header:
+ *
+ *   ALLEGRO_SPRITE_RAW_HEADER, padded to ALLEGRO_SPRITE_RAW_DATA bytes
+ *   Pixels, ALLEGRO_PIXEL_FORMAT_ABGR_8888_LE, width * 4 bytes a row
+ *
+ * Least recently used files are removed when the cache outgrows its cap.
+ */
+
+#define ALLEGRO_SPRITE_RAW_MAGIC	0x31574152 /* "RAW1" */
+#define ALLEGRO_SPRITE_RAW_VERSION	1
+#define ALLEGRO_SPRITE_RAW_DATA		64
+#define ALLEGRO_SPRITE_RAW_EXT		".raw"
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t width;
+	uint32_t height;
+	int64_t mtime_sec; /* Source file */
+	int64_t mtime_nsec;
+	uint64_t source_size;
+	uint64_t path_hash;
+} ALLEGRO_SPRITE_RAW_HEADER;
+
+/* Cache file with its age, for trimming */
+typedef struct {
+	char name[32];
+	size_t size;
+	struct timespec mtime;
+} ALLEGRO_SPRITE_RAW_FILE;
+
+static char *al_image_cache_dir = NULL;
+static size_t al_image_cache_max = 0;
+
+/*
+ * Keep decoded images in dir, created if missing, using at most
+ * max_bytes of disk (0 for no limit). NULL turns the cache off. Set it
+ * before loading, not while loader threads run.
+ */
+int al_set_sprite_image_cache(const char *dir, size_t max_bytes)
+{
+	char *copy = NULL;
+
+	if (dir) {
+		if (mkdir(dir, 0755) && errno != EEXIST) {
+			fprintf(stderr, "Create cache dir [%s] error!\n", dir);
+			ERROR_RETURN(-1);
+		}
+		copy = strdup(dir);
+		if (!copy)
+			ERROR_RETURN(-1);
+	}
+
+	free(al_image_cache_dir);
+	al_image_cache_dir = copy;
+	al_image_cache_max = max_bytes;
+	return 0;
+}
+
+static uint64_t al_image_cache_hash(const char *str)
+{
+	uint64_t hash = 14695981039346656037ull;
+
+	while (*str) {
+		hash ^= (unsigned char)*str++;
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+static bool al_check_raw_header(const ALLEGRO_SPRITE_RAW_HEADER *h,
+				const struct stat *src, uint64_t hash, size_t size)
+{
+	return h->magic == ALLEGRO_SPRITE_RAW_MAGIC &&
+		h->version == ALLEGRO_SPRITE_RAW_VERSION &&
+		h->path_hash == hash &&
+		h->mtime_sec == src->st_mtim.tv_sec &&
+		h->mtime_nsec == src->st_mtim.tv_nsec &&
+		h->source_size == (uint64_t)src->st_size &&
+		h->width > 0 && h->height > 0 &&
+		(size - ALLEGRO_SPRITE_RAW_DATA) / 4 / h->width >= h->height;
+}
+
+/* Bitmap of a valid cache file, NULL on a miss */
+static ALLEGRO_BITMAP *al_read_raw_image(const char *cpath,
+				const struct stat *src, uint64_t hash)
+{
+	const ALLEGRO_SPRITE_RAW_HEADER *h;
+	ALLEGRO_LOCKED_REGION *lr;
+	ALLEGRO_BITMAP *bitmap = NULL;
+	struct stat st;
+	const char *pixels;
+	void *base;
+	size_t row;
+	int fd, y;
+
+	fd = open(cpath, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st) || st.st_size < ALLEGRO_SPRITE_RAW_DATA) {
+		close(fd);
+		return NULL;
+	}
+
+	base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (base == MAP_FAILED) {
+		close(fd);
+		return NULL;
+	}
+
+	h = base;
+	if (!al_check_raw_header(h, src, hash, st.st_size))
+		goto exit;
+
+	bitmap = al_create_bitmap(h->width, h->height);
+	if (!bitmap)
+		goto exit;
+	lr = al_lock_bitmap(bitmap, ALLEGRO_PIXEL_FORMAT_ABGR_8888_LE, ALLEGRO_LOCK_WRITEONLY);
+	if (!lr) {
+		al_destroy_bitmap(bitmap);
+		bitmap = NULL;
+		goto exit;
+	}
+
+	row = (size_t)h->width * 4;
+	pixels = (const char *)base + ALLEGRO_SPRITE_RAW_DATA;
+	for (y = 0; y < h->height; y++)
+		memcpy((char *)lr->data + y * lr->pitch, pixels + y * row, row);
+	al_unlock_bitmap(bitmap);
+
+	/* Recently used, see al_trim_image_cache() */
+	futimens(fd, NULL);
+
+exit:
+	munmap(base, st.st_size);
+	close(fd);
+	return bitmap;
+}
+
+static int al_raw_file_cmp(const void *a, const void *b)
+{
+	const ALLEGRO_SPRITE_RAW_FILE *fa = a, *fb = b;
+
+	if (fa->mtime.tv_sec != fb->mtime.tv_sec)
+		return fa->mtime.tv_sec < fb->mtime.tv_sec ? -1 : 1;
+	if (fa->mtime.tv_nsec != fb->mtime.tv_nsec)
+		return fa->mtime.tv_nsec < fb->mtime.tv_nsec ? -1 : 1;
+	return 0;
+}
+
+/* Remove the least recently used files over the cap */
+static void al_trim_image_cache(void)
+{
+	ALLEGRO_SPRITE_RAW_FILE *files = NULL, *tmp;
+	struct dirent *ent;
+	struct stat st;
+	size_t total = 0;
+	const char *ext;
+	char path[PATH_MAX];
+	int count = 0, max = 0, i;
+	DIR *d;
+
+	if (!al_image_cache_max)
+		return;
+
+	d = opendir(al_image_cache_dir);
+	if (!d)
+		return;
+	while ((ent = readdir(d))) {
+		ext = strrchr(ent->d_name, '.');
+		if (!ext || strcmp(ext, ALLEGRO_SPRITE_RAW_EXT) ||
+			strlen(ent->d_name) >= sizeof(files->name))
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", al_image_cache_dir, ent->d_name);
+		if (stat(path, &st))
+			continue;
+
+		if (count == max) {
+			max = max ? max * 2 : 64;
+			tmp = realloc(files, sizeof(ALLEGRO_SPRITE_RAW_FILE) * max);
+			if (!tmp)
+				break;
+			files = tmp;
+		}
+		strcpy(files[count].name, ent->d_name);
+		files[count].size = st.st_size;
+		files[count].mtime = st.st_mtim;
+		total += st.st_size;
+		count++;
+	}
+	closedir(d);
+
+	if (total > al_image_cache_max) {
+		qsort(files, count, sizeof(ALLEGRO_SPRITE_RAW_FILE), al_raw_file_cmp);
+		for (i = 0; i < count && total > al_image_cache_max; i++) {
+			snprintf(path, sizeof(path), "%s/%s", al_image_cache_dir, files[i].name);
+			if (!unlink(path))
+				total -= files[i].size;
+		}
+	}
+	free(files);
+}
+
+/* Store a decoded image, written aside then renamed for other threads */
+static void al_write_raw_image(const char *cpath, ALLEGRO_BITMAP *bitmap,
+				const struct stat *src, uint64_t hash)
+{
+	ALLEGRO_SPRITE_RAW_HEADER h;
+	ALLEGRO_LOCKED_REGION *lr;
+	char head[ALLEGRO_SPRITE_RAW_DATA];
+	char tmp[PATH_MAX];
+	size_t row;
+	bool bad;
+	FILE *fp;
+	int fd, y;
+
+	memset(&h, 0, sizeof(h));
+	h.magic = ALLEGRO_SPRITE_RAW_MAGIC;
+	h.version = ALLEGRO_SPRITE_RAW_VERSION;
+	h.width = al_get_bitmap_width(bitmap);
+	h.height = al_get_bitmap_height(bitmap);
+	h.mtime_sec = src->st_mtim.tv_sec;
+	h.mtime_nsec = src->st_mtim.tv_nsec;
+	h.source_size = src->st_size;
+	h.path_hash = hash;
+	memset(head, 0, sizeof(head));
+	memcpy(head, &h, sizeof(h));
+
+	snprintf(tmp, sizeof(tmp), "%s/.tmpXXXXXX", al_image_cache_dir);
+	fd = mkstemp(tmp);
+	if (fd < 0)
+		return;
+	fp = fdopen(fd, "wb");
+	if (!fp) {
+		close(fd);
+		unlink(tmp);
+		return;
+	}
+
+	lr = al_lock_bitmap(bitmap, ALLEGRO_PIXEL_FORMAT_ABGR_8888_LE, ALLEGRO_LOCK_READONLY);
+	if (lr) {
+		row = (size_t)h.width * 4;
+		fwrite(head, 1, sizeof(head), fp);
+		for (y = 0; y < h.height; y++)
+			fwrite((char *)lr->data + y * lr->pitch, 1, row, fp);
+		al_unlock_bitmap(bitmap);
+	}
+
+	bad = !lr || ferror(fp);
+	if (fclose(fp) || bad || rename(tmp, cpath)) {
+		unlink(tmp);
+		return;
+	}
+	al_trim_image_cache();
+}
+
+/*
+ * al_load_bitmap() through the decoded image cache, when it is set.
+ * Images without premultiplied alpha are always decoded.
+ */
+ALLEGRO_BITMAP *al_load_cached_bitmap(const char *filename)
+{
+	ALLEGRO_BITMAP *bitmap;
+	struct stat src;
+	char cpath[PATH_MAX];
+	uint64_t hash;
+
+	if (!al_image_cache_dir ||
+		(al_get_new_bitmap_flags() & ALLEGRO_NO_PREMULTIPLIED_ALPHA) ||
+		stat(filename, &src))
+		return al_load_bitmap(filename);
+
+	hash = al_image_cache_hash(filename);
+	snprintf(cpath, sizeof(cpath), "%s/%016llx"ALLEGRO_SPRITE_RAW_EXT,
+			al_image_cache_dir, (unsigned long long)hash);
+
+	bitmap = al_read_raw_image(cpath, &src, hash);
+	if (bitmap)
+		return bitmap;
+
+	bitmap = al_load_bitmap(filename);
+	if (bitmap)
+		al_write_raw_image(cpath, bitmap, &src, hash);
+	return bitmap;
+}
+
+/***************************************************************************************/
+/********** Packed Assets **************************************************************/
+/***************************************************************************************/
+
+/*
+ * Asset archive (.pak), written by al_save_sprite_pak(). All fields
+ * are in native byte order, laid out as:
+ *
+ *   ALLEGRO_SPRITE_PAK_HEADER
+ *   uint32_t                  buckets[bucket_count], first entry of each chain
+ *   ALLEGRO_SPRITE_PAK_ENTRY  [entry_count]
+ *   File names, '\0' terminated [names_size bytes]
+ *   File data, each aligned to ALLEGRO_SPRITE_PAK_ALIGN
+ *
+ * Entries are found by the FNV-1a hash of their name. The archive is
+ * mapped read only and files are read in place through memfiles.
+ */
+
+#define ALLEGRO_SPRITE_PAK_MAGIC	0x314b4150 /* "PAK1" */
+#define ALLEGRO_SPRITE_PAK_VERSION	1
+#define ALLEGRO_SPRITE_PAK_ALIGN	64
+#define ALLEGRO_SPRITE_PAK_NONE		0xffffffff /* End of a bucket chain */
+#define ALLEGRO_SPRITE_PAK_HASH		2166136261u
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t entry_count;
+	uint32_t bucket_count; /* Power of two, at least 2 */
+	uint32_t names_size;
+	uint32_t reserved;
+} ALLEGRO_SPRITE_PAK_HEADER;
+
+typedef struct {
+	uint32_t hash;
+	uint32_t name; /* Offset in name table */
+	uint32_t next; /* Next entry in the bucket */
+	uint32_t reserved;
+	uint64_t offset; /* File data from the start of the archive */
+	uint64_t size;
+} ALLEGRO_SPRITE_PAK_ENTRY;
+
+struct _ALLEGRO_SPRITE_PAK {
+	void *base;
+	size_t size;
+
+	const ALLEGRO_SPRITE_PAK_HEADER *header;
+	const uint32_t *buckets;
+	const ALLEGRO_SPRITE_PAK_ENTRY *entries;
+	const char *names;
+};
+
+/* Archive searched before the file system, see al_mount_sprite_pak() */
+static ALLEGRO_SPRITE_PAK *al_sprite_pak = NULL;
+
+static uint32_t al_sprite_pak_hash(uint32_t hash, const char *str)
+{
+	while (*str) {
+		hash ^= (unsigned char)*str++;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+/* Entry of "dir/name", or of name if dir is NULL, no path is built */
+static const ALLEGRO_SPRITE_PAK_ENTRY *al_find_sprite_pak_entry(ALLEGRO_SPRITE_PAK *pak,
+				const char *dir, const char *name)
+{
+	const ALLEGRO_SPRITE_PAK_ENTRY *e;
+	const char *s;
+	uint32_t hash = ALLEGRO_SPRITE_PAK_HASH;
+	uint32_t i;
+	size_t n = 0;
+
+	if (!pak)
+		return NULL;
+
+	if (dir) {
+		hash = al_sprite_pak_hash(hash, dir);
+		hash = al_sprite_pak_hash(hash, "/");
+		n = strlen(dir);
+	}
+	hash = al_sprite_pak_hash(hash, name);
+
+	i = pak->buckets[hash & (pak->header->bucket_count - 1)];
+	for (; i != ALLEGRO_SPRITE_PAK_NONE; i = e->next) {
+		e = &pak->entries[i];
+		if (e->hash != hash)
+			continue;
+
+		s = pak->names + e->name;
+		if (dir) {
+			if (strncmp(s, dir, n) || s[n] != '/')
+				continue;
+			s += n + 1;
+		}
+		if (!strcmp(s, name))
+			return e;
+	}
+	return NULL;
+}
+
+ALLEGRO_SPRITE_PAK *al_open_sprite_pak(const char *filepath)
+{
+	ALLEGRO_SPRITE_PAK *pak;
+	const ALLEGRO_SPRITE_PAK_HEADER *header;
+	const ALLEGRO_SPRITE_PAK_ENTRY *e;
+	struct stat st;
+	size_t bytes;
+	void *base;
+	uint32_t i;
+	int fd;
+
+	fd = open(filepath, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "Open file [%s] error!\n", filepath);
+		ERROR_RETURN(NULL);
+	}
+
+	if (fstat(fd, &st) ||
+		st.st_size < (off_t)sizeof(ALLEGRO_SPRITE_PAK_HEADER)) {
+		close(fd);
+		ERROR_RETURN(NULL);
+	}
+
+	base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED)
+		ERROR_RETURN(NULL);
+
+	/* Check everything once, lookups trust the archive */
+	header = base;
+	bytes = sizeof(*header)
+		+ (size_t)header->bucket_count * sizeof(uint32_t)
+		+ (size_t)header->entry_count * sizeof(ALLEGRO_SPRITE_PAK_ENTRY)
+		+ header->names_size;
+	if (header->magic != ALLEGRO_SPRITE_PAK_MAGIC ||
+		header->version != ALLEGRO_SPRITE_PAK_VERSION ||
+		header->bucket_count < 2 ||
+		(header->bucket_count & (header->bucket_count - 1)) ||
+		header->names_size == 0 || bytes > (size_t)st.st_size)
+		goto fail;
+
+	pak = calloc(1, sizeof(ALLEGRO_SPRITE_PAK));
+	if (!pak)
+		goto fail;
+	pak->base = base;
+	pak->size = st.st_size;
+	pak->header = header;
+	pak->buckets = (const uint32_t *)(header + 1);
+	pak->entries = (const void *)(pak->buckets + header->bucket_count);
+	pak->names = (const char *)(pak->entries + header->entry_count);
+
+	if (pak->names[header->names_size - 1] != '\0')
+		goto fail_free;
+	for (i = 0; i < header->bucket_count; i++) {
+		if (pak->buckets[i] != ALLEGRO_SPRITE_PAK_NONE &&
+			pak->buckets[i] >= header->entry_count)
+			goto fail_free;
+	}
+	for (i = 0; i < header->entry_count; i++) {
+		e = &pak->entries[i];
+		if (e->name >= header->names_size ||
+			(e->next != ALLEGRO_SPRITE_PAK_NONE && e->next <= i) ||
+			e->offset > pak->size || e->size > pak->size - e->offset)
+			goto fail_free;
+	}
+	return pak;
+
+fail_free:
+	free(pak);
+fail:
+	munmap(base, st.st_size);
+	fprintf(stderr, "Bad archive [%s]!\n", filepath);
+	ERROR_RETURN(NULL);
+}
+
+/* Sprites loaded from the archive must be destroyed first */
+void al_close_sprite_pak(ALLEGRO_SPRITE_PAK *pak)
+{
+	if (!pak)
+		return;
+	if (al_sprite_pak == pak)
+		al_sprite_pak = NULL;
+	munmap(pak->base, pak->size);
+	free(pak);
+}
+
+/*
+ * Make the sprite loaders look for files in pak before the file system,
+ * under the "dir/filename" path they are given. NULL unmounts. Mount
+ * before loading, not while loader threads run.
+ */
+void al_mount_sprite_pak(ALLEGRO_SPRITE_PAK *pak)
+{
+	al_sprite_pak = pak;
+}
+
+static ALLEGRO_FILE *al_open_sprite_pak_entry(ALLEGRO_SPRITE_PAK *pak,
+				const ALLEGRO_SPRITE_PAK_ENTRY *e)
+{
+	return al_open_memfile((char *)pak->base + e->offset, e->size, "r");
+}
+
+/* Read only file of the archive, the data is not copied */
+ALLEGRO_FILE *al_fopen_sprite_pak(ALLEGRO_SPRITE_PAK *pak, const char *filename)
+{
+	const ALLEGRO_SPRITE_PAK_ENTRY *e;
+
+	e = al_find_sprite_pak_entry(pak, NULL, filename);
+	if (!e)
+		return NULL;
+	return al_open_sprite_pak_entry(pak, e);
+}
+
+/* Open "dir/filename" from the mounted archive or else from disk */
+static ALLEGRO_FILE *al_open_sprite_file(const char *dir, const char *filename)
+{
+	const ALLEGRO_SPRITE_PAK_ENTRY *e;
+	ALLEGRO_FILE *fp;
+	char *path;
+
+	e = al_find_sprite_pak_entry(al_sprite_pak, dir, filename);
+	if (e)
+		return al_open_sprite_pak_entry(al_sprite_pak, e);
+
+	path = malloc(strlen(dir)+strlen(filename)+10);
+	if (!path)
+		return NULL;
+	sprintf(path, "%s/%s", dir, filename);
+	fp = al_fopen(path, "rb");
+	if (!fp)
+		fprintf(stderr, "Open file [%s] error!\n", path);
+	free(path);
+	return fp;
+}
+
+/* Decode an image from the mounted archive or else from disk */
+static ALLEGRO_BITMAP *al_load_sprite_bitmap(const char *path)
+{
+	const ALLEGRO_SPRITE_PAK_ENTRY *e;
+	ALLEGRO_BITMAP *bitmap;
+	ALLEGRO_FILE *fp;
+	const char *ext;
+
+	e = al_find_sprite_pak_entry(al_sprite_pak, NULL, path);
+	if (!e)
+		return al_load_cached_bitmap(path);
+
+	ext = strrchr(path, '.');
+	fp = al_open_sprite_pak_entry(al_sprite_pak, e);
+	if (!ext || !fp) {
+		if (fp)
+			al_fclose(fp);
+		return NULL;
+	}
+	bitmap = al_load_bitmap_f(fp, ext);
+	al_fclose(fp);
+	return bitmap;
+}
+
+/*
+ * Open a temporary file next to filepath, al_commit_sprite_file() renames
+ * it into place. Loaded .spb and .pak files are mapped, rewriting them in
+ * place would change or truncate the pages under live definitions.
+ */
+static FILE *al_create_sprite_file(const char *filepath, char *tmp, size_t size)
+{
+	FILE *fp;
+	int fd;
+
+	snprintf(tmp, size, "%s.tmpXXXXXX", filepath);
+	fd = mkstemp(tmp);
+	if (fd < 0)
+		return NULL;
+	fchmod(fd, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	fp = fdopen(fd, "wb");
+	if (!fp) {
+		close(fd);
+		unlink(tmp);
+	}
+	return fp;
+}
+
+/* Close a file of al_create_sprite_file(), renamed into place if ok */
+static int al_commit_sprite_file(FILE *fp, const char *tmp, const char *filepath, bool ok)
+{
+	bool bad = !ok || ferror(fp);
+
+	if (fclose(fp) || bad || rename(tmp, filepath)) {
+		unlink(tmp);
+		return -1;
+	}
+	return 0;
+}
+
+/* Pack files into an archive, each stored under the name it is given */
+int al_save_sprite_pak(const char *filepath, const char **files, int n)
+{
+	ALLEGRO_SPRITE_PAK_HEADER header;
+	ALLEGRO_SPRITE_PAK_ENTRY *entries = NULL;
+	uint32_t *buckets = NULL;
+	static const char zero[ALLEGRO_SPRITE_PAK_ALIGN];
+	FILE *fp = NULL, *in;
+	char buf[4096];
+	char tmp[PATH_MAX];
+	uint64_t offset;
+	size_t len;
+	long size;
+	uint32_t b;
+	int i, k, ret = -1;
+
+	if (!filepath || !files || n <= 0)
+		ERROR_RETURN(-1);
+
+	memset(&header, 0, sizeof(header));
+	header.magic = ALLEGRO_SPRITE_PAK_MAGIC;
+	header.version = ALLEGRO_SPRITE_PAK_VERSION;
+	header.entry_count = n;
+	for (header.bucket_count = 2; header.bucket_count < (uint32_t)n; )
+		header.bucket_count *= 2;
+
+	buckets = malloc(sizeof(uint32_t) * header.bucket_count);
+	entries = calloc(n, sizeof(ALLEGRO_SPRITE_PAK_ENTRY));
+	if (!buckets || !entries)
+		goto exit;
+	memset(buckets, 0xff, sizeof(uint32_t) * header.bucket_count);
+
+	/* Chains are kept in entry order, the reader relies on it */
+	for (i = n - 1; i >= 0; i--) {
+		for (k = 0; k < i; k++) {
+			if (!strcmp(files[k], files[i])) {
+				fprintf(stderr, "Duplicate file [%s]!\n", files[i]);
+				goto exit;
+			}
+		}
+		entries[i].hash = al_sprite_pak_hash(ALLEGRO_SPRITE_PAK_HASH, files[i]);
+		b = entries[i].hash & (header.bucket_count - 1);
+		entries[i].next = buckets[b];
+		buckets[b] = i;
+	}
+
+	for (i = 0; i < n; i++) {
+		entries[i].name = header.names_size;
+		header.names_size += strlen(files[i]) + 1;
+	}
+
+	offset = sizeof(header) + sizeof(uint32_t) * header.bucket_count
+		+ sizeof(ALLEGRO_SPRITE_PAK_ENTRY) * n + header.names_size;
+	for (i = 0; i < n; i++) {
+		in = fopen(files[i], "rb");
+		if (!in || fseek(in, 0, SEEK_END) || (size = ftell(in)) < 0) {
+			fprintf(stderr, "Open file [%s] error!\n", files[i]);
+			if (in)
+				fclose(in);
+			goto exit;
+		}
+		fclose(in);
+		offset = (offset + ALLEGRO_SPRITE_PAK_ALIGN - 1) & ~(uint64_t)(ALLEGRO_SPRITE_PAK_ALIGN - 1);
+		entries[i].offset = offset;
+		entries[i].size = size;
+		offset += size;
+	}
+
+	fp = al_create_sprite_file(filepath, tmp, sizeof(tmp));
+	if (!fp) {
+		fprintf(stderr, "Open file [%s] error!\n", filepath);
+		goto exit;
+	}
+
+	fwrite(&header, sizeof(header), 1, fp);
+	fwrite(buckets, sizeof(uint32_t), header.bucket_count, fp);
+	fwrite(entries, sizeof(ALLEGRO_SPRITE_PAK_ENTRY), n, fp);
+	for (i = 0; i < n; i++)
+		fwrite(files[i], 1, strlen(files[i]) + 1, fp);
+
+	for (i = 0; i < n; i++) {
+		fwrite(zero, 1, entries[i].offset - ftell(fp), fp);
+
+		in = fopen(files[i], "rb");
+		if (!in)
+			goto exit;
+		while ((len = fread(buf, 1, sizeof(buf), in)) > 0)
+			fwrite(buf, 1, len, fp);
+		fclose(in);
+		if ((uint64_t)ftell(fp) != entries[i].offset + entries[i].size) {
+			fprintf(stderr, "File [%s] changed while packing!\n", files[i]);
+			goto exit;
+		}
+	}
+
+	ret = 0;
+
+exit:
+	if (fp && al_commit_sprite_file(fp, tmp, filepath, ret == 0))
+		ret = -1;
+	free(buckets);
+	free(entries);
+	if (ret)
+		ERROR_RETURN(-1);
+	return 0;
+}
+
+/***************************************************************************************/
+/********** Shared Bitmap Cache ********************************************************/
+/***************************************************************************************/
+
+/* All loaded sprite images, keyed by resolved path */
+static ALLEGRO_SPRITE_IMAGE *al_sprite_images = NULL;
+
+/* Guards the image and atlas lists once loader threads exist */
+static ALLEGRO_MUTEX *al_sprite_images_mutex = NULL;
+
+static void al_lock_sprite_images(void)
+{
+	if (al_sprite_images_mutex)
+		al_lock_mutex(al_sprite_images_mutex);
+}
+
+static void al_unlock_sprite_images(void)
+{
+	if (al_sprite_images_mutex)
+		al_unlock_mutex(al_sprite_images_mutex);
+}
+
+/* All atlas pages */
+static ALLEGRO_SPRITE_ATLAS *al_sprite_atlases = NULL;
+
+/* Residency state, hits and misses are only touched by the drawing thread */
+static ALLEGRO_SPRITE_MEMORY_STATS al_sprite_memory;
+static int al_sprite_memory_flags = 0;
+static uint64_t al_sprite_draw_clock = 0; /* Frames, see al_update_sprite_memory() */
+
+static size_t al_sprite_bitmap_size(ALLEGRO_BITMAP *bitmap)
+{
+	return (size_t)al_get_bitmap_width(bitmap) * al_get_bitmap_height(bitmap) * 4;
+}
+
+static void al_release_sprite_atlas(ALLEGRO_SPRITE_ATLAS *atlas)
+{
+	ALLEGRO_SPRITE_ATLAS **p;
+
+	if (--atlas->refs > 0)
+		return;
+
+	for (p = &al_sprite_atlases; *p; p = &(*p)->next) {
+		if (*p == atlas) {
+			*p = atlas->next;
+			break;
+		}
+	}
+
+	if (atlas->bitmap)
+		al_destroy_bitmap(atlas->bitmap);
+	free(atlas->nodes);
+	free(atlas);
+}
+
+/* Look up a cached image and take a reference, called locked */
+static ALLEGRO_SPRITE_IMAGE *al_find_sprite_image(const char *path)
+{
+	ALLEGRO_SPRITE_IMAGE *image;
+
+	for (image = al_sprite_images; image; image = image->next) {
+		if (!strcmp(image->path, path)) {
+			image->refs++;
+			return image;
+		}
+	}
+	return NULL;
+}
+
+static ALLEGRO_SPRITE_IMAGE *al_acquire_sprite_image(const char *filepath)
+{
+	ALLEGRO_SPRITE_IMAGE *image, *other;
+	char *path;
+
+	/* "a/../b.png" and "b.png" must hit the same entry, archive
+	 * entries are only known by their exact name */
+	if (al_find_sprite_pak_entry(al_sprite_pak, NULL, filepath))
+		path = strdup(filepath);
+	else
+		path = realpath(filepath, NULL);
+	if (!path)
+		path = strdup(filepath);
+	if (!path)
+		return NULL;
+
+	al_lock_sprite_images();
+	image = al_find_sprite_image(path);
+	al_unlock_sprite_images();
+	if (image) {
+		free(path);
+		return image;
+	}
+
+	image = calloc(1, sizeof(ALLEGRO_SPRITE_IMAGE));
+	if (!image) {
+		free(path);
+		return NULL;
+	}
+
+	/* Decode unlocked, loader threads decode in parallel */
+	image->bitmap = al_load_sprite_bitmap(path);
+	if (!image->bitmap) {
+		free(path);
+		free(image);
+		return NULL;
+	}
+	image->path = path;
+	image->refs = 1;
+	image->size = al_sprite_bitmap_size(image->bitmap);
+
+	al_lock_sprite_images();
+	other = al_find_sprite_image(path);
+	if (!other) {
+		image->last_use = al_sprite_draw_clock;
+		image->next = al_sprite_images;
+		al_sprite_images = image;
+		al_sprite_memory.resident += image->size;
+	}
+	al_unlock_sprite_images();
+
+	/* Another thread loaded it meanwhile */
+	if (other) {
+		al_destroy_bitmap(image->bitmap);
+		free(image->path);
+		free(image);
+		image = other;
+	}
+	return image;
+}
+
+static void al_release_sprite_image(ALLEGRO_SPRITE_IMAGE *image)
+{
+	ALLEGRO_SPRITE_IMAGE **p;
+
+	al_lock_sprite_images();
+	if (--image->refs > 0) {
+		al_unlock_sprite_images();
+		return;
+	}
+
+	for (p = &al_sprite_images; *p; p = &(*p)->next) {
+		if (*p == image) {
+			*p = image->next;
+			break;
+		}
+	}
+
+	if (image->bitmap) {
+		al_destroy_bitmap(image->bitmap);
+		al_sprite_memory.resident -= image->size;
+	}
+	if (image->backup)
+		al_destroy_bitmap(image->backup);
+	if (image->atlas)
+		al_release_sprite_atlas(image->atlas);
+	al_unlock_sprite_images();
+	free(image->path);
+	free(image);
+}
+
+/* Composites are owned by their tileset, not by the image cache */
+static void al_destroy_flat_image(ALLEGRO_SPRITE_IMAGE *image)
+{
+	al_destroy_bitmap(image->bitmap);
+	free(image);
+}
+
+/* Loaded definitions by file, only the main thread removes them */
+static ALLEGRO_SPRITE_DEF *al_sprite_defs = NULL;
+
+/* Some tileset has flatten_pending set, see al_flatten_pending_tilesets() */
+static bool al_sprite_flatten_pending = false;
+
+static void al_register_sprite_def(ALLEGRO_SPRITE_DEF *def)
+{
+	al_lock_sprite_images();
+	def->next = al_sprite_defs;
+	al_sprite_defs = def;
+	al_unlock_sprite_images();
+}
+
+static void al_unregister_sprite_def(ALLEGRO_SPRITE_DEF *def)
+{
+	ALLEGRO_SPRITE_DEF **p;
+
+	al_lock_sprite_images();
+	for (p = &al_sprite_defs; *p; p = &(*p)->next) {
+		if (*p == def) {
+			*p = def->next;
+			break;
+		}
+	}
+	al_unlock_sprite_images();
+}
+
+/***************************************************************************************/
+/********** Residency ******************************************************************/
+/***************************************************************************************/
+
+/*
+ * With a budget set, al_update_sprite_memory() evicts the least recently
+ * drawn images between frames until the resident bytes fit. Images drawn
+ * in the frame just ended are kept. An evicted image is restored from its
+ * memory copy (ALLEGRO_SPRITE_KEEP_MEMORY_COPY) or reloaded from disk
+ * the next time it is drawn. Atlas pages and flattened composites are
+ * not evicted. Evicting and restoring happen on the drawing thread.
+ */
+
+void al_set_sprite_memory_budget(size_t bytes, int flags)
+{
+	al_sprite_memory.budget = bytes;
+	al_sprite_memory_flags = flags;
+}
+
+void al_get_sprite_memory_stats(ALLEGRO_SPRITE_MEMORY_STATS *stats)
+{
+	al_lock_sprite_images();
+	*stats = al_sprite_memory;
+	al_unlock_sprite_images();
+}
+
+/* Drop the least recently drawn image not drawn this frame, called locked */
+static bool al_evict_sprite_image(void)
+{
+	ALLEGRO_SPRITE_IMAGE *image, *victim = NULL;
+	ALLEGRO_STATE state;
+
+	for (image = al_sprite_images; image; image = image->next) {
+		if (!image->bitmap || image->atlas || image->pins ||
+			image->last_use >= al_sprite_draw_clock)
+			continue;
+		if (!victim || image->last_use < victim->last_use)
+			victim = image;
+	}
+	if (!victim)
+		return false;
+
+	if (al_sprite_memory_flags & ALLEGRO_SPRITE_KEEP_MEMORY_COPY) {
+		/* Move the pixels out of video memory */
+		al_store_state(&state, ALLEGRO_STATE_NEW_BITMAP_PARAMETERS);
+		al_set_new_bitmap_flags(ALLEGRO_MEMORY_BITMAP);
+		al_convert_bitmap(victim->bitmap);
+		al_restore_state(&state);
+		victim->backup = victim->bitmap;
+	} else {
+		al_destroy_bitmap(victim->bitmap);
+	}
+	victim->bitmap = NULL;
+
+	al_sprite_memory.resident -= victim->size;
+	al_sprite_memory.evictions++;
+	return true;
+}
+
+/* Bring an evicted image back, called locked */
+static int al_restore_sprite_image(ALLEGRO_SPRITE_IMAGE *image)
+{
+	if (image->backup) {
+		image->bitmap = image->backup;
+		image->backup = NULL;
+		al_convert_bitmap(image->bitmap);
+	} else {
+		image->bitmap = al_load_sprite_bitmap(image->path);
+		if (!image->bitmap)
+			ERROR_RETURN(-1);
+	}
+
+	al_sprite_memory.resident += image->size;
+	return 0;
+}
+
+/* See Tileset Loading */
+static void al_flatten_pending_tilesets(void);
+
+/*
+ * Evict images until the resident bytes fit the budget and start a new
+ * frame. Call once per frame on the drawing thread with drawing not held,
+ * e.g. after al_flip_display(). Tilesets loaded on other threads are
+ * flattened here too. Returns the number of images evicted.
+ */
+int al_update_sprite_memory(void)
+{
+	int evicted = 0;
+
+	al_flatten_pending_tilesets();
+
+	al_lock_sprite_images();
+	while (al_sprite_memory.budget &&
+			al_sprite_memory.resident > al_sprite_memory.budget) {
+		if (!al_evict_sprite_image())
+			break;
+		evicted++;
+	}
+	al_sprite_draw_clock++;
+	al_unlock_sprite_images();
+	return evicted;
+}
+
+/* Bitmap of an image about to be drawn, NULL if it can't be restored */
+static ALLEGRO_BITMAP *al_use_sprite_image(ALLEGRO_SPRITE_IMAGE *image)
+{
+	bool held;
+
+	image->last_use = al_sprite_draw_clock;
+
+	if (image->bitmap) {
+		al_sprite_memory.hits++;
+		return image->bitmap;
+	}
+	al_sprite_memory.misses++;
+
+	/* Loading isn't allowed while drawing is held, flush the batch */
+	held = al_is_bitmap_drawing_held();
+	if (held)
+		al_hold_bitmap_drawing(false);
+	al_lock_sprite_images();
+	if (!image->bitmap)
+		al_restore_sprite_image(image);
+	al_unlock_sprite_images();
+	if (held)
+		al_hold_bitmap_drawing(true);
+	return image->bitmap;
+}
+
+/***************************************************************************************/
+/********** Texture Atlas **************************************************************/
+/***************************************************************************************/
+
+/* Gap between packed images, keeps filtering from bleeding neighbours in */
+#define ATLAS_PADDING	1
+
+static ALLEGRO_SPRITE_ATLAS *al_create_sprite_atlas(int w, int h)
+{
+	ALLEGRO_SPRITE_ATLAS *atlas;
+
+	atlas = calloc(1, sizeof(ALLEGRO_SPRITE_ATLAS));
+	if (!atlas)
+		return NULL;
+
+	/* Every node is at least one pixel wide */
+	atlas->nodes = malloc(sizeof(ALLEGRO_SPRITE_SKYLINE) * (w + 1));
+	if (!atlas->nodes) {
+		free(atlas);
+		return NULL;
+	}
+
+	atlas->width = w;
+	atlas->height = h;
+	atlas->node_count = 1;
+	atlas->nodes[0].x = 0;
+	atlas->nodes[0].y = 0;
+	atlas->nodes[0].w = w;
+	return atlas;
+}
+
+/* Lowest y a w x h rect can sit at when its left edge is on node i */
+static int al_sprite_skyline_fit(ALLEGRO_SPRITE_ATLAS *atlas, int i, int w, int h)
+{
+	int x = atlas->nodes[i].x;
+	int y = 0;
+	int left = w;
+
+	if (x + w > atlas->width)
+		return -1;
+
+	for (; left > 0 && i < atlas->node_count; i++) {
+		if (atlas->nodes[i].y > y)
+			y = atlas->nodes[i].y;
+		if (y + h > atlas->height)
+			return -1;
+		left -= atlas->nodes[i].w;
+	}
+	return y;
+}
+
+/* Bottom-left skyline packing, returns -1 if the page is full */
+static int al_sprite_skyline_pack(ALLEGRO_SPRITE_ATLAS *atlas,
+				int w, int h, int *px, int *py)
+{
+	int best = -1, best_y = atlas->height, best_w = atlas->width + 1;
+	int i, y, x, right;
+
+	for (i = 0; i < atlas->node_count; i++) {
+		y = al_sprite_skyline_fit(atlas, i, w, h);
+		if (y < 0)
+			continue;
+		if (y < best_y || (y == best_y && atlas->nodes[i].w < best_w)) {
+			best = i;
+			best_y = y;
+			best_w = atlas->nodes[i].w;
+		}
+	}
+	if (best < 0)
+		return -1;
+
+	x = atlas->nodes[best].x;
+	right = x + w;
+
+	/* Insert the new top segment */
+	memmove(&atlas->nodes[best+1], &atlas->nodes[best],
+			sizeof(ALLEGRO_SPRITE_SKYLINE) * (atlas->node_count - best));
+	atlas->node_count++;
+	atlas->nodes[best].x = x;
+	atlas->nodes[best].y = best_y + h;
+	atlas->nodes[best].w = w;
+
+	/* Shrink or drop the segments it covers */
+	for (i = best + 1; i < atlas->node_count; ) {
+		if (atlas->nodes[i].x >= right)
+			break;
+		if (atlas->nodes[i].x + atlas->nodes[i].w <= right) {
+			memmove(&atlas->nodes[i], &atlas->nodes[i+1],
+				sizeof(ALLEGRO_SPRITE_SKYLINE) * (atlas->node_count - i - 1));
+			atlas->node_count--;
+			continue;
+		}
+		atlas->nodes[i].w -= right - atlas->nodes[i].x;
+		atlas->nodes[i].x = right;
+		break;
+	}
+
+	/* Merge neighbours of the same height */
+	for (i = 0; i + 1 < atlas->node_count; ) {
+		if (atlas->nodes[i].y == atlas->nodes[i+1].y) {
+			atlas->nodes[i].w += atlas->nodes[i+1].w;
+			memmove(&atlas->nodes[i+1], &atlas->nodes[i+2],
+				sizeof(ALLEGRO_SPRITE_SKYLINE) * (atlas->node_count - i - 2));
+			atlas->node_count--;
+			continue;
+		}
+		i++;
+	}
+
+	*px = x;
+	*py = best_y;
+	return 0;
+}
+
+typedef struct {
+	ALLEGRO_SPRITE_IMAGE *image;
+	ALLEGRO_SPRITE_ATLAS *atlas;
+	int x;
+	int y;
+} ALLEGRO_SPRITE_ATLAS_SLOT;
+
+static int al_sprite_atlas_slot_cmp(const void *a, const void *b)
+{
+	const ALLEGRO_SPRITE_ATLAS_SLOT *sa = a;
+	const ALLEGRO_SPRITE_ATLAS_SLOT *sb = b;
+
+	/* Tallest first packs a skyline best */
+	return al_get_bitmap_height(sb->image->bitmap) -
+			al_get_bitmap_height(sa->image->bitmap);
+}
+
+/*
+ * Pack every loaded sprite image that is not in an atlas yet into
+ * page_width x page_height atlas pages. Each image bitmap is replaced
+ * by a sub-bitmap of its page, so tiles keep their coordinates and
+ * sprites drawn while bitmap drawing is held batch into one texture.
+ * Returns the number of pages created, or -1 on error.
+ */
+int al_build_sprite_atlas(int page_width, int page_height)
+{
+	ALLEGRO_SPRITE_ATLAS_SLOT *slots;
+	ALLEGRO_SPRITE_ATLAS *pages = NULL, *atlas;
+	ALLEGRO_SPRITE_IMAGE *image;
+	ALLEGRO_BITMAP *sub;
+	ALLEGRO_STATE state;
+	int i, count = 0, page_count = 0;
+	int w, h;
+
+	/* Evicted images stay out */
+	al_lock_sprite_images();
+	for (image = al_sprite_images; image; image = image->next) {
+		if (!image->atlas && image->bitmap)
+			count++;
+	}
+	if (count == 0) {
+		al_unlock_sprite_images();
+		return 0;
+	}
+
+	slots = calloc(count, sizeof(ALLEGRO_SPRITE_ATLAS_SLOT));
+	if (!slots) {
+		al_unlock_sprite_images();
+		ERROR_RETURN(-1);
+	}
+
+	count = 0;
+	for (image = al_sprite_images; image; image = image->next) {
+		if (!image->atlas && image->bitmap)
+			slots[count++].image = image;
+	}
+	qsort(slots, count, sizeof(ALLEGRO_SPRITE_ATLAS_SLOT), al_sprite_atlas_slot_cmp);
+
+	/* Place the images, opening pages as they fill up */
+	for (i = 0; i < count; i++) {
+		w = al_get_bitmap_width(slots[i].image->bitmap) + ATLAS_PADDING;
+		h = al_get_bitmap_height(slots[i].image->bitmap) + ATLAS_PADDING;
+		if (w > page_width || h > page_height)
+			continue; /* Stays a standalone bitmap */
+
+		for (atlas = pages; atlas; atlas = atlas->next) {
+			if (!al_sprite_skyline_pack(atlas, w, h, &slots[i].x, &slots[i].y))
+				break;
+		}
+
+		if (!atlas) {
+			atlas = al_create_sprite_atlas(page_width, page_height);
+			if (!atlas)
+				break;
+			al_sprite_skyline_pack(atlas, w, h, &slots[i].x, &slots[i].y);
+			atlas->next = pages;
+			pages = atlas;
+			page_count++;
+		}
+		slots[i].atlas = atlas;
+	}
+
+	/* Render the pages */
+	al_store_state(&state, ALLEGRO_STATE_TARGET_BITMAP | ALLEGRO_STATE_BLENDER);
+	al_set_blender(ALLEGRO_ADD, ALLEGRO_ONE, ALLEGRO_ZERO);
+	for (atlas = pages; atlas; atlas = atlas->next) {
+		atlas->bitmap = al_create_bitmap(atlas->width, atlas->height);
+		if (!atlas->bitmap)
+			continue;
+		al_set_target_bitmap(atlas->bitmap);
+		al_clear_to_color(al_map_rgba(0, 0, 0, 0));
+	}
+	al_hold_bitmap_drawing(true);
+	for (i = 0; i < count; i++) {
+		atlas = slots[i].atlas;
+		if (!atlas || !atlas->bitmap)
+			continue;
+		al_set_target_bitmap(atlas->bitmap);
+		al_draw_bitmap(slots[i].image->bitmap, slots[i].x, slots[i].y, 0);
+	}
+	al_hold_bitmap_drawing(false);
+	al_restore_state(&state);
+
+	/* Swap the images over to their atlas regions */
+	for (i = 0; i < count; i++) {
+		atlas = slots[i].atlas;
+		if (!atlas || !atlas->bitmap)
+			continue;
+
+		image = slots[i].image;
+		w = al_get_bitmap_width(image->bitmap);
+		h = al_get_bitmap_height(image->bitmap);
+		sub = al_create_sub_bitmap(atlas->bitmap, slots[i].x, slots[i].y, w, h);
+		if (!sub)
+			continue;
+
+		al_destroy_bitmap(image->bitmap);
+		image->bitmap = sub;
+		image->atlas = atlas;
+		atlas->refs++;
+	}
+
+	/* Hand the pages over to the images using them */
+	while (pages) {
+		atlas = pages;
+		pages = pages->next;
+		free(atlas->nodes);
+		atlas->nodes = NULL;
+		if (atlas->refs == 0) {
+			if (atlas->bitmap)
+				al_destroy_bitmap(atlas->bitmap);
+			free(atlas);
+			page_count--;
+			continue;
+		}
+		atlas->next = al_sprite_atlases;
+		al_sprite_atlases = atlas;
+	}
+	al_unlock_sprite_images();
+
+	free(slots);
+	return page_count;
+}
+
+void al_dump_sprite(ALLEGRO_SPRITE *s)
+{
+	if (!s)
+		return;
+
+	printf("Sprite: pos (%d, %d)\n", s->x, s->y);
+	al_dump_sprite_def(s->def);
+}
+
+void al_dump_sprite_def(ALLEGRO_SPRITE_DEF *def)
+{
+	int i, j, t;
+
+	if (!def)
+		return;
+
+	printf("Sprite definition: %d tilesets.\n", def->tileset_count);
+
+	for (i = 0; i < def->tileset_count; i++) {
+		printf("\nTileset %2d: %d layers\n", i+1, def->tilesets[i].layer_count);
+		for (j = 0; j < def->tilesets[i].layer_count; j++) {
+			printf("\tLayer %2d: %d tiles\n", j+1, def->tilesets[i].layers[j].tile_count);
+			printf("\t\tImage file:   %s\n", def->tilesets[i].layers[j].image_file);
+			printf("\t\tImage Width:  %4d\n", def->tilesets[i].layers[j].image_width);
+			printf("\t\tImage Height: %4d\n", def->tilesets[i].layers[j].image_height);
+			printf("\t\tTile width:   %4d\n", def->tilesets[i].layers[j].tile_width);
+			printf("\t\tTile height:  %4d\n", def->tilesets[i].layers[j].tile_height);
+			printf("\t\tTile %2d:\n", j+1);
+			for (t = 0; t < def->tilesets[i].layers[j].tile_count; t++) {
+				printf("\t\t\t\t%02d: %4d, %4d\n", t+1,
+						def->tilesets[i].layers[j].tiles[t].x,
+						def->tilesets[i].layers[j].tiles[t].y);
+			}
+		}
+	}
+	printf("\n");
+}
+
+void al_destroy_sprite_def(ALLEGRO_SPRITE_DEF *def)
+{
+	ALLEGRO_SPRITE_DEF *reloaded;
+	int i, j;
+
+	if (!def || --def->refs > 0)
+		return;
+
+	al_unregister_sprite_def(def);
+
+	for (i = 0; i < def->tileset_count; i++) {
+		if (def->tilesets[i].flat)
+			al_destroy_flat_image(def->tilesets[i].flat);
+
+		if (!def->tilesets[i].layers)
+			continue;
+
+		for (j = 0; j < def->tilesets[i].layer_count; j++) {
+			if (def->tilesets[i].layers[j].image)
+				al_release_sprite_image(def->tilesets[i].layers[j].image);
+		}
+	}
+
+	if (def->map_base)
+		munmap(def->map_base, def->map_size);
+
+	/* Tables and strings live in the same block */
+	reloaded = def->reloaded;
+	free(def);
+	al_destroy_sprite_def(reloaded);
+}
+
+ALLEGRO_SPRITE *al_create_sprite_instance(ALLEGRO_SPRITE_DEF *def)
+{
+	ALLEGRO_SPRITE *s;
+
+	if (!def)
+		return NULL;
+
+	s = calloc(1, sizeof(ALLEGRO_SPRITE));
+	if (!s)
+		return NULL;
+
+	while (def->reloaded)
+		def = def->reloaded;
+	def->refs++;
+	s->def = def;
+	return s;
+}
+
+int al_destroy_sprite(ALLEGRO_SPRITE *s)
+{
+	if (!s)
+		return -1;
+
+	al_destroy_sprite_def(s->def);
+	free(s);
+	return 0;
+}
+
+/* Wrap a freshly loaded definition in a single sprite that owns it */
+static ALLEGRO_SPRITE *al_create_sprite_owner(ALLEGRO_SPRITE_DEF *def)
+{
+	ALLEGRO_SPRITE *s;
+
+	if (!def)
+		return NULL;
+
+	s = al_create_sprite_instance(def);
+	al_destroy_sprite_def(def);
+	return s;
+}
+
+
+/***************************************************************************************/
+/********** Sprite Arena ***************************************************************/
+/***************************************************************************************/
+
+/*
+ * A definition is allocated as a single block, sized by a first pass
+ * over the descriptor:
+ *
+ *   ALLEGRO_SPRITE_DEF | tilesets | layers | tiles | frames | dir, image files
+ *
+ * Each piece is 8 byte aligned. Layers, tiles, frames and strings are
+ * handed out from their own region, so the layers of a tileset and the
+ * tiles of a layer stay contiguous however the descriptor orders them.
+ */
+
+#define ARENA_ALIGN(x)	(((x) + 7) & ~(size_t)7)
+
+typedef struct {
+	int tileset_count;
+	int layer_count;
+	int tile_count;
+	int frame_count; /* Entries of all frame tables */
+	size_t string_size; /* Aligned size of all strings */
+} ALLEGRO_SPRITE_SIZE;
+
+typedef struct {
+	char *next;
+	char *end;
+} ALLEGRO_SPRITE_ARENA;
+
+enum {
+	ARENA_LAYERS = 0,
+	ARENA_TILES,
+	ARENA_FRAMES,
+	ARENA_STRINGS,
+	ARENA_COUNT
+};
+
+static void al_sprite_size_string(ALLEGRO_SPRITE_SIZE *size, const char *str)
+{
+	size->string_size += ARENA_ALIGN(strlen(str) + 1);
+}
+
+static void *al_sprite_arena_alloc(ALLEGRO_SPRITE_ARENA *arena, size_t size)
+{
+	char *p = arena->next;
+
+	size = ARENA_ALIGN(size);
+	if (size > (size_t)(arena->end - p))
+		return NULL;
+	arena->next += size;
+	return p;
+}
+
+static char *al_sprite_arena_strdup(ALLEGRO_SPRITE_ARENA *arena, const char *str)
+{
+	char *p = al_sprite_arena_alloc(arena, strlen(str) + 1);
+
+	if (p)
+		strcpy(p, str);
+	return p;
+}
+
+/*
+ * Layers may have different frame counts, the table covers all their
+ * combinations. Counters never reach ALLEGRO_SPRITE_COUNTER_MAX, so
+ * the table never needs more frames than that.
+ */
+static int al_sprite_frame_count(int frames, int layer_frames)
+{
+	int a = frames, b = layer_frames, t;
+
+	while (b) {
+		t = a % b;
+		a = b;
+		b = t;
+	}
+
+	if ((long)frames / a * layer_frames > ALLEGRO_SPRITE_COUNTER_MAX)
+		return ALLEGRO_SPRITE_COUNTER_MAX;
+	return frames / a * layer_frames;
+}
+
+/* Room for the layer frames and the flattened frames */
+static void al_sprite_size_frames(ALLEGRO_SPRITE_SIZE *size, int frames, int layers)
+{
+	size->frame_count += 4 * frames * (layers + 1);
+}
+
+/* Allocate the frame tables of a tileset once its layers are parsed */
+static int al_build_sprite_frames(ALLEGRO_SPRITE_ARENA *arena, ALLEGRO_SPRITE_TILESET *tileset)
+{
+	ALLEGRO_SPRITE_FRAME *frame;
+	int i, count = 1;
+
+	for (i = 0; i < tileset->layer_count; i++)
+		count = al_sprite_frame_count(count, tileset->layers[i].tile_count / 4);
+
+	frame = al_sprite_arena_alloc(arena,
+				sizeof(ALLEGRO_SPRITE_FRAME) * 4 * count * tileset->layer_count);
+	if (!frame && tileset->layer_count)
+		ERROR_RETURN(-1);
+	tileset->frames = frame;
+	tileset->frame_count = count;
+
+	tileset->flat_frames = al_sprite_arena_alloc(arena, sizeof(ALLEGRO_SPRITE_FRAME) * 4 * count);
+	if (!tileset->flat_frames)
+		ERROR_RETURN(-1);
+	return 0;
+}
+
+/* Fill the frame table, again whenever layer images change */
+static void al_fill_sprite_frames(ALLEGRO_SPRITE_TILESET *tileset)
+{
+	ALLEGRO_SPRITE_TILE_LAYER *layer;
+	ALLEGRO_SPRITE_FRAME *frame = tileset->frames;
+	ALLEGRO_SPRITE_TILE *tile;
+	int d, f, i, count = tileset->frame_count;
+
+	for (d = 0; d < 4; d++) {
+		for (f = 0; f < count; f++) {
+			for (i = 0; i < tileset->layer_count; i++, frame++) {
+				layer = &tileset->layers[i];
+				tile = &layer->tiles[d * layer->tile_count / 4 + f % (layer->tile_count / 4)];
+				frame->image = layer->image;
+				frame->sx = tile->x;
+				frame->sy = tile->y;
+				frame->sw = layer->tile_width;
+				frame->sh = layer->tile_height;
+			}
+		}
+	}
+}
+
+/* Allocate a zeroed definition with room for all its tables */
+static ALLEGRO_SPRITE_DEF *al_create_sprite_def(ALLEGRO_SPRITE_SIZE *size,
+				const char *dir, const char *filename,
+				ALLEGRO_SPRITE_ARENA arena[ARENA_COUNT])
+{
+	ALLEGRO_SPRITE_DEF *def;
+	size_t region[ARENA_COUNT];
+	size_t bytes;
+	char *p;
+	int i;
+
+	al_sprite_size_string(size, dir);
+	al_sprite_size_string(size, filename);
+	region[ARENA_LAYERS] = sizeof(ALLEGRO_SPRITE_TILE_LAYER) * size->layer_count;
+	region[ARENA_TILES] = sizeof(ALLEGRO_SPRITE_TILE) * size->tile_count;
+	region[ARENA_FRAMES] = sizeof(ALLEGRO_SPRITE_FRAME) * size->frame_count;
+	region[ARENA_STRINGS] = size->string_size;
+
+	bytes = ARENA_ALIGN(sizeof(ALLEGRO_SPRITE_DEF))
+		+ ARENA_ALIGN(sizeof(ALLEGRO_SPRITE_TILESET) * size->tileset_count);
+	for (i = 0; i < ARENA_COUNT; i++)
+		bytes += ARENA_ALIGN(region[i]);
+
+	def = calloc(1, bytes);
+	if (!def)
+		return NULL;
+
+	p = (char *)def + ARENA_ALIGN(sizeof(ALLEGRO_SPRITE_DEF));
+	def->refs = 1;
+	def->tileset_count = size->tileset_count;
+	def->tilesets = (ALLEGRO_SPRITE_TILESET *)p;
+	p += ARENA_ALIGN(sizeof(ALLEGRO_SPRITE_TILESET) * size->tileset_count);
+
+	for (i = 0; i < ARENA_COUNT; i++) {
+		arena[i].next = p;
+		arena[i].end = p + region[i];
+		p += ARENA_ALIGN(region[i]);
+	}
+
+	def->dir = al_sprite_arena_strdup(&arena[ARENA_STRINGS], dir);
+	def->file = al_sprite_arena_strdup(&arena[ARENA_STRINGS], filename);
+	return def;
+}
+
+/***************************************************************************************/
+/********** Layer Flattening ***********************************************************/
+/***************************************************************************************/
+
+/* Flags of the definitions loaded from now on */
+static int al_new_sprite_flags = 0;
+
+void al_set_new_sprite_flags(int flags)
+{
+	al_new_sprite_flags = flags;
+}
+
+int al_get_new_sprite_flags(void)
+{
+	return al_new_sprite_flags;
+}
+
+/* Widest bitmap a flattened tileset wraps its frames at */
+#define FLATTEN_MAX_WIDTH	2048
+
+/* Draw the layers of every frame of a tileset into one bitmap */
+static int al_flatten_sprite_tileset(ALLEGRO_SPRITE_TILESET *tileset)
+{
+	ALLEGRO_SPRITE_IMAGE *flat;
+	ALLEGRO_SPRITE_FRAME *frame, *out;
+	ALLEGRO_STATE state;
+	int w = 0, h = 0;
+	int count, cols, rows;
+	int i, j;
+	bool held;
+
+	/* Nothing to save on a single layer */
+	if (tileset->layer_count < 2)
+		return 0;
+
+	for (i = 0; i < tileset->layer_count; i++) {
+		if (tileset->layers[i].tile_width > w)
+			w = tileset->layers[i].tile_width;
+		if (tileset->layers[i].tile_height > h)
+			h = tileset->layers[i].tile_height;
+	}
+	if (w <= 0 || h <= 0)
+		ERROR_RETURN(-1);
+
+	count = 4 * tileset->frame_count;
+	cols = FLATTEN_MAX_WIDTH / w;
+	if (cols < 1)
+		cols = 1;
+	if (cols > count)
+		cols = count;
+	rows = (count + cols - 1) / cols;
+
+	flat = calloc(1, sizeof(ALLEGRO_SPRITE_IMAGE));
+	if (!flat)
+		ERROR_RETURN(-1);
+	flat->refs = 1;
+	flat->bitmap = al_create_bitmap(cols * w, rows * h);
+	if (!flat->bitmap) {
+		free(flat);
+		ERROR_RETURN(-1);
+	}
+
+	/* May run mid frame, flush the caller's held drawing to its target
+	 * first and hold it again when done */
+	held = al_is_bitmap_drawing_held();
+	if (held)
+		al_hold_bitmap_drawing(false);
+
+	al_store_state(&state, ALLEGRO_STATE_TARGET_BITMAP | ALLEGRO_STATE_BLENDER);
+	al_set_target_bitmap(flat->bitmap);
+	al_clear_to_color(al_map_rgba(0, 0, 0, 0));
+	al_set_blender(ALLEGRO_ADD, ALLEGRO_ONE, ALLEGRO_INVERSE_ALPHA);
+
+	/* Evicted layers are loaded before holding, loading isn't allowed
+	 * while drawing is held */
+	al_lock_sprite_images();
+	for (i = 0; i < count * tileset->layer_count; i++) {
+		if (!tileset->frames[i].image->bitmap)
+			al_restore_sprite_image(tileset->frames[i].image);
+	}
+
+	/* Layers stack in the order al_draw_sprite() draws them */
+	al_hold_bitmap_drawing(true);
+	frame = tileset->frames;
+	out = tileset->flat_frames;
+	for (i = 0; i < count; i++, out++) {
+		out->image = flat;
+		out->sx = (i % cols) * w;
+		out->sy = (i / cols) * h;
+		out->sw = w;
+		out->sh = h;
+		for (j = 0; j < tileset->layer_count; j++, frame++) {
+			if (!frame->image->bitmap)
+				continue;
+			al_draw_bitmap_region(frame->image->bitmap,
+					frame->sx, frame->sy, frame->sw, frame->sh,
+					out->sx, out->sy, 0);
+		}
+	}
+	al_hold_bitmap_drawing(false);
+	al_unlock_sprite_images();
+	al_restore_state(&state);
+	if (held)
+		al_hold_bitmap_drawing(true);
+
+	if (tileset->flat)
+		al_destroy_flat_image(tileset->flat);
+	tileset->flat = flat;
+	return 0;
+}
+
+/*
+ * Composite each layered tileset into one bitmap, so a sprite is drawn
+ * with one blit instead of one per layer. Call again to rebuild after
+ * changing layers.
+ */
+int al_flatten_sprite_def(ALLEGRO_SPRITE_DEF *def)
+{
+	int i;
+
+	if (!def)
+		ERROR_RETURN(-1);
+
+	/* Tilesets not loaded yet are flattened when they are */
+	def->flags |= ALLEGRO_SPRITE_FLATTEN;
+	for (i = 0; i < def->tileset_count; i++) {
+		if (!def->tilesets[i].loaded)
+			continue;
+		if (al_flatten_sprite_tileset(&def->tilesets[i]))
+			ERROR_RETURN(-1);
+	}
+	return 0;
+}
+
+/***************************************************************************************/
+/********** Tileset Loading ************************************************************/
+/***************************************************************************************/
+
+static int al_load_sprite_layer_bitmap(ALLEGRO_SPRITE_DEF *def,
+				ALLEGRO_SPRITE_TILE_LAYER *layer)
+{
+	char *path;
+
+	path = malloc(strlen(def->dir)+strlen(layer->image_file)+10);
+	if (!path)
+		ERROR_RETURN(-1);
+	sprintf(path, "%s/%s", def->dir, layer->image_file);
+	layer->image = al_acquire_sprite_image(path);
+	if (!layer->image) {
+		free(path);
+		ERROR_RETURN(-1);
+	}
+	free(path);
+	return 0;
+}
+
+/*
+ * Acquire the images of a tileset. Tilesets of ALLEGRO_SPRITE_LAZY
+ * definitions stay unloaded until an action first selects them.
+ */
+static int al_load_sprite_tileset(ALLEGRO_SPRITE_DEF *def, int tileset_id)
+{
+	ALLEGRO_SPRITE_TILESET *tileset;
+	int i;
+
+	if (tileset_id < 0 || tileset_id >= def->tileset_count)
+		ERROR_RETURN(-1);
+
+	tileset = &def->tilesets[tileset_id];
+	if (tileset->loaded)
+		return 0;
+
+	for (i = 0; i < tileset->layer_count; i++) {
+		if (tileset->layers[i].image)
+			continue;
+		if (al_load_sprite_layer_bitmap(def, &tileset->layers[i]))
+			ERROR_RETURN(-1);
+	}
+	al_fill_sprite_frames(tileset);
+	tileset->loaded = true;
+
+	if (!(def->flags & ALLEGRO_SPRITE_FLATTEN))
+		return 0;
+
+	/* Compositing draws video bitmaps, leave it to the display thread */
+	if (!al_get_current_display()) {
+		al_lock_sprite_images();
+		tileset->flatten_pending = true;
+		al_sprite_flatten_pending = true;
+		al_unlock_sprite_images();
+		return 0;
+	}
+
+	/* Layered drawing still works if this fails */
+	al_flatten_sprite_tileset(tileset);
+	return 0;
+}
+
+/* Tilesets of def waiting to be flattened, stored to pending if not NULL */
+static int al_find_pending_tilesets(ALLEGRO_SPRITE_DEF *def,
+				ALLEGRO_SPRITE_TILESET **pending)
+{
+	int i, n = 0;
+
+	for (i = 0; i < def->tileset_count; i++) {
+		if (!def->tilesets[i].flatten_pending)
+			continue;
+		if (pending) {
+			def->tilesets[i].flatten_pending = false;
+			pending[n] = &def->tilesets[i];
+		}
+		n++;
+	}
+	return n;
+}
+
+/*
+ * Flatten the tilesets loader and watcher threads left pending, on the
+ * display thread. Same pattern as al_swap_sprite_image(): collect them
+ * locked, flatten unlocked.
+ */
+static void al_flatten_pending_tilesets(void)
+{
+	ALLEGRO_SPRITE_TILESET **pending = NULL;
+	ALLEGRO_SPRITE_DEF *def;
+	int i, n = 0;
+
+	al_lock_sprite_images();
+	if (!al_sprite_flatten_pending) {
+		al_unlock_sprite_images();
+		return;
+	}
+	for (def = al_sprite_defs; def; def = def->next)
+		n += al_find_pending_tilesets(def, NULL);
+	if (n > 0)
+		pending = malloc(sizeof(ALLEGRO_SPRITE_TILESET *) * n);
+	/* Retried next frame if out of memory */
+	al_sprite_flatten_pending = n > 0 && !pending;
+	n = 0;
+	for (def = al_sprite_defs; pending && def; def = def->next)
+		n += al_find_pending_tilesets(def, pending + n);
+	al_unlock_sprite_images();
+
+	for (i = 0; i < n; i++)
+		al_flatten_sprite_tileset(pending[i]);
+	free(pending);
+}
+
+/* Load what the flags of a freshly parsed definition ask for */
+static int al_load_sprite_tilesets(ALLEGRO_SPRITE_DEF *def, int flags)
+{
+	int i;
+
+	def->flags = flags;
+	if (flags & ALLEGRO_SPRITE_LAZY)
+		return 0;
+
+	for (i = 0; i < def->tileset_count; i++) {
+		if (al_load_sprite_tileset(def, i))
+			ERROR_RETURN(-1);
+	}
+	return 0;
+}
+
+/*
+ * Swap the image of a layer, e.g. to change equipment. The image is
+ * relative to the sprite directory and must use the same tile layout.
+ * A flattened tileset is rebuilt. al_save_sprite_binary() still saves
+ * the original image file.
+ */
+int al_set_sprite_layer_image(ALLEGRO_SPRITE_DEF *def, int tileset_id,
+				int layer_id, const char *filename)
+{
+	ALLEGRO_SPRITE_TILESET *tileset;
+	ALLEGRO_SPRITE_IMAGE *image, *old;
+	char *path;
+
+	if (!def || tileset_id < 0 || tileset_id >= def->tileset_count)
+		ERROR_RETURN(-1);
+	tileset = &def->tilesets[tileset_id];
+	if (layer_id < 0 || layer_id >= tileset->layer_count)
+		ERROR_RETURN(-1);
+	if (al_load_sprite_tileset(def, tileset_id))
+		ERROR_RETURN(-1);
+
+	path = malloc(strlen(def->dir)+strlen(filename)+10);
+	if (!path)
+		ERROR_RETURN(-1);
+	sprintf(path, "%s/%s", def->dir, filename);
+	image = al_acquire_sprite_image(path);
+	free(path);
+	if (!image)
+		ERROR_RETURN(-1);
+
+	old = tileset->layers[layer_id].image;
+	tileset->layers[layer_id].image = image;
+	al_fill_sprite_frames(tileset);
+	al_release_sprite_image(old);
+
+	if (tileset->flat)
+		return al_flatten_sprite_tileset(tileset);
+	return 0;
+}
+
+/* Bytes of the bitmaps a definition keeps loaded, shared images included */
+size_t al_get_sprite_def_resident_size(ALLEGRO_SPRITE_DEF *def)
+{
+	ALLEGRO_SPRITE_TILESET *tileset;
+	ALLEGRO_SPRITE_IMAGE *image;
+	size_t size = 0;
+	int i, j, k, l;
+	bool seen;
+
+	if (!def)
+		return 0;
+
+	for (i = 0; i < def->tileset_count; i++) {
+		tileset = &def->tilesets[i];
+		if (!tileset->loaded)
+			continue;
+
+		if (tileset->flat)
+			size += al_sprite_bitmap_size(tileset->flat->bitmap);
+
+		for (j = 0; j < tileset->layer_count; j++) {
+			image = tileset->layers[j].image;
+
+			/* Count an image once even if several layers use it */
+			seen = false;
+			for (k = 0; k <= i && !seen; k++) {
+				if (!def->tilesets[k].loaded)
+					continue;
+				for (l = 0; l < def->tilesets[k].layer_count; l++) {
+					if (k == i && l == j)
+						break;
+					if (def->tilesets[k].layers[l].image == image) {
+						seen = true;
+						break;
+					}
+				}
+			}
+			if (seen)
+				continue;
+
+			if (image->bitmap)
+				size += image->size;
+		}
+	}
+	return size;
+}
+
+size_t al_get_sprite_resident_size(ALLEGRO_SPRITE *s)
+{
+	if (!s)
+		return 0;
+	return al_get_sprite_def_resident_size(s->def);
+}
+
+/***************************************************************************************/
+/********** Parse Sprite Data From JSON File *******************************************/
+/***************************************************************************************/
+
+/*
+ * Streaming reader for the JSON sprite descriptor:
+ *
+ *   { "<tileset>": { "layers": [ {
+ *       "image": { "file": "a.png", "size": {"w": 272, "h": 256} },
+ *       "tiles": { "count": 8, "size": {"w": 16, "h": 32},
+ *                  "face_down": [ {"x": 0, "y": 0}, ... ], "face_up": ...,
+ *                  "face_right": ..., "face_left": ... } }, ... ] }, ... }
+ *
+ * The file is read twice through a fixed buffer, the first pass sizes
+ * the definition and the second fills it, writing tiles straight into
+ * their arrays. Memory use doesn't depend on the file size. Unknown
+ * keys are skipped.
+ */
+
+#define JSON_BUFFER_SIZE	4096
+#define JSON_KEY_SIZE		32
+#define JSON_NUMBER_SIZE	32
+
+typedef struct {
+	ALLEGRO_FILE *fp;
+	char buf[JSON_BUFFER_SIZE];
+	size_t pos;
+	size_t len;
+	int line;
+
+	/* Sizing pass */
+	ALLEGRO_SPRITE_SIZE *size;
+
+	/* Filling pass */
+	ALLEGRO_SPRITE_DEF *def;
+	ALLEGRO_SPRITE_ARENA *arena;
+	int tileset_id;
+} ALLEGRO_SPRITE_JSON;
+
+/* Tileset being read */
+typedef struct {
+	ALLEGRO_SPRITE_TILESET *tileset;
+	int layer_count;
+	int frames;
+} ALLEGRO_SPRITE_JSON_TILESET;
+
+/* Layer being read, faces are stored in file order until its end */
+typedef struct {
+	ALLEGRO_SPRITE_TILE_LAYER *layer;
+	ALLEGRO_SPRITE_TILE *tiles;
+	ALLEGRO_SPRITE_TILE tile;
+	bool has_file;
+	int image_width;
+	int image_height;
+	int count;
+	int tile_width;
+	int tile_height;
+	int face_count;
+	int face_order[4];
+	int face_size[4];
+} ALLEGRO_SPRITE_JSON_LAYER;
+
+static const char *al_json_face_name[4] = {
+	"face_down",
+	"face_up",
+	"face_right",
+	"face_left",
+};
+
+static int al_json_getc(ALLEGRO_SPRITE_JSON *j)
+{
+	int c;
+
+	if (j->pos == j->len) {
+		j->len = al_fread(j->fp, j->buf, sizeof(j->buf));
+		j->pos = 0;
+		if (j->len == 0)
+			return EOF;
+	}
+	c = (unsigned char)j->buf[j->pos++];
+	if (c == '\n')
+		j->line++;
+	return c;
+}
+
+/* Push back the last character read, never EOF */
+static void al_json_ungetc(ALLEGRO_SPRITE_JSON *j)
+{
+	j->pos--;
+	if (j->buf[j->pos] == '\n')
+		j->line--;
+}
+
+/* Next character that isn't white space */
+static int al_json_next(ALLEGRO_SPRITE_JSON *j)
+{
+	int c;
+
+	do {
+		c = al_json_getc(j);
+	} while (c == ' ' || c == '\t' || c == '\r' || c == '\n');
+	return c;
+}
+
+static int al_json_expect(ALLEGRO_SPRITE_JSON *j, int ch)
+{
+	if (al_json_next(j) != ch)
+		ERROR_RETURN(-1);
+	return 0;
+}
+
+static void al_json_put(char *out, size_t max, size_t *len, int c)
+{
+	if (out && *len + 1 < max)
+		out[*len] = c;
+	(*len)++;
+}
+
+/*
+ * Read a string whose opening quote was consumed. Up to max - 1 bytes
+ * are stored in out, *len gets the full length.
+ */
+static int al_json_string(ALLEGRO_SPRITE_JSON *j, char *out, size_t max, size_t *len)
+{
+	unsigned int u;
+	int c, i;
+
+	*len = 0;
+	while ((c = al_json_getc(j)) != '"') {
+		if (c == EOF || c < 0x20)
+			ERROR_RETURN(-1);
+
+		if (c == '\\') {
+			c = al_json_getc(j);
+			switch (c) {
+				case '"': case '\\': case '/':
+					break;
+				case 'b': c = '\b'; break;
+				case 'f': c = '\f'; break;
+				case 'n': c = '\n'; break;
+				case 'r': c = '\r'; break;
+				case 't': c = '\t'; break;
+				case 'u':
+					u = 0;
+					for (i = 0; i < 4; i++) {
+						c = al_json_getc(j);
+						if (c >= '0' && c <= '9')
+							u = u * 16 + c - '0';
+						else if (c >= 'a' && c <= 'f')
+							u = u * 16 + c - 'a' + 10;
+						else if (c >= 'A' && c <= 'F')
+							u = u * 16 + c - 'A' + 10;
+						else
+							ERROR_RETURN(-1);
+					}
+
+					/* UTF-8, surrogates are not paired */
+					if (u < 0x80) {
+						c = u;
+					} else if (u < 0x800) {
+						al_json_put(out, max, len, 0xc0 | (u >> 6));
+						c = 0x80 | (u & 0x3f);
+					} else {
+						al_json_put(out, max, len, 0xe0 | (u >> 12));
+						al_json_put(out, max, len, 0x80 | ((u >> 6) & 0x3f));
+						c = 0x80 | (u & 0x3f);
+					}
+					break;
+				default:
+					ERROR_RETURN(-1);
+			}
+		}
+		al_json_put(out, max, len, c);
+	}
+
+	if (out && max > 0)
+		out[*len < max ? *len : max - 1] = '\0';
+	return 0;
+}
+
+static int al_json_number(ALLEGRO_SPRITE_JSON *j, int *value)
+{
+	char buf[JSON_NUMBER_SIZE];
+	char *end;
+	double d;
+	int c, n = 0;
+
+	c = al_json_next(j);
+	while ((c >= '0' && c <= '9') || c == '-' || c == '+' ||
+			c == '.' || c == 'e' || c == 'E') {
+		if (n == sizeof(buf) - 1)
+			ERROR_RETURN(-1);
+		buf[n++] = c;
+		c = al_json_getc(j);
+	}
+	if (c != EOF)
+		al_json_ungetc(j);
+	buf[n] = '\0';
+
+	d = strtod(buf, &end);
+	if (n == 0 || *end != '\0' || d < INT_MIN || d > INT_MAX)
+		ERROR_RETURN(-1);
+	*value = (int)d;
+	return 0;
+}
+
+/* Skip any value, nesting is tracked with a counter, not recursion */
+static int al_json_skip(ALLEGRO_SPRITE_JSON *j)
+{
+	size_t len;
+	int depth = 0;
+	int c;
+
+	do {
+		c = al_json_next(j);
+		switch (c) {
+			case '{': case '[':
+				depth++;
+				break;
+			case '}': case ']':
+				if (--depth < 0)
+					ERROR_RETURN(-1);
+				break;
+			case ',': case ':':
+				if (depth == 0)
+					ERROR_RETURN(-1);
+				break;
+			case '"':
+				if (al_json_string(j, NULL, 0, &len))
+					ERROR_RETURN(-1);
+				break;
+			case EOF:
+				ERROR_RETURN(-1);
+			default:
+				/* Number or literal */
+				while (c != EOF && !strchr(",:]} \t\r\n", c))
+					c = al_json_getc(j);
+				if (c != EOF)
+					al_json_ungetc(j);
+				break;
+		}
+	} while (depth > 0);
+	return 0;
+}
+
+/* Read an object, member() reads the value of each key */
+static int al_json_object(ALLEGRO_SPRITE_JSON *j,
+			int (*member)(ALLEGRO_SPRITE_JSON *, const char *, void *), void *data)
+{
+	char key[JSON_KEY_SIZE];
+	size_t len;
+	int c;
+
+	if (al_json_expect(j, '{'))
+		ERROR_RETURN(-1);
+
+	c = al_json_next(j);
+	if (c == '}')
+		return 0;
+
+	while (1) {
+		if (c != '"' || al_json_string(j, key, sizeof(key), &len))
+			ERROR_RETURN(-1);
+
+		/* Too long to be a known key */
+		if (len >= sizeof(key))
+			key[0] = '\0';
+
+		if (al_json_expect(j, ':') || member(j, key, data))
+			ERROR_RETURN(-1);
+
+		c = al_json_next(j);
+		if (c == '}')
+			return 0;
+		if (c != ',')
+			ERROR_RETURN(-1);
+		c = al_json_next(j);
+	}
+}
+
+/* Read an array, element() reads each value */
+static int al_json_array(ALLEGRO_SPRITE_JSON *j,
+			int (*element)(ALLEGRO_SPRITE_JSON *, void *), void *data)
+{
+	int c;
+
+	if (al_json_expect(j, '['))
+		ERROR_RETURN(-1);
+
+	c = al_json_next(j);
+	if (c == ']')
+		return 0;
+	if (c != EOF)
+		al_json_ungetc(j);
+
+	while (1) {
+		if (element(j, data))
+			ERROR_RETURN(-1);
+
+		c = al_json_next(j);
+		if (c == ']')
+			return 0;
+		if (c != ',')
+			ERROR_RETURN(-1);
+	}
+}
+
+/* {"w": .., "h": ..} and {"x": .., "y": ..} */
+static int al_json_pair_member(ALLEGRO_SPRITE_JSON *j, const char *key, void *data)
+{
+	int *pair = data;
+
+	if (!strcmp(key, "w") || !strcmp(key, "x"))
+		return al_json_number(j, &pair[0]);
+	if (!strcmp(key, "h") || !strcmp(key, "y"))
+		return al_json_number(j, &pair[1]);
+	return al_json_skip(j);
+}
+
+static int al_json_pair(ALLEGRO_SPRITE_JSON *j, int *a, int *b)
+{
+	int pair[2] = {0, 0};
+
+	if (al_json_object(j, al_json_pair_member, pair))
+		ERROR_RETURN(-1);
+	*a = pair[0];
+	*b = pair[1];
+	return 0;
+}
+
+static int al_json_tile(ALLEGRO_SPRITE_JSON *j, void *data)
+{
+	ALLEGRO_SPRITE_JSON_LAYER *l = data;
+	ALLEGRO_SPRITE_TILE *tile;
+
+	if (al_json_pair(j, &l->tile.x, &l->tile.y))
+		ERROR_RETURN(-1);
+
+	if (j->def) {
+		tile = al_sprite_arena_alloc(&j->arena[ARENA_TILES], sizeof(ALLEGRO_SPRITE_TILE));
+		if (!tile)
+			ERROR_RETURN(-1);
+		*tile = l->tile;
+	}
+	l->face_size[l->face_count - 1]++;
+	return 0;
+}
+
+static int al_json_image_member(ALLEGRO_SPRITE_JSON *j, const char *key, void *data)
+{
+	ALLEGRO_SPRITE_JSON_LAYER *l = data;
+	ALLEGRO_SPRITE_ARENA *strings;
+	size_t len;
+
+	if (!strcmp(key, "size"))
+		return al_json_pair(j, &l->image_width, &l->image_height);
+	if (strcmp(key, "file"))
+		return al_json_skip(j);
+
+	if (l->has_file || al_json_expect(j, '"'))
+		ERROR_RETURN(-1);
+	l->has_file = true;
+
+	if (!j->def) {
+		if (al_json_string(j, NULL, 0, &len))
+			ERROR_RETURN(-1);
+		j->size->string_size += ARENA_ALIGN(len + 1);
+		return 0;
+	}
+
+	/* Read the name straight into the string region */
+	strings = &j->arena[ARENA_STRINGS];
+	if (al_json_string(j, strings->next, strings->end - strings->next, &len) ||
+		len + 1 > (size_t)(strings->end - strings->next))
+		ERROR_RETURN(-1);
+	l->layer->image_file = al_sprite_arena_alloc(strings, len + 1);
+	return 0;
+}
+
+static int al_json_tiles_member(ALLEGRO_SPRITE_JSON *j, const char *key, void *data)
+{
+	ALLEGRO_SPRITE_JSON_LAYER *l = data;
+	int i, face = -1;
+
+	if (!strcmp(key, "count"))
+		return al_json_number(j, &l->count);
+	if (!strcmp(key, "size"))
+		return al_json_pair(j, &l->tile_width, &l->tile_height);
+
+	for (i = 0; i < 4; i++) {
+		if (!strcmp(key, al_json_face_name[i]))
+			face = i;
+	}
+	if (face < 0)
+		return al_json_skip(j);
+
+	for (i = 0; i < l->face_count; i++) {
+		if (l->face_order[i] == face)
+			ERROR_RETURN(-1);
+	}
+	l->face_order[l->face_count++] = face;
+	return al_json_array(j, al_json_tile, l);
+}
+
+static int al_json_layer_member(ALLEGRO_SPRITE_JSON *j, const char *key, void *data)
+{
+	if (!strcmp(key, "image"))
+		return al_json_object(j, al_json_image_member, data);
+	if (!strcmp(key, "tiles"))
+		return al_json_object(j, al_json_tiles_member, data);
+	return al_json_skip(j);
+}
+
+/* Swap two face blocks of a layer's tiles in place */
+static void al_json_swap_faces(ALLEGRO_SPRITE_TILE *a, ALLEGRO_SPRITE_TILE *b, int n)
+{
+	ALLEGRO_SPRITE_TILE t;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		t = a[i];
+		a[i] = b[i];
+		b[i] = t;
+	}
+}
+
+static int al_json_layer(ALLEGRO_SPRITE_JSON *j, void *data)
+{
+	ALLEGRO_SPRITE_JSON_TILESET *ts = data;
+	ALLEGRO_SPRITE_JSON_LAYER l;
+	ALLEGRO_SPRITE_TILE_LAYER *layer;
+	int i, k, c, n;
+
+	memset(&l, 0, sizeof(l));
+	if (j->def) {
+		l.layer = al_sprite_arena_alloc(&j->arena[ARENA_LAYERS],
+					sizeof(ALLEGRO_SPRITE_TILE_LAYER));
+		if (!l.layer)
+			ERROR_RETURN(-1);
+		l.tiles = (ALLEGRO_SPRITE_TILE *)j->arena[ARENA_TILES].next;
+	}
+
+	if (al_json_object(j, al_json_layer_member, &l))
+		ERROR_RETURN(-1);
+
+	/* Image and tile sizes are required */
+	if (l.image_width <= 0 || l.image_height <= 0 ||
+		l.tile_width <= 0 || l.tile_height <= 0)
+		ERROR_RETURN(-1);
+
+	/* Every face must hold a quarter of the tiles */
+	c = l.count;
+	n = c / 4;
+	if (!l.has_file || c <= 0 || c % 4 || l.face_count != 4)
+		ERROR_RETURN(-1);
+	for (i = 0; i < 4; i++) {
+		if (l.face_size[i] != n)
+			ERROR_RETURN(-1);
+	}
+
+	ts->layer_count++;
+	ts->frames = al_sprite_frame_count(ts->frames, n);
+
+	if (!j->def) {
+		j->size->layer_count++;
+		j->size->tile_count += c;
+		return 0;
+	}
+
+	/* Put the faces in direction order */
+	for (i = 0; i < 4; i++) {
+		for (k = i; l.face_order[k] != i; k++)
+			;
+		if (k != i) {
+			al_json_swap_faces(&l.tiles[i * n], &l.tiles[k * n], n);
+			l.face_order[k] = l.face_order[i];
+			l.face_order[i] = i;
+		}
+	}
+
+	layer = l.layer;
+	layer->image_width = l.image_width;
+	layer->image_height = l.image_height;
+	layer->tile_count = c;
+	layer->tile_width = l.tile_width;
+	layer->tile_height = l.tile_height;
+	layer->tiles = l.tiles;
+	layer->tiles_down = &(layer->tiles[0]);
+	layer->tiles_up = &(layer->tiles[c/4]);
+	layer->tiles_right = &(layer->tiles[c*2/4]);
+	layer->tiles_left = &(layer->tiles[c*3/4]);
+	return 0;
+}
+
+static int al_json_tileset_member(ALLEGRO_SPRITE_JSON *j, const char *key, void *data)
+{
+	if (!strcmp(key, "layers"))
+		return al_json_array(j, al_json_layer, data);
+	return al_json_skip(j);
+}
+
+/* Each member of the top object is a tileset, its name is not used */
+static int al_json_tileset(ALLEGRO_SPRITE_JSON *j, const char *key, void *data)
+{
+	ALLEGRO_SPRITE_JSON_TILESET ts;
+
+	memset(&ts, 0, sizeof(ts));
+	ts.frames = 1;
+
+	if (j->def) {
+		if (j->tileset_id >= j->def->tileset_count)
+			ERROR_RETURN(-1);
+		ts.tileset = &j->def->tilesets[j->tileset_id++];
+		ts.tileset->layers = (ALLEGRO_SPRITE_TILE_LAYER *)j->arena[ARENA_LAYERS].next;
+	}
+
+	if (al_json_object(j, al_json_tileset_member, &ts))
+		ERROR_RETURN(-1);
+
+	if (!j->def) {
+		j->size->tileset_count++;
+		al_sprite_size_frames(j->size, ts.frames, ts.layer_count);
+		return 0;
+	}
+
+	ts.tileset->layer_count = ts.layer_count;
+	return al_build_sprite_frames(&j->arena[ARENA_FRAMES], ts.tileset);
+}
+
+/* One pass over the descriptor, sizing or filling */
+static int al_json_sprite(ALLEGRO_SPRITE_JSON *j)
+{
+	j->pos = 0;
+	j->len = 0;
+	j->line = 1;
+	if (!al_fseek(j->fp, 0, ALLEGRO_SEEK_SET))
+		ERROR_RETURN(-1);
+
+	if (al_json_object(j, al_json_tileset, NULL) || al_json_next(j) != EOF)
+		ERROR_RETURN(-1);
+
+	/* The file changed between the passes */
+	if (j->def && j->tileset_id != j->def->tileset_count)
+		ERROR_RETURN(-1);
+	return 0;
+}
+
+static ALLEGRO_SPRITE_DEF *al_load_sprite_def_json(const char *dir,
+				const char *filename, int flags)
+{
+	ALLEGRO_SPRITE_JSON *j;
+	ALLEGRO_SPRITE_DEF *def = NULL;
+	ALLEGRO_SPRITE_SIZE size;
+	ALLEGRO_SPRITE_ARENA arena[ARENA_COUNT];
+
+	j = calloc(1, sizeof(ALLEGRO_SPRITE_JSON));
+	if (!j)
+		return NULL;
+
+	j->fp = al_open_sprite_file(dir, filename);
+	if (!j->fp)
+		goto exit;
+
+	memset(&size, 0, sizeof(size));
+	j->size = &size;
+	if (al_json_sprite(j) || size.tileset_count == 0) {
+		fprintf(stderr, "Parse sprite file [%s/%s] error, line %d!\n",
+				dir, filename, j->line);
+		goto exit;
+	}
+
+	def = al_create_sprite_def(&size, dir, filename, arena);
+	if (!def)
+		goto exit;
+
+	j->def = def;
+	j->arena = arena;
+	if (al_json_sprite(j) || al_load_sprite_tilesets(def, flags)) {
+		fprintf(stderr, "Load sprite file [%s/%s] error!\n", dir, filename);
+		al_destroy_sprite_def(def);
+		def = NULL;
+	} else {
+		al_register_sprite_def(def);
+	}
+
+exit:
+	if (j->fp)
+		al_fclose(j->fp);
+	free(j);
+	return def;
+}
+
+ALLEGRO_SPRITE_DEF *al_load_sprite_def(const char *dir, const char *filename)
+{
+	return al_load_sprite_def_json(dir, filename, al_new_sprite_flags);
+}
+
+ALLEGRO_SPRITE *al_load_sprite(const char *dir, const char *filename)
+{
+	return al_create_sprite_owner(al_load_sprite_def(dir, filename));
+}
+
+/***************************************************************************************/
+/********** Binary Sprite File *********************************************************/
+/***************************************************************************************/
+
+/*
+ * Binary sprite file (.spb), compiled from the JSON descriptor.
+ * All fields are 32 bits in native byte order, laid out as:
+ *
+ *   ALLEGRO_SPRITE_BIN_HEADER
+ *   ALLEGRO_SPRITE_BIN_TILESET [tileset_count]
+ *   ALLEGRO_SPRITE_BIN_LAYER   [layer_count]
+ *   ALLEGRO_SPRITE_TILE        [tile_count]
+ *   Image file names, '\0' terminated [string_size bytes]
+ *
+ * The file is mapped read only, the tile arrays and image file names
+ * of the sprite point straight into the mapping.
+ */
+
+#define ALLEGRO_SPRITE_BIN_MAGIC	0x31425053 /* "SPB1" */
+#define ALLEGRO_SPRITE_BIN_VERSION	1
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t tileset_count;
+	uint32_t layer_count;
+	uint32_t tile_count;
+	uint32_t string_size;
+} ALLEGRO_SPRITE_BIN_HEADER;
+
+typedef struct {
+	uint32_t layer_start; /* Index of first layer */
+	uint32_t layer_count;
+} ALLEGRO_SPRITE_BIN_TILESET;
+
+typedef struct {
+	uint32_t image_file; /* Offset in string table */
+	int32_t image_width;
+	int32_t image_height;
+
+	int32_t tile_count;
+	int32_t tile_width;
+	int32_t tile_height;
+	uint32_t tile_start; /* Index of first tile */
+} ALLEGRO_SPRITE_BIN_LAYER;
+
+int al_save_sprite_binary(ALLEGRO_SPRITE_DEF *def, const char *filepath)
+{
+	ALLEGRO_SPRITE_BIN_HEADER header;
+	ALLEGRO_SPRITE_BIN_TILESET bt;
+	ALLEGRO_SPRITE_BIN_LAYER bl;
+	ALLEGRO_SPRITE_TILE_LAYER *layer;
+	char tmp[PATH_MAX];
+	FILE *fp;
+	int i, j;
+
+	if (!def || !filepath)
+		ERROR_RETURN(-1);
+
+	memset(&header, 0, sizeof(header));
+	header.magic = ALLEGRO_SPRITE_BIN_MAGIC;
+	header.version = ALLEGRO_SPRITE_BIN_VERSION;
+	header.tileset_count = def->tileset_count;
+	for (i = 0; i < def->tileset_count; i++) {
+		header.layer_count += def->tilesets[i].layer_count;
+		for (j = 0; j < def->tilesets[i].layer_count; j++) {
+			layer = &def->tilesets[i].layers[j];
+			header.tile_count += layer->tile_count;
+			header.string_size += strlen(layer->image_file) + 1;
+		}
+	}
+
+	fp = al_create_sprite_file(filepath, tmp, sizeof(tmp));
+	if (!fp) {
+		fprintf(stderr, "Open file [%s] error!\n", filepath);
+		ERROR_RETURN(-1);
+	}
+
+	fwrite(&header, sizeof(header), 1, fp);
+
+	bt.layer_start = 0;
+	for (i = 0; i < def->tileset_count; i++) {
+		bt.layer_count = def->tilesets[i].layer_count;
+		fwrite(&bt, sizeof(bt), 1, fp);
+		bt.layer_start += bt.layer_count;
+	}
+
+	bl.image_file = 0;
+	bl.tile_start = 0;
+	for (i = 0; i < def->tileset_count; i++) {
+		for (j = 0; j < def->tilesets[i].layer_count; j++) {
+			layer = &def->tilesets[i].layers[j];
+			bl.image_width = layer->image_width;
+			bl.image_height = layer->image_height;
+			bl.tile_count = layer->tile_count;
+			bl.tile_width = layer->tile_width;
+			bl.tile_height = layer->tile_height;
+			fwrite(&bl, sizeof(bl), 1, fp);
+			bl.image_file += strlen(layer->image_file) + 1;
+			bl.tile_start += layer->tile_count;
+		}
+	}
+
+	for (i = 0; i < def->tileset_count; i++) {
+		for (j = 0; j < def->tilesets[i].layer_count; j++) {
+			layer = &def->tilesets[i].layers[j];
+			fwrite(layer->tiles, sizeof(ALLEGRO_SPRITE_TILE),
+						layer->tile_count, fp);
+		}
+	}
+
+	for (i = 0; i < def->tileset_count; i++) {
+		for (j = 0; j < def->tilesets[i].layer_count; j++) {
+			layer = &def->tilesets[i].layers[j];
+			fwrite(layer->image_file, 1, strlen(layer->image_file) + 1, fp);
+		}
+	}
+
+	if (al_commit_sprite_file(fp, tmp, filepath, true))
+		ERROR_RETURN(-1);
+	return 0;
+}
+
+static int al_check_sprite_binary(const void *base, size_t size)
+{
+	const ALLEGRO_SPRITE_BIN_HEADER *header = base;
+
+	if (size < sizeof(ALLEGRO_SPRITE_BIN_HEADER) ||
+		header->magic != ALLEGRO_SPRITE_BIN_MAGIC ||
+		header->version != ALLEGRO_SPRITE_BIN_VERSION)
+		ERROR_RETURN(-1);
+	return 0;
+}
+
+static void *al_map_sprite_binary(const char *filepath, size_t *map_size)
+{
+	struct stat st;
+	void *base;
+	int fd;
+
+	fd = open(filepath, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "Open file [%s] error!\n", filepath);
+		ERROR_RETURN(NULL);
+	}
+
+	if (fstat(fd, &st) ||
+		st.st_size < (off_t)sizeof(ALLEGRO_SPRITE_BIN_HEADER)) {
+		close(fd);
+		ERROR_RETURN(NULL);
+	}
+
+	base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED)
+		ERROR_RETURN(NULL);
+
+	if (al_check_sprite_binary(base, st.st_size)) {
+		munmap(base, st.st_size);
+		ERROR_RETURN(NULL);
+	}
+
+	*map_size = st.st_size;
+	return base;
+}
+
+/* Check the mapping and count what the definition has to hold */
+static int al_size_sprite_binary(ALLEGRO_SPRITE_SIZE *size, void *base, size_t map_size)
+{
+	const ALLEGRO_SPRITE_BIN_HEADER *header = base;
+	const ALLEGRO_SPRITE_BIN_TILESET *bt;
+	const ALLEGRO_SPRITE_BIN_LAYER *bl;
+	const char *strings;
+	size_t bytes;
+	int i, j, c, frames;
+
+	memset(size, 0, sizeof(ALLEGRO_SPRITE_SIZE));
+
+	bytes = sizeof(*header)
+		+ (size_t)header->tileset_count * sizeof(*bt)
+		+ (size_t)header->layer_count * sizeof(*bl)
+		+ (size_t)header->tile_count * sizeof(ALLEGRO_SPRITE_TILE)
+		+ header->string_size;
+	if (bytes > map_size || header->string_size == 0)
+		ERROR_RETURN(-1);
+
+	bt = (const void *)(header + 1);
+	bl = (const void *)(bt + header->tileset_count);
+	strings = (const char *)((const ALLEGRO_SPRITE_TILE *)(bl + header->layer_count)
+				+ header->tile_count);
+	if (strings[header->string_size - 1] != '\0')
+		ERROR_RETURN(-1);
+
+	for (i = 0; i < header->tileset_count; i++, bt++) {
+		if (bt->layer_start > header->layer_count ||
+			bt->layer_count > header->layer_count - bt->layer_start)
+			ERROR_RETURN(-1);
+
+		frames = 1;
+		for (j = 0; j < bt->layer_count; j++) {
+			const ALLEGRO_SPRITE_BIN_LAYER *b = &bl[bt->layer_start + j];
+
+			c = b->tile_count;
+			if (c <= 0 || c % 4 ||
+				b->tile_start > header->tile_count ||
+				c > header->tile_count - b->tile_start ||
+				b->image_file >= header->string_size)
+				ERROR_RETURN(-1);
+			frames = al_sprite_frame_count(frames, c / 4);
+		}
+		al_sprite_size_frames(size, frames, bt->layer_count);
+	}
+
+	/* Tiles and image files stay in the mapping */
+	size->tileset_count = header->tileset_count;
+	size->layer_count = header->layer_count;
+	return 0;
+}
+
+/* Fill the tables, the mapping is checked by al_size_sprite_binary() */
+static int al_parse_sprite_binary(ALLEGRO_SPRITE_DEF *def, ALLEGRO_SPRITE_ARENA *arena,
+				void *base)
+{
+	const ALLEGRO_SPRITE_BIN_HEADER *header = base;
+	const ALLEGRO_SPRITE_BIN_TILESET *bt;
+	const ALLEGRO_SPRITE_BIN_LAYER *bl;
+	ALLEGRO_SPRITE_TILE *tiles;
+	ALLEGRO_SPRITE_TILE_LAYER *layer;
+	char *strings;
+	int i, j, c;
+
+	bt = (const void *)(header + 1);
+	bl = (const void *)(bt + header->tileset_count);
+	tiles = (void *)(bl + header->layer_count);
+	strings = (char *)(tiles + header->tile_count);
+
+	for (i = 0; i < def->tileset_count; i++, bt++) {
+		def->tilesets[i].layers = al_sprite_arena_alloc(&arena[ARENA_LAYERS],
+					sizeof(ALLEGRO_SPRITE_TILE_LAYER) * bt->layer_count);
+		if (!def->tilesets[i].layers && bt->layer_count)
+			ERROR_RETURN(-1);
+		def->tilesets[i].layer_count = bt->layer_count;
+
+		for (j = 0; j < bt->layer_count; j++) {
+			const ALLEGRO_SPRITE_BIN_LAYER *b = &bl[bt->layer_start + j];
+
+			c = b->tile_count;
+			layer = &def->tilesets[i].layers[j];
+			layer->image_file = strings + b->image_file;
+			layer->image_width = b->image_width;
+			layer->image_height = b->image_height;
+			layer->tile_count = c;
+			layer->tile_width = b->tile_width;
+			layer->tile_height = b->tile_height;
+			layer->tiles = &tiles[b->tile_start];
+			layer->tiles_down = &(layer->tiles[0]);
+			layer->tiles_up = &(layer->tiles[c/4]);
+			layer->tiles_right = &(layer->tiles[c*2/4]);
+			layer->tiles_left = &(layer->tiles[c*3/4]);
+		}
+
+		if (al_build_sprite_frames(&arena[ARENA_FRAMES], &def->tilesets[i]))
+			ERROR_RETURN(-1);
+	}
+	return 0;
+}
+
+static ALLEGRO_SPRITE_DEF *al_load_sprite_def_spb(const char *dir,
+				const char *filename, int flags)
+{
+	ALLEGRO_SPRITE_DEF *def;
+	ALLEGRO_SPRITE_SIZE size;
+	ALLEGRO_SPRITE_ARENA arena[ARENA_COUNT];
+	const ALLEGRO_SPRITE_PAK_ENTRY *e;
+	size_t map_size;
+	void *base;
+	char *path;
+
+	/* Used in place from a mounted archive */
+	e = al_find_sprite_pak_entry(al_sprite_pak, dir, filename);
+	if (e) {
+		base = (char *)al_sprite_pak->base + e->offset;
+		map_size = e->size;
+		if (al_check_sprite_binary(base, map_size))
+			return NULL;
+	} else {
+		path = malloc(strlen(dir)+strlen(filename)+10);
+		if (!path)
+			return NULL;
+
+		sprintf(path, "%s/%s", dir, filename);
+		base = al_map_sprite_binary(path, &map_size);
+		free(path);
+		if (!base)
+			return NULL;
+	}
+
+	if (al_size_sprite_binary(&size, base, map_size) ||
+		!(def = al_create_sprite_def(&size, dir, filename, arena))) {
+		if (!e)
+			munmap(base, map_size);
+		return NULL;
+	}
+	if (!e) {
+		def->map_base = base;
+		def->map_size = map_size;
+	}
+
+	if (al_parse_sprite_binary(def, arena, base) ||
+		al_load_sprite_tilesets(def, flags)) {
+		al_destroy_sprite_def(def);
+		return NULL;
+	}
+	al_register_sprite_def(def);
+	return def;
+}
+
+ALLEGRO_SPRITE_DEF *al_load_sprite_def_binary(const char *dir, const char *filename)
+{
+	return al_load_sprite_def_spb(dir, filename, al_new_sprite_flags);
+}
+
+ALLEGRO_SPRITE *al_load_sprite_binary(const char *dir, const char *filename)
+{
+	return al_create_sprite_owner(al_load_sprite_def_binary(dir, filename));
+}
+
+/***************************************************************************************/
+/********** Asynchronous Loading *******************************************************/
+/***************************************************************************************/
+
+typedef struct _ALLEGRO_SPRITE_JOB ALLEGRO_SPRITE_JOB;
+struct _ALLEGRO_SPRITE_JOB {
+	char *dir;
+	char *filename;
+	int flags; /* New sprite flags when queued */
+	intptr_t data; /* User data, passed back in the event */
+	ALLEGRO_SPRITE_JOB *next;
+};
+
+struct _ALLEGRO_SPRITE_LOADER {
+	ALLEGRO_THREAD **threads;
+	int thread_count;
+
+	/* Pending jobs, FIFO */
+	ALLEGRO_MUTEX *mutex;
+	ALLEGRO_COND *cond;
+	ALLEGRO_SPRITE_JOB *head;
+	ALLEGRO_SPRITE_JOB *tail;
+	bool quit;
+
+	ALLEGRO_EVENT_SOURCE event_source;
+	bool event_source_ready;
+};
+
+static bool al_is_sprite_binary_file(const char *filename)
+{
+	const char *ext = strrchr(filename, '.');
+	return ext && !strcmp(ext, ".spb");
+}
+
+/* Drops the definition of an event nobody finished */
+static void al_sprite_loaded_dtor(ALLEGRO_USER_EVENT *event)
+{
+	al_destroy_sprite_def((ALLEGRO_SPRITE_DEF *)event->data1);
+}
+
+static void *al_sprite_loader_thread(ALLEGRO_THREAD *thread, void *arg)
+{
+	ALLEGRO_SPRITE_LOADER *loader = arg;
+	ALLEGRO_SPRITE_JOB *job;
+	ALLEGRO_SPRITE_DEF *def;
+	ALLEGRO_EVENT event;
+
+	/* No display on this thread, decode to memory */
+	al_set_new_bitmap_flags(ALLEGRO_MEMORY_BITMAP);
+
+	while (1) {
+		al_lock_mutex(loader->mutex);
+		while (!loader->head && !loader->quit)
+			al_wait_cond(loader->cond, loader->mutex);
+		if (loader->quit) {
+			al_unlock_mutex(loader->mutex);
+			break;
+		}
+		job = loader->head;
+		loader->head = job->next;
+		if (!loader->head)
+			loader->tail = NULL;
+		al_unlock_mutex(loader->mutex);
+
+		if (al_is_sprite_binary_file(job->filename))
+			def = al_load_sprite_def_spb(job->dir, job->filename, job->flags);
+		else
+			def = al_load_sprite_def_json(job->dir, job->filename, job->flags);
+
+		memset(&event, 0, sizeof(event));
+		event.user.type = ALLEGRO_EVENT_SPRITE_LOADED;
+		event.user.data1 = (intptr_t)def;
+		event.user.data2 = job->data;
+		event.user.data3 = (intptr_t)loader;
+		al_emit_user_event(&loader->event_source, &event, al_sprite_loaded_dtor);
+
+		free(job->dir);
+		free(job->filename);
+		free(job);
+	}
+	return NULL;
+}
+
+ALLEGRO_SPRITE_LOADER *al_create_sprite_loader(int threads)
+{
+	ALLEGRO_SPRITE_LOADER *loader;
+	int i;
+
+	if (threads <= 0)
+		threads = 1;
+
+	/* Image cache is shared with the loader threads from now on */
+	if (!al_sprite_images_mutex) {
+		al_sprite_images_mutex = al_create_mutex();
+		if (!al_sprite_images_mutex)
+			return NULL;
+	}
+
+	loader = calloc(1, sizeof(ALLEGRO_SPRITE_LOADER));
+	if (!loader)
+		return NULL;
+
+	loader->threads = calloc(threads, sizeof(ALLEGRO_THREAD *));
+	loader->mutex = al_create_mutex();
+	loader->cond = al_create_cond();
+	if (!loader->threads || !loader->mutex || !loader->cond) {
+		al_destroy_sprite_loader(loader);
+		return NULL;
+	}
+
+	al_init_user_event_source(&loader->event_source);
+	loader->event_source_ready = true;
+
+	for (i = 0; i < threads; i++) {
+		loader->threads[i] = al_create_thread(al_sprite_loader_thread, loader);
+		if (!loader->threads[i])
+			break;
+		loader->thread_count++;
+		al_start_thread(loader->threads[i]);
+	}
+
+	if (loader->thread_count == 0) {
+		al_destroy_sprite_loader(loader);
+		return NULL;
+	}
+	return loader;
+}
+
+void al_destroy_sprite_loader(ALLEGRO_SPRITE_LOADER *loader)
+{
+	ALLEGRO_SPRITE_JOB *job;
+	int i;
+
+	if (!loader)
+		return;
+
+	if (loader->mutex && loader->cond) {
+		al_lock_mutex(loader->mutex);
+		loader->quit = true;
+		al_broadcast_cond(loader->cond);
+		al_unlock_mutex(loader->mutex);
+	}
+
+	for (i = 0; i < loader->thread_count; i++)
+		al_destroy_thread(loader->threads[i]); /* Joins the thread */
+
+	/* Drop the jobs that never started */
+	while (loader->head) {
+		job = loader->head;
+		loader->head = job->next;
+		free(job->dir);
+		free(job->filename);
+		free(job);
+	}
+
+	/* Queued events are dropped here, with their definitions */
+	if (loader->event_source_ready)
+		al_destroy_user_event_source(&loader->event_source);
+	if (loader->cond)
+		al_destroy_cond(loader->cond);
+	if (loader->mutex)
+		al_destroy_mutex(loader->mutex);
+	free(loader->threads);
+	free(loader);
+}
+
+ALLEGRO_EVENT_SOURCE *al_get_sprite_loader_event_source(ALLEGRO_SPRITE_LOADER *loader)
+{
+	return &loader->event_source;
+}
+
+/*
+ * Queue a sprite to be parsed and decoded by the loader threads,
+ * ".spb" files are loaded as binary sprites. An ALLEGRO_EVENT_SPRITE_LOADED
+ * event is emitted when done, pass it to al_finish_sprite_load().
+ */
+int al_load_sprite_async(ALLEGRO_SPRITE_LOADER *loader,
+				const char *dir, const char *filename, intptr_t data)
+{
+	ALLEGRO_SPRITE_JOB *job;
+
+	job = calloc(1, sizeof(ALLEGRO_SPRITE_JOB));
+	if (!job)
+		ERROR_RETURN(-1);
+
+	job->dir = strdup(dir);
+	job->filename = strdup(filename);
+	job->flags = al_new_sprite_flags;
+	job->data = data;
+	if (!job->dir || !job->filename) {
+		free(job->dir);
+		free(job->filename);
+		free(job);
+		ERROR_RETURN(-1);
+	}
+
+	al_lock_mutex(loader->mutex);
+	if (loader->tail)
+		loader->tail->next = job;
+	else
+		loader->head = job;
+	loader->tail = job;
+	al_signal_cond(loader->cond);
+	al_unlock_mutex(loader->mutex);
+	return 0;
+}
+
+/* Upload the decoded images of a definition, on the display thread */
+static void al_upload_sprite_def(ALLEGRO_SPRITE_DEF *def)
+{
+	ALLEGRO_BITMAP *bitmap;
+	int i, j;
+
+	for (i = 0; i < def->tileset_count; i++) {
+		if (!def->tilesets[i].loaded)
+			continue;
+
+		for (j = 0; j < def->tilesets[i].layer_count; j++) {
+			bitmap = def->tilesets[i].layers[j].image->bitmap;
+			if (bitmap && al_get_bitmap_flags(bitmap) & ALLEGRO_MEMORY_BITMAP)
+				al_convert_bitmap(bitmap);
+		}
+
+		if (def->tilesets[i].flat)
+			al_convert_bitmap(def->tilesets[i].flat->bitmap);
+	}
+}
+
+/*
+ * Complete an ALLEGRO_EVENT_SPRITE_LOADED event on the display thread,
+ * converting its images to video bitmaps and flattening its tilesets,
+ * and release the event.
+ * Returns the loaded definition, owned by the caller, or NULL if loading
+ * failed. The loader event source should be registered with one queue
+ * only, the definition is handed over once.
+ */
+ALLEGRO_SPRITE_DEF *al_finish_sprite_load(ALLEGRO_EVENT *event)
+{
+	ALLEGRO_SPRITE_DEF *def;
+
+	if (event->type != ALLEGRO_EVENT_SPRITE_LOADED)
+		return NULL;
+
+	/* Take the definition over from the event destructor */
+	def = (ALLEGRO_SPRITE_DEF *)event->user.data1;
+	event->user.data1 = 0;
+	al_unref_user_event(&event->user);
+	if (!def)
+		return NULL;
+
+	al_lock_sprite_images();
+	al_upload_sprite_def(def);
+	al_unlock_sprite_images();
+	al_flatten_pending_tilesets();
+	return def;
+}
+
+/* Pool of al_load_sprites(), one thread per core */
+static ALLEGRO_SPRITE_LOADER *al_sprite_pool = NULL;
+
+static void al_destroy_sprite_pool(void)
+{
+	al_destroy_sprite_loader(al_sprite_pool);
+	al_sprite_pool = NULL;
+}
+
+/*
+ * Load n sprites at once, parsing and decoding on the pool threads
+ * and converting to video bitmaps on the calling display thread.
+ * sprites[i] is set to the sprite of files[i], NULL if it failed.
+ * Returns the number of sprites loaded.
+ */
+int al_load_sprites(const char *dir, const char **files, int n, ALLEGRO_SPRITE **sprites)
+{
+	ALLEGRO_EVENT_QUEUE *queue;
+	ALLEGRO_EVENT event;
+	ALLEGRO_SPRITE_DEF *def;
+	int i, queued = 0, loaded = 0;
+
+	for (i = 0; i < n; i++)
+		sprites[i] = NULL;
+
+	if (!al_sprite_pool) {
+		al_sprite_pool = al_create_sprite_loader(al_get_cpu_count());
+		if (!al_sprite_pool)
+			ERROR_RETURN(-1);
+		atexit(al_destroy_sprite_pool);
+	}
+
+	queue = al_create_event_queue();
+	if (!queue)
+		ERROR_RETURN(-1);
+	al_register_event_source(queue, &al_sprite_pool->event_source);
+
+	for (i = 0; i < n; i++) {
+		if (al_load_sprite_async(al_sprite_pool, dir, files[i], i) == 0)
+			queued++;
+	}
+
+	/* Upload each sprite as soon as it is decoded */
+	while (queued > 0) {
+		al_wait_for_event(queue, &event);
+		if (event.type != ALLEGRO_EVENT_SPRITE_LOADED)
+			continue;
+		queued--;
+
+		def = al_finish_sprite_load(&event);
+		i = event.user.data2;
+		sprites[i] = al_create_sprite_owner(def);
+		if (sprites[i])
+			loaded++;
+	}
+
+	al_unregister_event_source(queue, &al_sprite_pool->event_source);
+	al_destroy_event_queue(queue);
+	return loaded;
+}
+
+/***************************************************************************************/
+/********** Hot Reload *****************************************************************/
+/***************************************************************************************/
+
+/*
+ * A watcher thread waits on inotify for files written in a sprite
+ * directory. A changed descriptor is parsed again and a changed image
+ * decoded again on that thread; unrelated assets are not touched.
+ * A saved "name.json" also replaces definitions loaded from the compiled
+ * "name.spb". al_update_sprite_watcher() swaps the results in on the display
+ * thread, sprites move to a reloaded definition on their next draw.
+ */
+
+#define WATCH_EVENTS	(IN_CLOSE_WRITE | IN_MOVED_TO)
+#define WATCH_POLL_MS	100 /* Stop request latency */
+#define WATCH_SETTLE_MS	50 /* Merge the events of one save */
+#define WATCH_MAX_FILES	32
+
+typedef struct _ALLEGRO_SPRITE_RELOAD ALLEGRO_SPRITE_RELOAD;
+struct _ALLEGRO_SPRITE_RELOAD {
+	char *filename; /* Changed file, or the file of the definitions it replaces */
+	ALLEGRO_SPRITE_DEF *def; /* New definition of a descriptor */
+	ALLEGRO_BITMAP *bitmap; /* Or new memory bitmap of an image */
+	ALLEGRO_SPRITE_RELOAD *next;
+};
+
+struct _ALLEGRO_SPRITE_WATCHER {
+	char *dir;
+	int fd;
+	ALLEGRO_THREAD *thread;
+
+	/* Reloads ready to swap in, FIFO */
+	ALLEGRO_MUTEX *mutex;
+	ALLEGRO_SPRITE_RELOAD *head;
+	ALLEGRO_SPRITE_RELOAD *tail;
+};
+
+/* Live definition loaded from dir/filename, called locked */
+static ALLEGRO_SPRITE_DEF *al_find_sprite_def(const char *dir, const char *filename)
+{
+	ALLEGRO_SPRITE_DEF *def;
+
+	for (def = al_sprite_defs; def; def = def->next) {
+		if (!strcmp(def->file, filename) && !strcmp(def->dir, dir))
+			return def;
+	}
+	return NULL;
+}
+
+/* Cached image of path, without taking a reference, called locked */
+static ALLEGRO_SPRITE_IMAGE *al_find_sprite_image_path(const char *path)
+{
+	ALLEGRO_SPRITE_IMAGE *image;
+
+	for (image = al_sprite_images; image; image = image->next) {
+		if (!strcmp(image->path, path))
+			return image;
+	}
+	return NULL;
+}
+
+/* "name.spb" compiled from "name.json", NULL for other files */
+static char *al_sprite_binary_name(const char *filename)
+{
+	const char *ext = strrchr(filename, '.');
+	char *binary;
+
+	if (!ext || strcmp(ext, ".json"))
+		return NULL;
+
+	binary = malloc(ext - filename + sizeof(".spb"));
+	if (!binary)
+		return NULL;
+	memcpy(binary, filename, ext - filename);
+	strcpy(binary + (ext - filename), ".spb");
+	return binary;
+}
+
+static char *al_sprite_watch_path(ALLEGRO_SPRITE_WATCHER *w, const char *filename)
+{
+	char *path, *real;
+
+	path = malloc(strlen(w->dir)+strlen(filename)+10);
+	if (!path)
+		return NULL;
+	sprintf(path, "%s/%s", w->dir, filename);
+
+	/* Image cache key, see al_acquire_sprite_image() */
+	real = realpath(path, NULL);
+	if (real) {
+		free(path);
+		return real;
+	}
+	return path;
+}
+
+/* Parse or decode a changed file, on the watcher thread */
+static void al_reload_sprite_file(ALLEGRO_SPRITE_WATCHER *w, const char *filename)
+{
+	ALLEGRO_SPRITE_RELOAD *r;
+	ALLEGRO_SPRITE_DEF *def;
+	ALLEGRO_BITMAP *bitmap = NULL;
+	bool used;
+	char *path;
+	char *binary = NULL;
+	int flags = 0;
+
+	al_lock_sprite_images();
+	def = al_find_sprite_def(w->dir, filename);
+	if (!def) {
+		/* A descriptor loaded compiled, parse the saved source */
+		binary = al_sprite_binary_name(filename);
+		if (binary)
+			def = al_find_sprite_def(w->dir, binary);
+		if (!def) {
+			free(binary);
+			binary = NULL;
+		}
+	}
+	if (def)
+		flags = def->flags;
+	al_unlock_sprite_images();
+
+	if (def) {
+		if (al_is_sprite_binary_file(filename))
+			def = al_load_sprite_def_spb(w->dir, filename, flags);
+		else
+			def = al_load_sprite_def_json(w->dir, filename, flags);
+		if (!def) {
+			free(binary);
+			return;
+		}
+	} else {
+		path = al_sprite_watch_path(w, filename);
+		if (!path)
+			return;
+		al_lock_sprite_images();
+		used = al_find_sprite_image_path(path) != NULL;
+		al_unlock_sprite_images();
+
+		/* Not an image in use */
+		if (used)
+			bitmap = al_load_cached_bitmap(path);
+		free(path);
+		if (!bitmap)
+			return;
+	}
+
+	r = calloc(1, sizeof(ALLEGRO_SPRITE_RELOAD));
+	if (r)
+		r->filename = binary ? binary : strdup(filename);
+	else
+		free(binary);
+	if (!r || !r->filename) {
+		free(r);
+		if (def)
+			al_destroy_sprite_def(def);
+		else
+			al_destroy_bitmap(bitmap);
+		return;
+	}
+	r->def = def;
+	r->bitmap = bitmap;
+
+	al_lock_mutex(w->mutex);
+	if (w->tail)
+		w->tail->next = r;
+	else
+		w->head = r;
+	w->tail = r;
+	al_unlock_mutex(w->mutex);
+}
+
+static void *al_sprite_watcher_thread(ALLEGRO_THREAD *thread, void *arg)
+{
+	ALLEGRO_SPRITE_WATCHER *w = arg;
+	const struct inotify_event *ev;
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	char *files[WATCH_MAX_FILES];
+	struct pollfd pfd;
+	int timeout = WATCH_POLL_MS;
+	int count = 0;
+	ssize_t len;
+	char *p;
+	int i;
+
+	/* No display on this thread, decode to memory */
+	al_set_new_bitmap_flags(ALLEGRO_MEMORY_BITMAP);
+
+	pfd.fd = w->fd;
+	pfd.events = POLLIN;
+	while (!al_get_thread_should_stop(thread)) {
+		if (poll(&pfd, 1, timeout) > 0) {
+			len = read(w->fd, buf, sizeof(buf));
+			for (p = buf; len > 0 && p < buf + len;
+					p += sizeof(struct inotify_event) + ev->len) {
+				ev = (const struct inotify_event *)p;
+				if (!ev->len || !(ev->mask & WATCH_EVENTS))
+					continue;
+				for (i = 0; i < count; i++) {
+					if (!strcmp(files[i], ev->name))
+						break;
+				}
+				if (i == count && count < WATCH_MAX_FILES &&
+					(files[count] = strdup(ev->name)))
+					count++;
+			}
+			timeout = WATCH_SETTLE_MS;
+			continue;
+		}
+
+		/* Quiet for a while, the files are complete */
+		for (i = 0; i < count; i++) {
+			al_reload_sprite_file(w, files[i]);
+			free(files[i]);
+		}
+		count = 0;
+		timeout = WATCH_POLL_MS;
+	}
+
+	for (i = 0; i < count; i++)
+		free(files[i]);
+	return NULL;
+}
+
+/*
+ * Watch dir for changed sprite files, e.g. while editing character.json
+ * or its images. Only definitions loaded from dir are reloaded. Reloads
+ * that drop tilesets are ignored, old sprites may still use them.
+ */
+ALLEGRO_SPRITE_WATCHER *al_create_sprite_watcher(const char *dir)
+{
+	ALLEGRO_SPRITE_WATCHER *w;
+
+	/* Image cache is shared with the watcher thread from now on */
+	if (!al_sprite_images_mutex) {
+		al_sprite_images_mutex = al_create_mutex();
+		if (!al_sprite_images_mutex)
+			ERROR_RETURN(NULL);
+	}
+
+	w = calloc(1, sizeof(ALLEGRO_SPRITE_WATCHER));
+	if (!w)
+		ERROR_RETURN(NULL);
+
+	w->dir = strdup(dir);
+	w->mutex = al_create_mutex();
+	w->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (!w->dir || !w->mutex || w->fd < 0 ||
+		inotify_add_watch(w->fd, dir, WATCH_EVENTS) < 0) {
+		al_destroy_sprite_watcher(w);
+		ERROR_RETURN(NULL);
+	}
+
+	w->thread = al_create_thread(al_sprite_watcher_thread, w);
+	if (!w->thread) {
+		al_destroy_sprite_watcher(w);
+		ERROR_RETURN(NULL);
+	}
+	al_start_thread(w->thread);
+	return w;
+}
+
+/* Reloads not swapped in yet are dropped */
+void al_destroy_sprite_watcher(ALLEGRO_SPRITE_WATCHER *w)
+{
+	ALLEGRO_SPRITE_RELOAD *r;
+
+	if (!w)
+		return;
+
+	if (w->thread)
+		al_destroy_thread(w->thread); /* Joins the thread */
+
+	while (w->head) {
+		r = w->head;
+		w->head = r->next;
+		if (r->def)
+			al_destroy_sprite_def(r->def);
+		else
+			al_destroy_bitmap(r->bitmap);
+		free(r->filename);
+		free(r);
+	}
+
+	if (w->fd >= 0)
+		close(w->fd);
+	if (w->mutex)
+		al_destroy_mutex(w->mutex);
+	free(w->dir);
+	free(w);
+}
+
+/* Replace the live definitions loaded from file with def */
+static int al_swap_sprite_def(ALLEGRO_SPRITE_DEF *def, const char *file)
+{
+	ALLEGRO_SPRITE_DEF **p, *old;
+	int n = 0;
+
+	al_lock_sprite_images();
+	al_upload_sprite_def(def);
+	for (p = &al_sprite_defs; (old = *p); ) {
+		if (old == def || strcmp(old->file, file) ||
+			strcmp(old->dir, def->dir)) {
+			p = &old->next;
+			continue;
+		}
+		if (old->tileset_count > def->tileset_count) {
+			fprintf(stderr, "Sprite file [%s/%s] lost tilesets, not reloaded!\n",
+					def->dir, file);
+			p = &old->next;
+			continue;
+		}
+
+		/* Replaced definitions live on until their sprites move */
+		*p = old->next;
+		old->reloaded = def;
+		def->refs++;
+		n++;
+	}
+	al_unlock_sprite_images();
+	al_flatten_pending_tilesets();
+
+	al_destroy_sprite_def(def);
+	return n;
+}
+
+/* Flattened tilesets of def drawing image, stored to stale if not NULL */
+static int al_find_stale_tilesets(ALLEGRO_SPRITE_DEF *def, ALLEGRO_SPRITE_IMAGE *image,
+				ALLEGRO_SPRITE_TILESET **stale)
+{
+	ALLEGRO_SPRITE_TILESET *tileset;
+	int i, j, n = 0;
+
+	for (i = 0; i < def->tileset_count; i++) {
+		tileset = &def->tilesets[i];
+		if (!tileset->flat)
+			continue;
+		for (j = 0; j < tileset->layer_count; j++) {
+			if (tileset->layers[j].image == image) {
+				if (stale)
+					stale[n] = tileset;
+				n++;
+				break;
+			}
+		}
+	}
+	return n;
+}
+
+/* Replace the bitmap of a cached image, rebuilding composites of it */
+static int al_swap_sprite_image(ALLEGRO_SPRITE_WATCHER *w, const char *filename,
+				ALLEGRO_BITMAP *bitmap)
+{
+	ALLEGRO_SPRITE_IMAGE *image;
+	ALLEGRO_SPRITE_TILESET **stale = NULL;
+	ALLEGRO_SPRITE_DEF *def;
+	char *path;
+	int i, n = 0;
+
+	path = al_sprite_watch_path(w, filename);
+
+	al_lock_sprite_images();
+	image = path ? al_find_sprite_image_path(path) : NULL;
+	if (!image) {
+		al_unlock_sprite_images();
+		al_destroy_bitmap(bitmap);
+		free(path);
+		return 0;
+	}
+
+	al_convert_bitmap(bitmap);
+	if (image->bitmap) {
+		al_destroy_bitmap(image->bitmap);
+		al_sprite_memory.resident -= image->size;
+	}
+	if (image->backup) {
+		al_destroy_bitmap(image->backup);
+		image->backup = NULL;
+	}
+
+	/* The new image stands alone until the atlas is rebuilt */
+	if (image->atlas) {
+		al_release_sprite_atlas(image->atlas);
+		image->atlas = NULL;
+	}
+
+	image->bitmap = bitmap;
+	image->size = al_sprite_bitmap_size(bitmap);
+	al_sprite_memory.resident += image->size;
+
+	/*
+	 * The watcher thread adds definitions meanwhile, collect the stale
+	 * composites locked and rebuild them unlocked, flattening locks too.
+	 * Only this thread destroys definitions, the tilesets stay valid.
+	 */
+	for (def = al_sprite_defs; def; def = def->next)
+		n += al_find_stale_tilesets(def, image, NULL);
+	if (n > 0)
+		stale = malloc(sizeof(ALLEGRO_SPRITE_TILESET *) * n);
+	n = 0;
+	for (def = al_sprite_defs; stale && def; def = def->next)
+		n += al_find_stale_tilesets(def, image, stale + n);
+	al_unlock_sprite_images();
+	free(path);
+
+	for (i = 0; i < n; i++)
+		al_flatten_sprite_tileset(stale[i]);
+	free(stale);
+	return 1;
+}
+
+/*
+ * Swap in what the watcher reloaded, on the display thread between
+ * frames. Returns the number of definitions and images replaced.
+ */
+int al_update_sprite_watcher(ALLEGRO_SPRITE_WATCHER *w)
+{
+	ALLEGRO_SPRITE_RELOAD *r, *next;
+	int n = 0;
+
+	al_lock_mutex(w->mutex);
+	r = w->head;
+	w->head = w->tail = NULL;
+	al_unlock_mutex(w->mutex);
+
+	for (; r; r = next) {
+		next = r->next;
+		if (r->def)
+			n += al_swap_sprite_def(r->def, r->filename);
+		else
+			n += al_swap_sprite_image(w, r->filename, r->bitmap);
+		free(r->filename);
+		free(r);
+	}
+	return n;
+}
+
+/* Move a sprite to the newest definition of its file */
+static void al_sprite_follow_reload(ALLEGRO_SPRITE *s)
+{
+	ALLEGRO_SPRITE_DEF *def = s->def;
+
+	while (def->reloaded)
+		def = def->reloaded;
+
+	/* Keep drawing the old one if the new tileset fails to load */
+	if (s->action && al_load_sprite_tileset(def, s->action->tileset_id))
+		return;
+
+	def->refs++;
+	al_destroy_sprite_def(s->def);
+	s->def = def;
+	if (s->action) {
+		s->w = def->tilesets[s->action->tileset_id].layers[0].tile_width;
+		s->h = def->tilesets[s->action->tileset_id].layers[0].tile_height;
+	}
+}
+
+/***************************************************************************************/
+/********** Camera *********************************************************************/
+/***************************************************************************************/
+
+/* 24.8 fixed point, keeps the fractions of slow camera moves */
+#define CAMERA_SHIFT	8
+#define CAMERA_ONE	(1 << CAMERA_SHIFT)
+#define CAMERA_FIXED(x)	((int32_t)((x) * CAMERA_ONE))
+
+/*
+ * The view into a map, shared by everything drawn in it. Sprites read it
+ * through al_use_sprite_camera() instead of each holding a map position,
+ * so a scroll doesn't touch every sprite. The position is kept below
+ * pixels, drawing rounds it down to whole pixels for map and sprites
+ * alike so they never drift apart.
+ */
+struct _ALLEGRO_CAMERA {
+	int32_t x; /* Top left of the view in the map */
+	int32_t y;
+	int width; /* View size */
+	int height;
+	int map_width; /* 0 for no bounds */
+	int map_height;
+	ALLEGRO_SPRITE_RECT dead_zone; /* Part of the view a followed target moves freely in */
+	int32_t follow_speed; /* Part of the way to the target covered per follow */
+};
+
+/* Camera of al_draw_sprite(), NULL to use the map position of each sprite */
+static ALLEGRO_CAMERA *al_sprite_camera = NULL;
+
+ALLEGRO_CAMERA *al_create_camera(int width, int height)
+{
+	ALLEGRO_CAMERA *c;
+
+	c = calloc(1, sizeof(ALLEGRO_CAMERA));
+	if (!c)
+		ERROR_RETURN(NULL);
+
+	/* Keeps a followed target centered */
+	c->width = width;
+	c->height = height;
+	c->dead_zone.x1 = c->dead_zone.x2 = width / 2;
+	c->dead_zone.y1 = c->dead_zone.y2 = height / 2;
+	c->follow_speed = CAMERA_ONE;
+	return c;
+}
+
+void al_destroy_camera(ALLEGRO_CAMERA *c)
+{
+	if (al_sprite_camera == c)
+		al_sprite_camera = NULL;
+	free(c);
+}
+
+void al_use_sprite_camera(ALLEGRO_CAMERA *c)
+{
+	al_sprite_camera = c;
+}
+
+static void al_clamp_camera(ALLEGRO_CAMERA *c)
+{
+	if (c->map_width > 0) {
+		if (c->x > CAMERA_FIXED(c->map_width - c->width))
+			c->x = CAMERA_FIXED(c->map_width - c->width);
+		if (c->x < 0)
+			c->x = 0;
+	}
+	if (c->map_height > 0) {
+		if (c->y > CAMERA_FIXED(c->map_height - c->height))
+			c->y = CAMERA_FIXED(c->map_height - c->height);
+		if (c->y < 0)
+			c->y = 0;
+	}
+}
+
+/* Keep the view inside a map_w x map_h map, 0 for no bounds */
+void al_camera_set_map_size(ALLEGRO_CAMERA *c, int map_w, int map_h)
+{
+	c->map_width = map_w;
+	c->map_height = map_h;
+	al_clamp_camera(c);
+}
+
+/* Area of the view, in view pixels, a followed target may move in */
+void al_camera_set_dead_zone(ALLEGRO_CAMERA *c, int x, int y, int w, int h)
+{
+	c->dead_zone.x1 = x;
+	c->dead_zone.y1 = y;
+	c->dead_zone.x2 = x + w;
+	c->dead_zone.y2 = y + h;
+}
 
-struct _ALLEGRO_SPRITE {
-	/* JSON file directory */
-	char *dir;
+/* Part of the distance to the dead zone covered per follow, 1 to snap */
+void al_camera_set_follow_speed(ALLEGRO_CAMERA *c, float speed)
+{
+	if (speed <= 0 || speed > 1)
+		speed = 1;
+	c->follow_speed = CAMERA_FIXED(speed);
+}
 
-	/* Bitmap tilesets */
-	int tileset_count;
-	ALLEGRO_SPRITE_TILESET *tilesets;
+void al_camera_move_to(ALLEGRO_CAMERA *c, float x, float y)
+{
+	c->x = CAMERA_FIXED(x);
+	c->y = CAMERA_FIXED(y);
+	al_clamp_camera(c);
+}
 
-	/* The size of map that sprite is in */
-	int map_x;
-	int map_y;
-	int map_width;
-	int map_height;
+void al_camera_move_step(ALLEGRO_CAMERA *c, float step_x, float step_y)
+{
+	c->x += CAMERA_FIXED(step_x);
+	c->y += CAMERA_FIXED(step_y);
+	al_clamp_camera(c);
+}
 
-	/* Position in map. */
-	int x;
-	int y;
+/* Camera position on one axis that has [p1, p2) inside the dead zone [z1, z2) */
+static int32_t al_camera_follow_axis(int32_t pos, int p1, int p2, int z1, int z2,
+					int32_t speed)
+{
+	int32_t goal = pos;
 
-	/* Current tile size, related to tileset. */
-	int w;
-	int h;
+	if (p2 - p1 > z2 - z1)
+		goal = CAMERA_FIXED(p1 + p2 - z1 - z2) / 2; /* Too big, center it */
+	else if (CAMERA_FIXED(p1 - z1) < pos)
+		goal = CAMERA_FIXED(p1 - z1);
+	else if (CAMERA_FIXED(p2 - z2) > pos)
+		goal = CAMERA_FIXED(p2 - z2);
 
-	/* The direction sprite face to, tile selecting */
-	ALLEGRO_SPRITE_DIRECTION direction;
+	/* The last fraction of a pixel is not worth easing */
+	if (abs(goal - pos) < CAMERA_ONE)
+		return goal;
+	return pos + (int32_t)(((int64_t)(goal - pos) * speed) >> CAMERA_SHIFT);
+}
 
-	ALLEGRO_SPRITE_ACTION actions[MAX_ACTIONS];
-	ALLEGRO_SPRITE_ACTION *action; /* Selected action, pointer to actions[?] */
-	int action_count;
-};
+/*
+ * Move toward a view of the map rectangle x, y, w, h inside the dead
+ * zone, call once per tick. Returns true if the view moved by a pixel.
+ */
+bool al_camera_follow(ALLEGRO_CAMERA *c, int x, int y, int w, int h)
+{
+	int old_x = al_camera_get_x(c);
+	int old_y = al_camera_get_y(c);
 
-void al_dump_sprite(ALLEGRO_SPRITE *s)
+	c->x = al_camera_follow_axis(c->x, x, x + w,
+				c->dead_zone.x1, c->dead_zone.x2, c->follow_speed);
+	c->y = al_camera_follow_axis(c->y, y, y + h,
+				c->dead_zone.y1, c->dead_zone.y2, c->follow_speed);
+	al_clamp_camera(c);
+	return al_camera_get_x(c) != old_x || al_camera_get_y(c) != old_y;
+}
+
+/* Whole pixel position used for drawing */
+int al_camera_get_x(ALLEGRO_CAMERA *c)
 {
-	int i, j, t;
+	return c->x >> CAMERA_SHIFT;
+}
 
-	if (!s)
-		return;
+int al_camera_get_y(ALLEGRO_CAMERA *c)
+{
+	return c->y >> CAMERA_SHIFT;
+}
 
-	printf("Sprite: pos (%d, %d), %d tilesets.\n", s->x, s->y, s->tileset_count);
-
-	for (i = 0; i < s->tileset_count; i++) {
-		printf("\nTileset %2d: %d layers\n", i+1, s->tilesets[i].layer_count);
-		for (j = 0; j < s->tilesets[i].layer_count; j++) {
-			printf("\tLayer %2d: %d tiles\n", j+1, s->tilesets[i].layers[j].tile_count);
-			printf("\t\tImage file:   %s\n", s->tilesets[i].layers[j].image_file);
-			printf("\t\tImage Width:  %4d\n", s->tilesets[i].layers[j].image_width);
-			printf("\t\tImage Height: %4d\n", s->tilesets[i].layers[j].image_height);
-			printf("\t\tTile width:   %4d\n", s->tilesets[i].layers[j].tile_width);
-			printf("\t\tTile height:  %4d\n", s->tilesets[i].layers[j].tile_height);
-			printf("\t\tTile %2d:\n", j+1);
-			for (t = 0; t < s->tilesets[i].layers[j].tile_count; t++) {
-				printf("\t\t\t\t%02d: %4d, %4d\n", t+1,
-						s->tilesets[i].layers[j].tiles[t].x,
-						s->tilesets[i].layers[j].tiles[t].y);
-			}
-		}
-	}
-	printf("\n");
+int al_camera_get_width(ALLEGRO_CAMERA *c)
+{
+	return c->width;
 }
 
-int al_destroy_sprite(ALLEGRO_SPRITE *s)
+int al_camera_get_height(ALLEGRO_CAMERA *c)
 {
-	int i, j;
+	return c->height;
+}
 
-	if (s->dir)
-		free(s->dir);
+/***************************************************************************************/
+/********** Sprite Draw ****************************************************************/
+/***************************************************************************************/
 
-	if (!s->tilesets)
-		return 0;
+/* Frames to draw for a sprite, NULL if it has none */
+static ALLEGRO_SPRITE_FRAME *al_sprite_frames(ALLEGRO_SPRITE *s, int *layer_count)
+{
+	ALLEGRO_SPRITE_TILESET *tileset;
+	int frame_id;
 
-	for (i = 0; i < s->tileset_count; i++) {
-		if (!s->tilesets[i].layers)
-			continue;
+	if (!s->action || (unsigned)s->direction > ALLEGRO_SPRITE_LEFT)
+		return NULL;
 
-		for (j = 0; j < s->tilesets[i].layer_count; j++) {
-			if (s->tilesets[i].layers[j].image_file)
-				free(s->tilesets[i].layers[j].image_file);
+	if (s->def->reloaded)
+		al_sprite_follow_reload(s);
 
-			if (s->tilesets[i].layers[j].bitmap)
-				al_destroy_bitmap(s->tilesets[i].layers[j].bitmap);
+	tileset = &(s->def->tilesets[s->action->tileset_id]);
 
-			if (s->tilesets[i].layers[j].tiles)
-				free(s->tilesets[i].layers[j].tiles);
-		}
-		free(s->tilesets[i].layers);
-	}
+	frame_id = s->direction * tileset->frame_count +
+				s->action->counter % tileset->frame_count;
 
-	free(s->tilesets);
-	free(s);
-	return 0;
+	/* Layers of a frame are adjacent in the table */
+	if (tileset->flat) {
+		*layer_count = 1;
+		return &tileset->flat_frames[frame_id];
+	}
+	*layer_count = tileset->layer_count;
+	return &tileset->frames[frame_id * tileset->layer_count];
 }
 
+/* Counts of al_draw_sprite() and al_draw_sprites(), only the drawing thread draws */
+static ALLEGRO_SPRITE_DRAW_STATS al_sprite_draw_stats;
 
-/***************************************************************************************/
-/********** Parse Sprite Data From JSON File *******************************************/
-/***************************************************************************************/
+void al_get_sprite_draw_stats(ALLEGRO_SPRITE_DRAW_STATS *stats)
+{
+	*stats = al_sprite_draw_stats;
+}
 
-static int al_parse_sprite_tiles(ALLEGRO_SPRITE_TILE *tiles, cJSON *obj)
+/* Where s is drawn on the target */
+static void al_sprite_screen_pos(ALLEGRO_SPRITE *s, int *x, int *y)
 {
-	int i, size = 0;
+	if (al_sprite_camera) {
+		*x = s->x - al_camera_get_x(al_sprite_camera);
+		*y = s->y - al_camera_get_y(al_sprite_camera);
+	} else {
+		*x = s->x - s->map_x;
+		*y = s->y - s->map_y;
+	}
+}
 
-	if (!obj || !cJSON_IsArray(obj))
-		ERROR_RETURN(-1);
+/* Screen bounds of the frames, the layers may differ in size */
+static void al_sprite_bounds(ALLEGRO_SPRITE *s, ALLEGRO_SPRITE_FRAME *frame,
+				int layer_count, ALLEGRO_SPRITE_RECT *r)
+{
+	int i, w = 0, h = 0;
 
-	size = cJSON_GetArraySize(obj);
-	for (i = 0; i < size; i++) {
-		cJSON *item, *item_x, *item_y;
+	for (i = 0; i < layer_count; i++) {
+		if (frame[i].sw > w) w = frame[i].sw;
+		if (frame[i].sh > h) h = frame[i].sh;
+	}
+	al_sprite_screen_pos(s, &r->x1, &r->y1);
+	r->x2 = r->x1 + w;
+	r->y2 = r->y1 + h;
+}
 
-		item = cJSON_GetArrayItem(obj, i);
-		if (!item || !cJSON_IsObject(item))
-			ERROR_RETURN(-1);
+/* The part of the target drawing can reach */
+static void al_sprite_viewport(ALLEGRO_SPRITE_RECT *view)
+{
+	int x, y, w, h;
 
-		item_x = cJSON_GetObjectItem(item, "x");
-		if (!item_x || !cJSON_IsNumber(item_x))
-			ERROR_RETURN(-1);
+	al_get_clipping_rectangle(&x, &y, &w, &h);
+	view->x1 = x;
+	view->y1 = y;
+	view->x2 = x + w;
+	view->y2 = y + h;
+}
 
-		item_y = cJSON_GetObjectItem(item, "y");
-		if (!item_y || !cJSON_IsNumber(item_y))
-			ERROR_RETURN(-1);
+/* Whether the frames of s fall outside view, counted either way */
+static bool al_sprite_culled(ALLEGRO_SPRITE *s, ALLEGRO_SPRITE_FRAME *frame,
+				int layer_count, const ALLEGRO_SPRITE_RECT *view)
+{
+	ALLEGRO_SPRITE_RECT r;
 
-		tiles[i].x = (int)item_x->valuedouble;
-		tiles[i].y = (int)item_y->valuedouble;
+	al_sprite_bounds(s, frame, layer_count, &r);
+	if (r.x2 <= view->x1 || r.x1 >= view->x2 ||
+		r.y2 <= view->y1 || r.y1 >= view->y2) {
+		al_sprite_draw_stats.culled++;
+		return true;
 	}
-	return 0;
+	al_sprite_draw_stats.drawn++;
+	return false;
 }
 
-static int al_parse_sprite_layer(ALLEGRO_SPRITE *s,
-				ALLEGRO_SPRITE_TILE_LAYER *layer, cJSON *obj)
+/* Sprites outside the clipping rectangle are skipped before their images
+ * are touched, so they don't bring evicted images back either */
+int al_draw_sprite(ALLEGRO_SPRITE *s)
 {
-	char *path;
-	cJSON *item, *item_s, *item_t;
-	int w, h, c;
+	int i;
+	int layer_count;
+	int x, y;
+	ALLEGRO_SPRITE_FRAME *frame;
+	ALLEGRO_SPRITE_RECT view;
+	ALLEGRO_BITMAP *bitmap;
 
-	memset(layer, 0, sizeof(ALLEGRO_SPRITE_TILE_LAYER));
+	frame = al_sprite_frames(s, &layer_count);
+	if (!frame)
+		return -1;
 
-	/* Parse image info */
-	item = cJSON_GetObjectItem(obj, "image");
-	if (!item || !cJSON_IsObject(item))
-		ERROR_RETURN(-1);
+	al_sprite_viewport(&view);
+	if (al_sprite_culled(s, frame, layer_count, &view))
+		return 0;
 
-	/* Image file path */
-	item_s = cJSON_GetObjectItem(item, "file");
-	if (!item_s || !cJSON_IsString(item_s))
-		ERROR_RETURN(-1);
-	layer->image_file = malloc(strlen(item_s->valuestring)+2);
-	if (!layer->image_file)
-		ERROR_RETURN(-1);
-	strcpy(layer->image_file, item_s->valuestring);
+	al_sprite_screen_pos(s, &x, &y);
 
-	/* Image size, width X height */
-	item_s = cJSON_GetObjectItem(item, "size");
-	if (!item_s || !cJSON_IsObject(item_s))
-		ERROR_RETURN(-1);
+	for (i = 0; i < layer_count; i++, frame++) {
+		bitmap = al_use_sprite_image(frame->image);
+		if (!bitmap)
+			continue;
+		al_draw_bitmap_region(bitmap,
+				frame->sx, frame->sy, frame->sw, frame->sh,
+				x, y, 0);
+	}
+	return 0;
+}
 
-	item_t = cJSON_GetObjectItem(item_s, "w");
-	if (!item_t || !cJSON_IsNumber(item_t))
-		ERROR_RETURN(-1);
-	layer->image_width = (int)item_t->valuedouble;
+/* Batches al_draw_sprites() looks back through for one to join */
+#define BATCH_WINDOW	16
 
-	item_t = cJSON_GetObjectItem(item_s, "h");
-	if (!item_t || !cJSON_IsNumber(item_t))
-		ERROR_RETURN(-1);
-	layer->image_height = (int)item_t->valuedouble;
+/* One layer blit, chained to the next blit of its batch */
+typedef struct {
+	ALLEGRO_SPRITE_IMAGE *image; /* Pinned until the blit is drawn */
+	const ALLEGRO_SPRITE_FRAME *frame;
+	float dx;
+	float dy;
+	int next;
+} ALLEGRO_SPRITE_BLIT;
 
-	/* Parse tile info */
-	item = cJSON_GetObjectItem(obj, "tiles");
-	if (!item || !cJSON_IsObject(item))
-		ERROR_RETURN(-1);
+/* Blits of one bitmap drawn together, with their bounding box */
+typedef struct {
+	ALLEGRO_BITMAP *bitmap;
+	float x1, y1, x2, y2;
+	int first;
+	int last;
+} ALLEGRO_SPRITE_BATCH;
 
-	/* Parse tile count */
-	item_s = cJSON_GetObjectItem(item, "count");
-	if (!item_s || !cJSON_IsNumber(item_s))
-		ERROR_RETURN(-1);
-	c = (int)item_s->valuedouble;
+/* Scratch of al_draw_sprites(), only used by the drawing thread */
+static ALLEGRO_SPRITE_BLIT *al_sprite_blits = NULL;
+static ALLEGRO_SPRITE_BATCH *al_sprite_batches = NULL;
+static int al_sprite_blit_max = 0;
 
-	/* Parse tile size */
-	item_s = cJSON_GetObjectItem(item, "size");
-	if (!item_s || !cJSON_IsObject(item_s))
-		ERROR_RETURN(-1);
+static int al_reserve_sprite_blits(int n)
+{
+	ALLEGRO_SPRITE_BLIT *blits;
+	ALLEGRO_SPRITE_BATCH *batches;
+	int max;
 
-	item_t = cJSON_GetObjectItem(item_s, "w");
-	if (!item_t || !cJSON_IsNumber(item_t))
-		ERROR_RETURN(-1);
-	w = (int)item_t->valuedouble;
+	if (n <= al_sprite_blit_max)
+		return 0;
 
-	item_t = cJSON_GetObjectItem(item_s, "h");
-	if (!item_t || !cJSON_IsNumber(item_t))
+	for (max = al_sprite_blit_max ? al_sprite_blit_max : 256; max < n; )
+		max *= 2;
+	blits = realloc(al_sprite_blits, sizeof(ALLEGRO_SPRITE_BLIT) * max);
+	if (!blits)
 		ERROR_RETURN(-1);
-	h = (int)item_t->valuedouble;
-
-	/* malloc tiles array */
-	layer->tiles = malloc(sizeof(ALLEGRO_SPRITE_TILE) * c);
-	if (!layer->tiles)
+	al_sprite_blits = blits;
+	batches = realloc(al_sprite_batches, sizeof(ALLEGRO_SPRITE_BATCH) * max);
+	if (!batches)
 		ERROR_RETURN(-1);
+	al_sprite_batches = batches;
+	al_sprite_blit_max = max;
+	return 0;
+}
 
-	layer->tile_count = c;
-	layer->tile_width = w;
-	layer->tile_height = h;
-	layer->tiles_down = &(layer->tiles[0]);
-	layer->tiles_up = &(layer->tiles[c/4]);
-	layer->tiles_right = &(layer->tiles[c*2/4]);
-	layer->tiles_left = &(layer->tiles[c*3/4]);
+/* Release the images pinned by the first count blits */
+static void al_unpin_sprite_blits(int count)
+{
+	int i;
 
-	/* Parse tiles */
-	item_s = cJSON_GetObjectItem(item, "face_down");
-	if (!item_s || !cJSON_IsArray(item_s))
-		ERROR_RETURN(-1);
-	if (al_parse_sprite_tiles(layer->tiles_down, item_s))
-		ERROR_RETURN(-1);
+	for (i = 0; i < count; i++)
+		al_sprite_blits[i].image->pins--;
+}
 
-	item_s = cJSON_GetObjectItem(item, "face_up");
-	if (!item_s || !cJSON_IsArray(item_s))
-		ERROR_RETURN(-1);
-	if (al_parse_sprite_tiles(layer->tiles_up, item_s))
-		ERROR_RETURN(-1);
+/*
+ * Draw n sprites as if by al_draw_sprite() in list order, with blits of
+ * the same bitmap grouped to save texture switches. A blit only moves
+ * ahead of batches it doesn't overlap, so overlapping sprites still
+ * stack in list order. Drawing is held while the batches are drawn.
+ * Sprites are culled as by al_draw_sprite().
+ */
+int al_draw_sprites(ALLEGRO_SPRITE **list, int n)
+{
+	ALLEGRO_SPRITE_BLIT *b;
+	ALLEGRO_SPRITE_BATCH *batch;
+	ALLEGRO_SPRITE_FRAME *frame;
+	ALLEGRO_SPRITE_RECT view;
+	ALLEGRO_BITMAP *bitmap;
+	float x1, y1, x2, y2;
+	int blit_count = 0, batch_count = 0;
+	int layer_count, i, j, k, target;
+	int x, y;
+	bool held;
 
-	item_s = cJSON_GetObjectItem(item, "face_right");
-	if (!item_s || !cJSON_IsArray(item_s))
-		ERROR_RETURN(-1);
-	if (al_parse_sprite_tiles(layer->tiles_right, item_s))
-		ERROR_RETURN(-1);
+	al_sprite_viewport(&view);
+	for (i = 0; i < n; i++) {
+		frame = al_sprite_frames(list[i], &layer_count);
+		if (!frame || al_sprite_culled(list[i], frame, layer_count, &view))
+			continue;
+		if (al_reserve_sprite_blits(blit_count + layer_count)) {
+			al_unpin_sprite_blits(blit_count);
+			ERROR_RETURN(-1);
+		}
+		al_sprite_screen_pos(list[i], &x, &y);
 
-	item_s = cJSON_GetObjectItem(item, "face_left");
-	if (!item_s || !cJSON_IsArray(item_s))
-		ERROR_RETURN(-1);
-	if (al_parse_sprite_tiles(layer->tiles_left, item_s))
-		ERROR_RETURN(-1);
+		for (j = 0; j < layer_count; j++, frame++) {
+			bitmap = al_use_sprite_image(frame->image);
+			if (!bitmap)
+				continue;
 
-	/* Load image file to bitmap */
-	path = malloc(strlen(s->dir)+strlen(layer->image_file)+10);
-	if (!path)
-		ERROR_RETURN(-1);
-	sprintf(path, "%s/%s", s->dir, layer->image_file);
-	layer->bitmap = al_load_bitmap(path);
-	if (!layer->bitmap) {
-		free(path);
-		ERROR_RETURN(-1);
+			frame->image->pins++;
+			b = &al_sprite_blits[blit_count];
+			b->image = frame->image;
+			b->frame = frame;
+			b->dx = x;
+			b->dy = y;
+			b->next = -1;
+			x1 = b->dx;
+			y1 = b->dy;
+			x2 = x1 + frame->sw;
+			y2 = y1 + frame->sh;
+
+			/* Latest batch of this bitmap, unless a later one is in the way */
+			target = -1;
+			for (k = batch_count - 1; k >= 0 && k >= batch_count - BATCH_WINDOW; k--) {
+				batch = &al_sprite_batches[k];
+				if (batch->bitmap == bitmap) {
+					target = k;
+					break;
+				}
+				if (x1 < batch->x2 && batch->x1 < x2 &&
+					y1 < batch->y2 && batch->y1 < y2)
+					break;
+			}
+
+			if (target < 0) {
+				batch = &al_sprite_batches[batch_count++];
+				batch->bitmap = bitmap;
+				batch->x1 = x1;
+				batch->y1 = y1;
+				batch->x2 = x2;
+				batch->y2 = y2;
+				batch->first = blit_count;
+			} else {
+				batch = &al_sprite_batches[target];
+				al_sprite_blits[batch->last].next = blit_count;
+				if (x1 < batch->x1) batch->x1 = x1;
+				if (y1 < batch->y1) batch->y1 = y1;
+				if (x2 > batch->x2) batch->x2 = x2;
+				if (y2 > batch->y2) batch->y2 = y2;
+			}
+			batch->last = blit_count++;
+		}
 	}
-	free(path);
+
+	held = al_is_bitmap_drawing_held();
+	al_hold_bitmap_drawing(true);
+	for (k = 0; k < batch_count; k++) {
+		for (i = al_sprite_batches[k].first; i >= 0; i = b->next) {
+			b = &al_sprite_blits[i];
+			bitmap = b->image->bitmap;
+			if (!bitmap)
+				continue;
+			al_draw_bitmap_region(bitmap,
+					b->frame->sx, b->frame->sy, b->frame->sw, b->frame->sh,
+					b->dx, b->dy, 0);
+		}
+	}
+	al_hold_bitmap_drawing(held);
+	al_unpin_sprite_blits(blit_count);
 	return 0;
 }
 
-static int al_parse_sprite_tileset(ALLEGRO_SPRITE *s,
-				ALLEGRO_SPRITE_TILESET *tileset, cJSON *obj)
+/***************************************************************************************/
+/********** Render Queue ***************************************************************/
+/***************************************************************************************/
+
+/*
+ * Sprites drawn back to front by foot position (y + h), so a sprite
+ * standing lower on screen overlaps the ones behind it. The order is
+ * kept between frames and repaired by insertion sort, which is linear
+ * when only a few sprites moved.
+ *
+ * With a background set, the queue draws in dirty rectangle mode: the
+ * target keeps the last frame, and only where a sprite moved, changed
+ * frame or left the queue is the background restored and the sprites
+ * there drawn again.
+ */
+/* What a sprite looked like at the last draw */
+typedef struct {
+	ALLEGRO_SPRITE_FRAME *frame;
+	ALLEGRO_SPRITE_RECT rect;
+} ALLEGRO_SPRITE_DRAWN;
+
+struct _ALLEGRO_SPRITE_QUEUE {
+	ALLEGRO_SPRITE **sprites;
+	int *keys; /* Foot y of sprites[] at the last sort */
+	ALLEGRO_SPRITE_DRAWN *drawn; /* State of sprites[] at the last draw */
+	ALLEGRO_SPRITE **list; /* Scratch, sprites of one dirty rectangle */
+	int count;
+	int max;
+
+	/* Dirty rectangle mode */
+	ALLEGRO_BITMAP *background;
+	bool full; /* Redraw everything at the next draw */
+	ALLEGRO_SPRITE_RECT *damage; /* Disjoint areas to redraw */
+	int damage_count;
+	int damage_max;
+	ALLEGRO_SPRITE_RECT damage_box; /* Bounds of the last redraw */
+};
+
+ALLEGRO_SPRITE_QUEUE *al_create_sprite_queue(void)
+{
+	return calloc(1, sizeof(ALLEGRO_SPRITE_QUEUE));
+}
+
+void al_destroy_sprite_queue(ALLEGRO_SPRITE_QUEUE *q)
 {
-	int ret = 0;
-	int count = 0, i;
-	cJSON *item, *item_s;
+	if (!q)
+		return;
+	free(q->sprites);
+	free(q->keys);
+	free(q->drawn);
+	free(q->list);
+	free(q->damage);
+	free(q);
+}
 
-	memset(tileset, 0, sizeof(ALLEGRO_SPRITE_TILESET));
+/* Add r to the damage, merged with every area it touches */
+static int al_add_sprite_damage(ALLEGRO_SPRITE_QUEUE *q, ALLEGRO_SPRITE_RECT r)
+{
+	ALLEGRO_SPRITE_RECT *d;
+	int i, max;
 
-	item = cJSON_GetObjectItem(obj, "layers");
-	if (!item || !cJSON_IsArray(item))
-		ERROR_RETURN(-1);
+	if (r.x1 >= r.x2 || r.y1 >= r.y2)
+		return 0;
 
-	count = cJSON_GetArraySize(item);
+	for (i = 0; i < q->damage_count; ) {
+		d = &q->damage[i];
+		if (r.x1 > d->x2 || d->x1 > r.x2 || r.y1 > d->y2 || d->y1 > r.y2) {
+			i++;
+			continue;
+		}
+		if (d->x1 < r.x1) r.x1 = d->x1;
+		if (d->y1 < r.y1) r.y1 = d->y1;
+		if (d->x2 > r.x2) r.x2 = d->x2;
+		if (d->y2 > r.y2) r.y2 = d->y2;
 
-	/* Alloc layers array */
-	tileset->layers = malloc(sizeof(ALLEGRO_SPRITE_TILE_LAYER) * count);
-	if (!tileset->layers)
-		ERROR_RETURN(-1);
-	tileset->layer_count = count;
+		/* The union may touch areas already passed */
+		*d = q->damage[--q->damage_count];
+		i = 0;
+	}
 
-	/* Parse layers */
-	for (i = 0; i < count; i++) {
-		item_s = cJSON_GetArrayItem(item, i);
-		ret = al_parse_sprite_layer(s, &tileset->layers[i], item_s);
-		if (ret)
+	if (q->damage_count == q->damage_max) {
+		max = q->damage_max ? q->damage_max * 2 : 16;
+		d = realloc(q->damage, sizeof(ALLEGRO_SPRITE_RECT) * max);
+		if (!d)
 			ERROR_RETURN(-1);
+		q->damage = d;
+		q->damage_max = max;
 	}
+	q->damage[q->damage_count++] = r;
 	return 0;
 }
 
-static int al_parse_sprite(ALLEGRO_SPRITE *s, cJSON *obj)
+/* The queue doesn't own its sprites, remove them before destroying */
+int al_sprite_queue_add(ALLEGRO_SPRITE_QUEUE *q, ALLEGRO_SPRITE *s)
 {
-	int i, ret = 0;
-	int count = 0;
-	cJSON *item;
-
-	if (!s || !obj)
-		ERROR_RETURN(-1);
+	ALLEGRO_SPRITE **sprites;
+	ALLEGRO_SPRITE_DRAWN *drawn;
+	int *keys;
+	int max;
 
-	item = obj->child;
-	if (!item)
+	if (!q || !s)
 		ERROR_RETURN(-1);
 
-	/* Get tilesets count */
-	while(item) {
-		count++;
-		item = item->next;
+	if (q->count == q->max) {
+		max = q->max ? q->max * 2 : 16;
+		sprites = realloc(q->sprites, sizeof(ALLEGRO_SPRITE *) * max);
+		if (!sprites)
+			ERROR_RETURN(-1);
+		q->sprites = sprites;
+		keys = realloc(q->keys, sizeof(int) * max);
+		if (!keys)
+			ERROR_RETURN(-1);
+		q->keys = keys;
+		drawn = realloc(q->drawn, sizeof(ALLEGRO_SPRITE_DRAWN) * max);
+		if (!drawn)
+			ERROR_RETURN(-1);
+		q->drawn = drawn;
+		sprites = realloc(q->list, sizeof(ALLEGRO_SPRITE *) * max);
+		if (!sprites)
+			ERROR_RETURN(-1);
+		q->list = sprites;
+		q->max = max;
 	}
 
-	s->tilesets = malloc(sizeof(ALLEGRO_SPRITE_TILESET) * count);
-	if (!s->tilesets)
-		ERROR_RETURN(-1);
-	s->tileset_count = count;
-
-	item = obj->child;
-	for (i = 0; i < s->tileset_count; i++) {
-		ret = al_parse_sprite_tileset(s, &s->tilesets[i], item);
-		if (ret)
-			ERROR_RETURN(ret);
-		item = item->next;
-	}
+	/* Goes to its place at the next sort, not drawn yet */
+	q->sprites[q->count] = s;
+	q->keys[q->count] = s->y + s->h;
+	memset(&q->drawn[q->count], 0, sizeof(ALLEGRO_SPRITE_DRAWN));
+	q->count++;
 	return 0;
 }
 
-static cJSON *al_json_parse(const char *filepath)
+int al_sprite_queue_remove(ALLEGRO_SPRITE_QUEUE *q, ALLEGRO_SPRITE *s)
 {
-	FILE *fp = NULL;
-	char *data = NULL;
-	int size = 0;
-	cJSON *json = NULL;
+	int i;
 
-	fp = fopen(filepath, "r");
-	if (!fp) {
-		fprintf(stderr, "Open file [%s] error!\n", filepath);
-		goto exit;
+	for (i = 0; i < q->count; i++) {
+		if (q->sprites[i] == s)
+			break;
 	}
+	if (i == q->count)
+		ERROR_RETURN(-1);
 
-	fseek(fp, 0, SEEK_END);
-	size = ftell(fp);
-	fseek(fp, 0, SEEK_SET);
+	/* Uncover where it was drawn */
+	if (q->background && al_add_sprite_damage(q, q->drawn[i].rect))
+		q->full = true;
 
-	data = malloc(size);
-	if (!data) {
-		fprintf(stderr, "Can't malloc memory, %d bytes\n", size);
-		goto exit;
-	}
+	/* Keep the order of the rest */
+	q->count--;
+	memmove(&q->sprites[i], &q->sprites[i + 1], sizeof(ALLEGRO_SPRITE *) * (q->count - i));
+	memmove(&q->keys[i], &q->keys[i + 1], sizeof(int) * (q->count - i));
+	memmove(&q->drawn[i], &q->drawn[i + 1], sizeof(ALLEGRO_SPRITE_DRAWN) * (q->count - i));
+	return 0;
+}
+
+/*
+ * Draw the queue in dirty rectangle mode over background, which is drawn
+ * at (0, 0) of the target. The target must keep its pixels between
+ * draws, for the display that means a copying swap method, see
+ * ALLEGRO_SWAP_METHOD. NULL goes back to drawing everything.
+ */
+void al_set_sprite_queue_background(ALLEGRO_SPRITE_QUEUE *q, ALLEGRO_BITMAP *background)
+{
+	q->background = background;
+	q->damage_count = 0;
+	q->full = true;
+}
 
-	fread(data, 1, size, fp);
+/* Redraw everything at the next draw, when the target lost its pixels */
+void al_invalidate_sprite_queue(ALLEGRO_SPRITE_QUEUE *q)
+{
+	q->full = true;
+}
 
-	json = cJSON_Parse(data);
-	if (!json)
-		fprintf(stderr, "Parse json data error!\n");
+/* Bounds of what the last draw in dirty rectangle mode changed, false if nothing */
+bool al_get_sprite_queue_damage(ALLEGRO_SPRITE_QUEUE *q, int *x, int *y, int *w, int *h)
+{
+	ALLEGRO_SPRITE_RECT *r = &q->damage_box;
 
-exit:
-	if (fp)
-		fclose(fp);
-	if (data)
-		free(data);
-	return json;
+	*x = r->x1;
+	*y = r->y1;
+	*w = r->x2 - r->x1;
+	*h = r->y2 - r->y1;
+	return *w > 0 && *h > 0;
 }
 
-ALLEGRO_SPRITE *al_load_sprite(const char *dir, const char *filename)
+/* Restore back to front order, equal keys keep their order */
+static void al_sort_sprite_queue(ALLEGRO_SPRITE_QUEUE *q)
 {
-	int ret;
-	cJSON *json;
 	ALLEGRO_SPRITE *s;
-	char *path;
+	ALLEGRO_SPRITE_DRAWN drawn;
+	int i, j, key;
 
-	path = malloc(strlen(dir)+strlen(filename)+10);
-	if (!path)
-		return NULL;
+	for (i = 0; i < q->count; i++)
+		q->keys[i] = q->sprites[i]->y + q->sprites[i]->h;
 
-	s = malloc(sizeof(ALLEGRO_SPRITE));
-	if (!s) {
-		free(path);
-		return NULL;
+	for (i = 1; i < q->count; i++) {
+		key = q->keys[i];
+		if (q->keys[i - 1] <= key)
+			continue;
+
+		s = q->sprites[i];
+		drawn = q->drawn[i];
+		for (j = i; j > 0 && q->keys[j - 1] > key; j--) {
+			q->keys[j] = q->keys[j - 1];
+			q->sprites[j] = q->sprites[j - 1];
+			q->drawn[j] = q->drawn[j - 1];
+		}
+		q->keys[j] = key;
+		q->sprites[j] = s;
+		q->drawn[j] = drawn;
 	}
+}
 
-	memset(s, 0, sizeof(ALLEGRO_SPRITE));
+/* Frames and screen bounds s is drawn with now */
+static void al_get_sprite_drawn(ALLEGRO_SPRITE *s, ALLEGRO_SPRITE_DRAWN *drawn)
+{
+	ALLEGRO_SPRITE_FRAME *frame;
+	int layer_count;
 
-	sprintf(path, "%s/%s", dir, filename);
-	json = al_json_parse(path);
+	memset(drawn, 0, sizeof(ALLEGRO_SPRITE_DRAWN));
+	frame = al_sprite_frames(s, &layer_count);
+	if (!frame)
+		return;
 
-	s->dir = path;
-	strcpy(s->dir, dir);
+	drawn->frame = frame;
+	al_sprite_bounds(s, frame, layer_count, &drawn->rect);
+}
 
-	ret = al_parse_sprite(s, json);
-	if (ret) {
-		al_destroy_sprite(s);
-		return NULL;
-	}
+/* Redraw the damaged areas of the target, see al_set_sprite_queue_background() */
+static int al_draw_sprite_queue_dirty(ALLEGRO_SPRITE_QUEUE *q)
+{
+	ALLEGRO_BITMAP *target = al_get_target_bitmap();
+	ALLEGRO_SPRITE_DRAWN now;
+	ALLEGRO_SPRITE_RECT *r, *box = &q->damage_box;
+	ALLEGRO_SPRITE_RECT screen = {0, 0, al_get_bitmap_width(target), al_get_bitmap_height(target)};
+	int cx, cy, cw, ch;
+	int i, j, n, redrawn = 0;
+	bool held;
 
-	//al_dump_sprite(s);
-	return s;
-}
+	/* Damage of sprites that moved or changed frame, old and new place */
+	for (i = 0; i < q->count; i++) {
+		al_get_sprite_drawn(q->sprites[i], &now);
+		if (!memcmp(&now, &q->drawn[i], sizeof(now)))
+			continue;
+		if (!q->full && (al_add_sprite_damage(q, q->drawn[i].rect) ||
+					al_add_sprite_damage(q, now.rect)))
+			q->full = true;
+		q->drawn[i] = now;
+	}
 
-/***************************************************************************************/
-/********** Sprite Draw ****************************************************************/
-/***************************************************************************************/
+	if (q->full) {
+		q->damage_count = 0;
+		if (al_add_sprite_damage(q, screen))
+			ERROR_RETURN(-1);
+		q->full = false;
+	}
 
-int al_draw_sprite(ALLEGRO_SPRITE *s)
-{
-	int i;
-	int tileset_id;
-	int tile_id;
-	ALLEGRO_SPRITE_TILESET *tileset;
-	ALLEGRO_SPRITE_TILE *tiles;
+	memset(box, 0, sizeof(ALLEGRO_SPRITE_RECT));
+	if (q->damage_count == 0)
+		return 0;
 
-	if (!s->action)
-		return -1;
+	/* Clipping doesn't apply to held drawing, flush it first */
+	held = al_is_bitmap_drawing_held();
+	al_hold_bitmap_drawing(false);
+	al_get_clipping_rectangle(&cx, &cy, &cw, &ch);
 
-	tileset_id = s->action->tileset_id;
-	tileset = &(s->tilesets[tileset_id]);
+	for (i = 0; i < q->damage_count; i++) {
+		r = &q->damage[i];
+		if (r->x1 < screen.x1) r->x1 = screen.x1;
+		if (r->y1 < screen.y1) r->y1 = screen.y1;
+		if (r->x2 > screen.x2) r->x2 = screen.x2;
+		if (r->y2 > screen.y2) r->y2 = screen.y2;
+		if (r->x1 >= r->x2 || r->y1 >= r->y2)
+			continue;
 
-	printf("SPRITE REAL x = %d, y = %d, map_y = %d\n", s->x-s->map_x, s->y - s->map_y, s->map_y);
-	for (i = 0; i < tileset->layer_count; i++) {
-		switch (s->direction) {
-			case ALLEGRO_SPRITE_DOWN:
-				tiles = tileset->layers[i].tiles_down;
-				break;
-			case ALLEGRO_SPRITE_UP:
-				tiles = tileset->layers[i].tiles_up;
-				break;
-			case ALLEGRO_SPRITE_RIGHT:
-				tiles = tileset->layers[i].tiles_right;
-				break;
-			case ALLEGRO_SPRITE_LEFT:
-				tiles = tileset->layers[i].tiles_left;
-			default:
-				break;
+		if (redrawn++ == 0) {
+			*box = *r;
+		} else {
+			if (r->x1 < box->x1) box->x1 = r->x1;
+			if (r->y1 < box->y1) box->y1 = r->y1;
+			if (r->x2 > box->x2) box->x2 = r->x2;
+			if (r->y2 > box->y2) box->y2 = r->y2;
 		}
-		tile_id = s->action->counter % (tileset->layers[i].tile_count / 4);
 
-		al_draw_bitmap_region(tileset->layers[i].bitmap,
-				tiles[tile_id].x,
-				tiles[tile_id].y,
-				tileset->layers[i].tile_width,
-				tileset->layers[i].tile_height,
-				s->x-s->map_x, s->y-s->map_y, 0);
+		al_set_clipping_rectangle(r->x1, r->y1, r->x2 - r->x1, r->y2 - r->y1);
+		al_draw_bitmap_region(q->background, r->x1, r->y1,
+				r->x2 - r->x1, r->y2 - r->y1, r->x1, r->y1, 0);
+
+		for (j = n = 0; j < q->count; j++) {
+			if (q->drawn[j].rect.x1 < r->x2 && r->x1 < q->drawn[j].rect.x2 &&
+				q->drawn[j].rect.y1 < r->y2 && r->y1 < q->drawn[j].rect.y2)
+				q->list[n++] = q->sprites[j];
+		}
+		al_draw_sprites(q->list, n);
 	}
-	return 0;
+
+	al_set_clipping_rectangle(cx, cy, cw, ch);
+	al_hold_bitmap_drawing(held);
+	q->damage_count = 0;
+	return redrawn;
+}
+
+/*
+ * Draw the queued sprites back to front, see al_draw_sprites(). In
+ * dirty rectangle mode returns how many areas were redrawn, 0 when the
+ * target is unchanged.
+ */
+int al_draw_sprite_queue(ALLEGRO_SPRITE_QUEUE *q)
+{
+	if (!q)
+		ERROR_RETURN(-1);
+
+	al_sort_sprite_queue(q);
+	if (q->background)
+		return al_draw_sprite_queue_dirty(q);
+	return al_draw_sprites(q->sprites, q->count);
 }
 
 /***************************************************************************************/
@@ -576,18 +4684,30 @@ int al_sprite_add_action(ALLEGRO_SPRITE *s, int id, int tileset_id,
 
 int al_sprite_start_action(ALLEGRO_SPRITE *s, int id)
 {
-	if (id < 0 || id > s->action_count)
+	if (id < 0 || id >= s->action_count)
+		return -1;
+
+	/* First use of a lazy tileset loads it */
+	if (al_load_sprite_tileset(s->def, s->actions[id].tileset_id))
 		return -1;
 
 	s->action = &s->actions[id];
-	s->w = s->tilesets[s->action->tileset_id].layers[0].tile_width;
-	s->h = s->tilesets[s->action->tileset_id].layers[0].tile_height;
+	s->w = s->def->tilesets[s->action->tileset_id].layers[0].tile_width;
+	s->h = s->def->tilesets[s->action->tileset_id].layers[0].tile_height;
 
 	s->action->running = true;
 	s->action->counter = 0;
 	return 0;
 }
 
+/* Hint that an action is about to start, loads its tileset now */
+int al_sprite_prefetch_action(ALLEGRO_SPRITE *s, int id)
+{
+	if (id < 0 || id >= s->action_count)
+		return -1;
+	return al_load_sprite_tileset(s->def, s->actions[id].tileset_id);
+}
+
 void al_sprite_update_action(ALLEGRO_SPRITE *s)
 {
 	if (!s->action)
@@ -596,7 +4716,7 @@ void al_sprite_update_action(ALLEGRO_SPRITE *s)
 		return;
 
 	s->action->counter++;
-	if (s->action->counter >= 2520)
+	if (s->action->counter >= ALLEGRO_SPRITE_COUNTER_MAX)
 		s->action->counter = 0;
 }
 
@@ -8,14 +8,118 @@ typedef enum {
 	ALLEGRO_SPRITE_LEFT = 3,
 } ALLEGRO_SPRITE_DIRECTION;
 
+/* Flags for al_set_new_sprite_flags() */
+enum {
+	ALLEGRO_SPRITE_FLATTEN = 1 << 0, /* Composite layers at load time */
+	ALLEGRO_SPRITE_LAZY = 1 << 1, /* Load tilesets on first use */
+};
+
+/* Flags for al_set_sprite_memory_budget() */
+enum {
+	ALLEGRO_SPRITE_KEEP_MEMORY_COPY = 1 << 0, /* Evict to memory, not to disk */
+};
+
+typedef struct {
+	unsigned long hits; /* Draws of a resident image */
+	unsigned long misses; /* Draws that restored an evicted image */
+	unsigned long evictions;
+	size_t resident; /* Bytes of resident images */
+	size_t budget; /* 0 for no limit */
+} ALLEGRO_SPRITE_MEMORY_STATS;
+
+typedef struct {
+	unsigned long drawn; /* Sprites drawn */
+	unsigned long culled; /* Sprites skipped outside the clipping rectangle */
+} ALLEGRO_SPRITE_DRAW_STATS;
+
+typedef struct _ALLEGRO_SPRITE_DEF ALLEGRO_SPRITE_DEF;
 typedef struct _ALLEGRO_SPRITE ALLEGRO_SPRITE;
+typedef struct _ALLEGRO_SPRITE_LOADER ALLEGRO_SPRITE_LOADER;
+typedef struct _ALLEGRO_SPRITE_PAK ALLEGRO_SPRITE_PAK;
+typedef struct _ALLEGRO_SPRITE_WATCHER ALLEGRO_SPRITE_WATCHER;
+typedef struct _ALLEGRO_SPRITE_QUEUE ALLEGRO_SPRITE_QUEUE;
+typedef struct _ALLEGRO_CAMERA ALLEGRO_CAMERA;
 
+/* Emitted by a sprite loader, user.data1 is the definition and
+ * user.data2 the data passed to al_load_sprite_async(). Pass each one
+ * to al_finish_sprite_load(), which releases the event */
+#define ALLEGRO_EVENT_SPRITE_LOADED	ALLEGRO_GET_EVENT_TYPE('S', 'P', 'R', 'L')
+
+void al_set_new_sprite_flags(int flags);
+int al_get_new_sprite_flags(void);
+
+ALLEGRO_SPRITE_DEF *al_load_sprite_def(const char *dir, const char *filename);
+ALLEGRO_SPRITE_DEF *al_load_sprite_def_binary(const char *dir, const char *filename);
+int al_save_sprite_binary(ALLEGRO_SPRITE_DEF *def, const char *filepath);
+void al_dump_sprite_def(ALLEGRO_SPRITE_DEF *def);
+void al_destroy_sprite_def(ALLEGRO_SPRITE_DEF *def);
+
+ALLEGRO_SPRITE *al_create_sprite_instance(ALLEGRO_SPRITE_DEF *def);
 ALLEGRO_SPRITE *al_load_sprite(const char *dir, const char *filename);
+ALLEGRO_SPRITE *al_load_sprite_binary(const char *dir, const char *filename);
+
+ALLEGRO_SPRITE_PAK *al_open_sprite_pak(const char *filepath);
+void al_close_sprite_pak(ALLEGRO_SPRITE_PAK *pak);
+void al_mount_sprite_pak(ALLEGRO_SPRITE_PAK *pak);
+ALLEGRO_FILE *al_fopen_sprite_pak(ALLEGRO_SPRITE_PAK *pak, const char *filename);
+int al_save_sprite_pak(const char *filepath, const char **files, int n);
+
+int al_set_sprite_image_cache(const char *dir, size_t max_bytes);
+ALLEGRO_BITMAP *al_load_cached_bitmap(const char *filename);
+
+int al_build_sprite_atlas(int page_width, int page_height);
+
+void al_set_sprite_memory_budget(size_t bytes, int flags);
+void al_get_sprite_memory_stats(ALLEGRO_SPRITE_MEMORY_STATS *stats);
+int al_update_sprite_memory(void);
+
+int al_flatten_sprite_def(ALLEGRO_SPRITE_DEF *def);
+int al_set_sprite_layer_image(ALLEGRO_SPRITE_DEF *def, int tileset_id,
+				int layer_id, const char *filename);
+size_t al_get_sprite_def_resident_size(ALLEGRO_SPRITE_DEF *def);
+size_t al_get_sprite_resident_size(ALLEGRO_SPRITE *s);
+
+ALLEGRO_SPRITE_LOADER *al_create_sprite_loader(int threads);
+void al_destroy_sprite_loader(ALLEGRO_SPRITE_LOADER *loader);
+ALLEGRO_EVENT_SOURCE *al_get_sprite_loader_event_source(ALLEGRO_SPRITE_LOADER *loader);
+int al_load_sprite_async(ALLEGRO_SPRITE_LOADER *loader,
+				const char *dir, const char *filename, intptr_t data);
+ALLEGRO_SPRITE_DEF *al_finish_sprite_load(ALLEGRO_EVENT *event);
+int al_load_sprites(const char *dir, const char **files, int n, ALLEGRO_SPRITE **sprites);
+
+ALLEGRO_SPRITE_WATCHER *al_create_sprite_watcher(const char *dir);
+void al_destroy_sprite_watcher(ALLEGRO_SPRITE_WATCHER *w);
+int al_update_sprite_watcher(ALLEGRO_SPRITE_WATCHER *w);
+
+ALLEGRO_CAMERA *al_create_camera(int width, int height);
+void al_destroy_camera(ALLEGRO_CAMERA *c);
+void al_use_sprite_camera(ALLEGRO_CAMERA *c);
+void al_camera_set_map_size(ALLEGRO_CAMERA *c, int map_w, int map_h);
+void al_camera_set_dead_zone(ALLEGRO_CAMERA *c, int x, int y, int w, int h);
+void al_camera_set_follow_speed(ALLEGRO_CAMERA *c, float speed);
+void al_camera_move_to(ALLEGRO_CAMERA *c, float x, float y);
+void al_camera_move_step(ALLEGRO_CAMERA *c, float step_x, float step_y);
+bool al_camera_follow(ALLEGRO_CAMERA *c, int x, int y, int w, int h);
+int al_camera_get_x(ALLEGRO_CAMERA *c);
+int al_camera_get_y(ALLEGRO_CAMERA *c);
+int al_camera_get_width(ALLEGRO_CAMERA *c);
+int al_camera_get_height(ALLEGRO_CAMERA *c);
 
 void al_dump_sprite(ALLEGRO_SPRITE *s);
 int al_destroy_sprite(ALLEGRO_SPRITE *s);
 
 int al_draw_sprite(ALLEGRO_SPRITE *s);
+int al_draw_sprites(ALLEGRO_SPRITE **list, int n);
+void al_get_sprite_draw_stats(ALLEGRO_SPRITE_DRAW_STATS *stats);
+
+ALLEGRO_SPRITE_QUEUE *al_create_sprite_queue(void);
+void al_destroy_sprite_queue(ALLEGRO_SPRITE_QUEUE *q);
+int al_sprite_queue_add(ALLEGRO_SPRITE_QUEUE *q, ALLEGRO_SPRITE *s);
+int al_sprite_queue_remove(ALLEGRO_SPRITE_QUEUE *q, ALLEGRO_SPRITE *s);
+int al_draw_sprite_queue(ALLEGRO_SPRITE_QUEUE *q);
+void al_set_sprite_queue_background(ALLEGRO_SPRITE_QUEUE *q, ALLEGRO_BITMAP *background);
+void al_invalidate_sprite_queue(ALLEGRO_SPRITE_QUEUE *q);
+bool al_get_sprite_queue_damage(ALLEGRO_SPRITE_QUEUE *q, int *x, int *y, int *w, int *h);
 
 void al_sprite_set_map_pos(ALLEGRO_SPRITE *s, int map_x, int map_y);
 void al_sprite_set_map_size(ALLEGRO_SPRITE *s, int map_w, int map_h);
@@ -31,6 +135,7 @@ int al_sprite_get_direction(ALLEGRO_SPRITE *s);
 int al_sprite_add_action(ALLEGRO_SPRITE *s, int id, int tileset_id,
 					int counter_max, int fps_interval, bool stopable);
 int al_sprite_start_action(ALLEGRO_SPRITE *s, int id);
+int al_sprite_prefetch_action(ALLEGRO_SPRITE *s, int id);
 void al_sprite_update_action(ALLEGRO_SPRITE *s);
 void al_sprite_stop_action(ALLEGRO_SPRITE *s);
 bool al_sprite_action_running(ALLEGRO_SPRITE *s);
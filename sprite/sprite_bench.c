@@ -0,0 +1,606 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <allegro5/allegro.h>
+#include <allegro5/allegro_image.h>
+
+#include "sprite.c"
+
+/*
+ * Sprite microbenchmarks.
+ *
+ * frames: per layer source rectangle lookup, the old direction switch
+ *         against the precomputed frame table, on SPRITE_COUNT sprites.
+ * load:   every JSON sprite of SPRITE_DIR loaded LOAD_ROUNDS times, one
+ *         after another against al_load_sprites().
+ * pak:    the same sequential loads from loose files against PAK_FILE,
+ *         built by "make" with spritec -p.
+ * batch:  SPRITE_COUNT sprites of every JSON sprite of SPRITE_DIR drawn one
+ *         al_draw_sprite() at a time against one al_draw_sprites().
+ * image:  every PNG of SPRITE_DIR and its tilesets decoded, then loaded
+ *         through an empty (cold) and a filled (warm) decoded image cache.
+ * cull:   SPRITE_COUNT sprites drawn with al_draw_sprites() all on screen,
+ *         then spread over a CULL_MAP_WIDTH wide map the view scrolls on.
+ * sort:   a render queue of SPRITE_COUNT sprites with SORT_MOVES of them
+ *         moved per round, kept sorted by insertion against qsort().
+ *
+ * usage: sprite_bench [test ...], runs all tests by default.
+ */
+
+#define SPRITE_DIR   "../assets"
+#define SPRITE_FILE  "character.spb"
+#define PAK_FILE     SPRITE_DIR"/assets.pak"
+
+#define SPRITE_COUNT	10000
+#define ROUNDS		100
+
+#define MAX_FILES	64
+#define LOAD_ROUNDS	100
+
+#define IMAGE_CACHE_DIR	"sprite_bench.cache"
+#define IMAGE_ROUNDS	10
+
+#define SORT_MOVES	16
+
+#define CULL_MAP_WIDTH	7040
+
+#define BG_WIDTH		640
+#define BG_HEIGHT		480
+
+static ALLEGRO_SPRITE *sprites[SPRITE_COUNT];
+
+/* Source rectangle lookup as al_draw_sprite() used to do it */
+static void draw_sprite_switch(ALLEGRO_SPRITE *s, bool draw, long *sum)
+{
+	int i, tile_id;
+	ALLEGRO_SPRITE_TILESET *tileset;
+	ALLEGRO_SPRITE_TILE *tiles = NULL;
+
+	tileset = &(s->def->tilesets[s->action->tileset_id]);
+	for (i = 0; i < tileset->layer_count; i++) {
+		switch (s->direction) {
+			case ALLEGRO_SPRITE_DOWN:
+				tiles = tileset->layers[i].tiles_down;
+				break;
+			case ALLEGRO_SPRITE_UP:
+				tiles = tileset->layers[i].tiles_up;
+				break;
+			case ALLEGRO_SPRITE_RIGHT:
+				tiles = tileset->layers[i].tiles_right;
+				break;
+			case ALLEGRO_SPRITE_LEFT:
+				tiles = tileset->layers[i].tiles_left;
+				break;
+		}
+		tile_id = s->action->counter % (tileset->layers[i].tile_count / 4);
+
+		if (draw)
+			al_draw_bitmap_region(tileset->layers[i].image->bitmap,
+					tiles[tile_id].x, tiles[tile_id].y,
+					tileset->layers[i].tile_width,
+					tileset->layers[i].tile_height,
+					s->x-s->map_x, s->y-s->map_y, 0);
+		else
+			*sum += tiles[tile_id].x + tiles[tile_id].y +
+					tileset->layers[i].tile_width +
+					tileset->layers[i].tile_height;
+	}
+}
+
+/* Same lookup through the frame table */
+static void draw_sprite_table(ALLEGRO_SPRITE *s, bool draw, long *sum)
+{
+	int i, frame_id;
+	ALLEGRO_SPRITE_TILESET *tileset;
+	ALLEGRO_SPRITE_FRAME *frame;
+
+	if (draw) {
+		al_draw_sprite(s);
+		return;
+	}
+
+	tileset = &(s->def->tilesets[s->action->tileset_id]);
+	frame_id = s->direction * tileset->frame_count +
+				s->action->counter % tileset->frame_count;
+	frame = &tileset->frames[frame_id * tileset->layer_count];
+	for (i = 0; i < tileset->layer_count; i++, frame++)
+		*sum += frame->sx + frame->sy + frame->sw + frame->sh;
+}
+
+static double run_frames(void (*fn)(ALLEGRO_SPRITE *, bool, long *),
+			bool draw, long *sum)
+{
+	double t = al_get_time();
+	int r, i;
+
+	for (r = 0; r < ROUNDS; r++) {
+		if (draw)
+			al_hold_bitmap_drawing(true);
+		for (i = 0; i < SPRITE_COUNT; i++) {
+			fn(sprites[i], draw, sum);
+			al_sprite_update_action(sprites[i]);
+		}
+		if (draw) {
+			al_hold_bitmap_drawing(false);
+			al_flip_display();
+		}
+	}
+	return al_get_time() - t;
+}
+
+static int bench_frames(void)
+{
+	ALLEGRO_SPRITE_DEF *def;
+	ALLEGRO_SPRITE *s;
+	long sum_switch = 0, sum_table = 0;
+	double t_switch, t_table;
+	int i;
+
+	def = al_load_sprite_def_binary(SPRITE_DIR, SPRITE_FILE);
+	if (!def) {
+		fprintf(stderr, "failed to load sprite "SPRITE_FILE"!\n");
+		return -1;
+	}
+
+	srand(1);
+	for (i = 0; i < SPRITE_COUNT; i++) {
+		s = al_create_sprite_instance(def);
+		al_sprite_set_map_size(s, BG_WIDTH, BG_HEIGHT);
+		al_sprite_move_to(s, rand() % BG_WIDTH, rand() % BG_HEIGHT);
+		al_sprite_add_action(s, 0, rand() % def->tileset_count, 4, 10, true);
+		al_sprite_start_action(s, 0);
+		al_sprite_action_set_counter(s, rand() % ALLEGRO_SPRITE_COUNTER_MAX);
+		al_sprite_set_direction(s, rand() % 4);
+		sprites[i] = s;
+	}
+
+	/* Both paths must pick the same rectangles */
+	for (i = 0; i < SPRITE_COUNT; i++)
+		al_sprite_action_set_counter(sprites[i], i % ALLEGRO_SPRITE_COUNTER_MAX);
+	t_switch = run_frames(draw_sprite_switch, false, &sum_switch);
+	for (i = 0; i < SPRITE_COUNT; i++)
+		al_sprite_action_set_counter(sprites[i], i % ALLEGRO_SPRITE_COUNTER_MAX);
+	t_table = run_frames(draw_sprite_table, false, &sum_table);
+
+	printf("frames: %d sprites x %d rounds\n", SPRITE_COUNT, ROUNDS);
+	printf("  lookup switch %8.3f ms/round\n", t_switch * 1000 / ROUNDS);
+	printf("  lookup table  %8.3f ms/round%s\n", t_table * 1000 / ROUNDS,
+			sum_switch == sum_table ? "" : "  MISMATCH");
+
+	t_switch = run_frames(draw_sprite_switch, true, NULL);
+	t_table = run_frames(draw_sprite_table, true, NULL);
+	printf("  draw switch   %8.3f ms/round\n", t_switch * 1000 / ROUNDS);
+	printf("  draw table    %8.3f ms/round\n", t_table * 1000 / ROUNDS);
+
+	for (i = 0; i < SPRITE_COUNT; i++)
+		al_destroy_sprite(sprites[i]);
+	al_destroy_sprite_def(def);
+	return sum_switch == sum_table ? 0 : -1;
+}
+
+/* Files of dir with extension ext, prefixed with dir if full */
+static int list_files(const char *dir, const char *ext, bool full,
+			char **files, int max)
+{
+	struct dirent *ent;
+	const char *e;
+	DIR *d;
+	int n = 0;
+
+	d = opendir(dir);
+	if (!d)
+		return 0;
+	while ((ent = readdir(d)) && n < max) {
+		e = strrchr(ent->d_name, '.');
+		if (!e || strcmp(e, ext))
+			continue;
+		if (full) {
+			files[n] = malloc(strlen(dir) + strlen(ent->d_name) + 2);
+			sprintf(files[n++], "%s/%s", dir, ent->d_name);
+		} else {
+			files[n++] = strdup(ent->d_name);
+		}
+	}
+	closedir(d);
+	return n;
+}
+
+/* JSON sprite descriptors of dir */
+static int list_sprite_files(const char *dir, char **files, int max)
+{
+	return list_files(dir, ".json", false, files, max);
+}
+
+static int bench_load(void)
+{
+	char *files[MAX_FILES];
+	ALLEGRO_SPRITE *loaded[MAX_FILES];
+	double t, t_seq, t_pool;
+	int n, r, i, ret = 0;
+
+	n = list_sprite_files(SPRITE_DIR, files, MAX_FILES);
+	if (n == 0) {
+		fprintf(stderr, "no sprites in "SPRITE_DIR"!\n");
+		return -1;
+	}
+
+	t = al_get_time();
+	for (r = 0; r < LOAD_ROUNDS; r++) {
+		for (i = 0; i < n; i++) {
+			loaded[i] = al_load_sprite(SPRITE_DIR, files[i]);
+			if (!loaded[i])
+				ret = -1;
+		}
+		for (i = 0; i < n; i++)
+			al_destroy_sprite(loaded[i]);
+	}
+	t_seq = al_get_time() - t;
+
+	t = al_get_time();
+	for (r = 0; r < LOAD_ROUNDS; r++) {
+		if (al_load_sprites(SPRITE_DIR, (const char **)files, n, loaded) != n)
+			ret = -1;
+		for (i = 0; i < n; i++)
+			al_destroy_sprite(loaded[i]);
+	}
+	t_pool = al_get_time() - t;
+
+	printf("load: %d sprites x %d rounds, %d threads\n", n, LOAD_ROUNDS, al_get_cpu_count());
+	printf("  sequential     %8.3f ms/round\n", t_seq * 1000 / LOAD_ROUNDS);
+	printf("  al_load_sprites %7.3f ms/round, %.2fx\n", t_pool * 1000 / LOAD_ROUNDS,
+			t_seq / t_pool);
+
+	for (i = 0; i < n; i++)
+		free(files[i]);
+	return ret;
+}
+
+static double load_all(char **files, int n, int *failed)
+{
+	ALLEGRO_SPRITE *s;
+	double t = al_get_time();
+	int r, i;
+
+	for (r = 0; r < LOAD_ROUNDS; r++) {
+		for (i = 0; i < n; i++) {
+			s = al_load_sprite(SPRITE_DIR, files[i]);
+			if (!s)
+				(*failed)++;
+			al_destroy_sprite(s);
+		}
+	}
+	return al_get_time() - t;
+}
+
+static int bench_pak(void)
+{
+	ALLEGRO_SPRITE_PAK *pak;
+	char *files[MAX_FILES];
+	double t_loose, t_pak;
+	int n, i, failed = 0;
+
+	n = list_sprite_files(SPRITE_DIR, files, MAX_FILES);
+	pak = al_open_sprite_pak(PAK_FILE);
+	if (n == 0 || !pak) {
+		fprintf(stderr, "no sprites or no "PAK_FILE"!\n");
+		return -1;
+	}
+
+	t_loose = load_all(files, n, &failed);
+	al_mount_sprite_pak(pak);
+	t_pak = load_all(files, n, &failed);
+	al_mount_sprite_pak(NULL);
+	al_close_sprite_pak(pak);
+
+	printf("pak: %d sprites x %d rounds\n", n, LOAD_ROUNDS);
+	printf("  loose files    %8.3f ms/round\n", t_loose * 1000 / LOAD_ROUNDS);
+	printf("  archive        %8.3f ms/round, %.2fx\n", t_pak * 1000 / LOAD_ROUNDS,
+			t_loose / t_pak);
+
+	for (i = 0; i < n; i++)
+		free(files[i]);
+	return failed ? -1 : 0;
+}
+
+static double draw_all(bool batched)
+{
+	double t = al_get_time();
+	int r, i;
+
+	for (r = 0; r < ROUNDS; r++) {
+		if (batched) {
+			al_draw_sprites(sprites, SPRITE_COUNT);
+		} else {
+			for (i = 0; i < SPRITE_COUNT; i++)
+				al_draw_sprite(sprites[i]);
+		}
+		al_flip_display();
+	}
+	return al_get_time() - t;
+}
+
+static int bench_batch(void)
+{
+	char *files[MAX_FILES];
+	ALLEGRO_SPRITE *loaded[MAX_FILES];
+	ALLEGRO_SPRITE *s;
+	double t_single, t_batch;
+	int n, i;
+
+	n = list_sprite_files(SPRITE_DIR, files, MAX_FILES);
+	if (n == 0 || al_load_sprites(SPRITE_DIR, (const char **)files, n, loaded) != n) {
+		fprintf(stderr, "failed to load sprites of "SPRITE_DIR"!\n");
+		return -1;
+	}
+
+	srand(1);
+	for (i = 0; i < SPRITE_COUNT; i++) {
+		s = al_create_sprite_instance(loaded[i % n]->def);
+		al_sprite_set_map_size(s, BG_WIDTH, BG_HEIGHT);
+		al_sprite_move_to(s, rand() % BG_WIDTH, rand() % BG_HEIGHT);
+		al_sprite_add_action(s, 0, 0, 4, 10, true);
+		al_sprite_start_action(s, 0);
+		al_sprite_set_direction(s, rand() % 4);
+		sprites[i] = s;
+	}
+
+	t_single = draw_all(false);
+	t_batch = draw_all(true);
+	printf("batch: %d sprites of %d kinds x %d rounds\n", SPRITE_COUNT, n, ROUNDS);
+	printf("  al_draw_sprite  %7.3f ms/round\n", t_single * 1000 / ROUNDS);
+	printf("  al_draw_sprites %7.3f ms/round, %.2fx\n", t_batch * 1000 / ROUNDS,
+			t_single / t_batch);
+
+	for (i = 0; i < SPRITE_COUNT; i++)
+		al_destroy_sprite(sprites[i]);
+	for (i = 0; i < n; i++) {
+		al_destroy_sprite(loaded[i]);
+		free(files[i]);
+	}
+	return 0;
+}
+
+static double load_images(ALLEGRO_BITMAP *(*load)(const char *),
+			char **files, int n, int *failed)
+{
+	ALLEGRO_BITMAP *bitmap;
+	double t = al_get_time();
+	int i;
+
+	for (i = 0; i < n; i++) {
+		bitmap = load(files[i]);
+		if (!bitmap)
+			(*failed)++;
+		al_destroy_bitmap(bitmap);
+	}
+	return al_get_time() - t;
+}
+
+static void clear_image_cache(void)
+{
+	char *files[MAX_FILES];
+	int i, n;
+
+	n = list_files(IMAGE_CACHE_DIR, ".raw", true, files, MAX_FILES);
+	for (i = 0; i < n; i++) {
+		unlink(files[i]);
+		free(files[i]);
+	}
+}
+
+static int bench_image(void)
+{
+	char *files[MAX_FILES];
+	double t_decode = 0, t_cold = 0, t_warm = 0;
+	int n, r, i, failed = 0;
+
+	n = list_files(SPRITE_DIR, ".png", true, files, MAX_FILES);
+	n += list_files(SPRITE_DIR"/tilesets", ".png", true, files + n, MAX_FILES - n);
+	if (n == 0 || al_set_sprite_image_cache(IMAGE_CACHE_DIR, 0)) {
+		fprintf(stderr, "no images in "SPRITE_DIR" or no cache!\n");
+		return -1;
+	}
+
+	for (r = 0; r < IMAGE_ROUNDS; r++) {
+		clear_image_cache();
+		t_decode += load_images(al_load_bitmap, files, n, &failed);
+		t_cold += load_images(al_load_cached_bitmap, files, n, &failed);
+		t_warm += load_images(al_load_cached_bitmap, files, n, &failed);
+	}
+
+	clear_image_cache();
+	rmdir(IMAGE_CACHE_DIR);
+	al_set_sprite_image_cache(NULL, 0);
+
+	printf("image: %d images x %d rounds\n", n, IMAGE_ROUNDS);
+	printf("  decode         %8.3f ms/round\n", t_decode * 1000 / IMAGE_ROUNDS);
+	printf("  cold cache     %8.3f ms/round\n", t_cold * 1000 / IMAGE_ROUNDS);
+	printf("  warm cache     %8.3f ms/round, %.2fx\n", t_warm * 1000 / IMAGE_ROUNDS,
+			t_decode / t_warm);
+
+	for (i = 0; i < n; i++)
+		free(files[i]);
+	return failed ? -1 : 0;
+}
+
+static double draw_culled(int map_w, ALLEGRO_SPRITE_DRAW_STATS *stats)
+{
+	ALLEGRO_SPRITE_DRAW_STATS before;
+	ALLEGRO_CAMERA *camera;
+	double t;
+	int r, i;
+
+	camera = al_create_camera(BG_WIDTH, BG_HEIGHT);
+	al_camera_set_map_size(camera, map_w, BG_HEIGHT);
+	al_use_sprite_camera(camera);
+
+	srand(1);
+	for (i = 0; i < SPRITE_COUNT; i++) {
+		al_sprite_set_map_size(sprites[i], map_w, BG_HEIGHT);
+		al_sprite_move_to(sprites[i], rand() % map_w, rand() % BG_HEIGHT);
+	}
+
+	al_get_sprite_draw_stats(&before);
+	t = al_get_time();
+	for (r = 0; r < ROUNDS; r++) {
+		/* Scroll across the map */
+		al_camera_move_to(camera, (map_w - BG_WIDTH) * r / ROUNDS, 0);
+		al_draw_sprites(sprites, SPRITE_COUNT);
+		al_flip_display();
+	}
+	t = al_get_time() - t;
+	al_get_sprite_draw_stats(stats);
+	stats->drawn = (stats->drawn - before.drawn) / ROUNDS;
+	stats->culled = (stats->culled - before.culled) / ROUNDS;
+
+	al_use_sprite_camera(NULL);
+	al_destroy_camera(camera);
+	return t;
+}
+
+static int bench_cull(void)
+{
+	ALLEGRO_SPRITE_DEF *def;
+	ALLEGRO_SPRITE_DRAW_STATS screen, map;
+	double t_screen, t_map;
+	int i;
+
+	def = al_load_sprite_def_binary(SPRITE_DIR, SPRITE_FILE);
+	if (!def) {
+		fprintf(stderr, "failed to load sprite "SPRITE_FILE"!\n");
+		return -1;
+	}
+
+	for (i = 0; i < SPRITE_COUNT; i++) {
+		sprites[i] = al_create_sprite_instance(def);
+		al_sprite_add_action(sprites[i], 0, 0, 4, 10, true);
+		al_sprite_start_action(sprites[i], 0);
+	}
+
+	t_screen = draw_culled(BG_WIDTH, &screen);
+	t_map = draw_culled(CULL_MAP_WIDTH, &map);
+	printf("cull: %d sprites x %d rounds\n", SPRITE_COUNT, ROUNDS);
+	printf("  on screen %7.3f ms/round, %lu drawn %lu culled\n",
+			t_screen * 1000 / ROUNDS, screen.drawn, screen.culled);
+	printf("  map %5d %7.3f ms/round, %lu drawn %lu culled, %.2fx\n", CULL_MAP_WIDTH,
+			t_map * 1000 / ROUNDS, map.drawn, map.culled, t_screen / t_map);
+
+	for (i = 0; i < SPRITE_COUNT; i++)
+		al_destroy_sprite(sprites[i]);
+	al_destroy_sprite_def(def);
+	return 0;
+}
+
+static int compare_foot(const void *a, const void *b)
+{
+	const ALLEGRO_SPRITE *s1 = *(ALLEGRO_SPRITE * const *)a;
+	const ALLEGRO_SPRITE *s2 = *(ALLEGRO_SPRITE * const *)b;
+
+	return (s1->y + s1->h) - (s2->y + s2->h);
+}
+
+static double sort_queue(ALLEGRO_SPRITE_QUEUE *q, bool insertion)
+{
+	double t;
+	int r, i;
+
+	/* Same moves for both sorts */
+	srand(2);
+	t = al_get_time();
+	for (r = 0; r < ROUNDS; r++) {
+		for (i = 0; i < SORT_MOVES; i++)
+			al_sprite_move_step(sprites[rand() % SPRITE_COUNT], 0, rand() % 9 - 4);
+		if (insertion)
+			al_sort_sprite_queue(q);
+		else
+			qsort(q->sprites, q->count, sizeof(ALLEGRO_SPRITE *), compare_foot);
+	}
+	return al_get_time() - t;
+}
+
+static int bench_sort(void)
+{
+	ALLEGRO_SPRITE_DEF *def;
+	ALLEGRO_SPRITE_QUEUE *q;
+	double t_qsort, t_insert;
+	int i;
+
+	def = al_load_sprite_def_binary(SPRITE_DIR, SPRITE_FILE);
+	q = al_create_sprite_queue();
+	if (!def || !q) {
+		fprintf(stderr, "failed to load sprite "SPRITE_FILE"!\n");
+		return -1;
+	}
+
+	srand(1);
+	for (i = 0; i < SPRITE_COUNT; i++) {
+		sprites[i] = al_create_sprite_instance(def);
+		al_sprite_set_map_size(sprites[i], BG_WIDTH, BG_HEIGHT);
+		al_sprite_move_to(sprites[i], rand() % BG_WIDTH, rand() % BG_HEIGHT);
+		al_sprite_queue_add(q, sprites[i]);
+	}
+
+	al_sort_sprite_queue(q);
+	t_qsort = sort_queue(q, false);
+	t_insert = sort_queue(q, true);
+	printf("sort: %d sprites, %d moved x %d rounds\n", SPRITE_COUNT, SORT_MOVES, ROUNDS);
+	printf("  qsort     %7.3f ms/round\n", t_qsort * 1000 / ROUNDS);
+	printf("  insertion %7.3f ms/round, %.2fx\n", t_insert * 1000 / ROUNDS,
+			t_qsort / t_insert);
+
+	al_destroy_sprite_queue(q);
+	for (i = 0; i < SPRITE_COUNT; i++)
+		al_destroy_sprite(sprites[i]);
+	al_destroy_sprite_def(def);
+	return 0;
+}
+
+static bool bench_selected(int argc, char **argv, const char *name)
+{
+	int i;
+
+	if (argc < 2)
+		return true;
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], name))
+			return true;
+	}
+	return false;
+}
+
+int main(int argc, char **argv)
+{
+	ALLEGRO_DISPLAY *display = NULL;
+	int ret = 0;
+
+	if (!al_init()) {
+		fprintf(stderr, "failed to initialize allegro!\n");
+		return -1;
+	}
+	al_init_image_addon();
+
+	display = al_create_display(BG_WIDTH, BG_HEIGHT);
+	if (!display) {
+		fprintf(stderr, "failed to create display!\n");
+		return -1;
+	}
+
+	if (bench_selected(argc, argv, "frames") && bench_frames())
+		ret = -1;
+	if (bench_selected(argc, argv, "load") && bench_load())
+		ret = -1;
+	if (bench_selected(argc, argv, "pak") && bench_pak())
+		ret = -1;
+	if (bench_selected(argc, argv, "batch") && bench_batch())
+		ret = -1;
+	if (bench_selected(argc, argv, "image") && bench_image())
+		ret = -1;
+	if (bench_selected(argc, argv, "cull") && bench_cull())
+		ret = -1;
+	if (bench_selected(argc, argv, "sort") && bench_sort())
+		ret = -1;
+
+	al_destroy_display(display);
+	return ret;
+}
@@ -0,0 +1,323 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <libgen.h>
+#include <allegro5/allegro.h>
+#include <allegro5/allegro_image.h>
+#include <cJSON.h>
+#include <cJSON_Utils.h>
+
+#include "sprite.c"
+
+/*
+ * Sprite asset compiler.
+ *
+ * Validates JSON sprite descriptors and compiles them to the binary
+ * sprite format loaded by al_load_sprite_binary(), so the runtime never
+ * has to parse or check JSON. With -p, packs files into an archive for
+ * al_mount_sprite_pak() instead, each under the path it is given.
+ */
+
+static const char *json_file = NULL;
+
+/* Report what is wrong with the descriptor being checked */
+static void check_error(const char *fmt, ...)
+{
+	va_list ap;
+
+	fprintf(stderr, "%s: ", json_file);
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fprintf(stderr, "\n");
+}
+
+static int check_number(cJSON *obj, const char *name, int *value)
+{
+	cJSON *item = cJSON_GetObjectItem(obj, name);
+
+	if (!item || !cJSON_IsNumber(item))
+		return -1;
+	*value = (int)item->valuedouble;
+	return 0;
+}
+
+static int check_size(cJSON *obj, int *w, int *h)
+{
+	cJSON *item = cJSON_GetObjectItem(obj, "size");
+
+	if (!item || !cJSON_IsObject(item))
+		return -1;
+	if (check_number(item, "w", w) || check_number(item, "h", h))
+		return -1;
+	if (*w <= 0 || *h <= 0)
+		return -1;
+	return 0;
+}
+
+static int check_layer(const char *tileset, int idx, cJSON *obj)
+{
+	cJSON *image, *tiles, *item, *tile;
+	int image_w, image_h;
+	int tile_w, tile_h;
+	int count, i, x, y;
+
+	if (!obj || !cJSON_IsObject(obj)) {
+		check_error("%s layer %d: not an object", tileset, idx);
+		ERROR_RETURN(-1);
+	}
+
+	image = cJSON_GetObjectItem(obj, "image");
+	if (!image || !cJSON_IsObject(image)) {
+		check_error("%s layer %d: missing \"image\"", tileset, idx);
+		ERROR_RETURN(-1);
+	}
+
+	item = cJSON_GetObjectItem(image, "file");
+	if (!item || !cJSON_IsString(item) || !item->valuestring[0]) {
+		check_error("%s layer %d: missing image \"file\"", tileset, idx);
+		ERROR_RETURN(-1);
+	}
+
+	if (check_size(image, &image_w, &image_h)) {
+		check_error("%s layer %d: bad image \"size\"", tileset, idx);
+		ERROR_RETURN(-1);
+	}
+
+	tiles = cJSON_GetObjectItem(obj, "tiles");
+	if (!tiles || !cJSON_IsObject(tiles)) {
+		check_error("%s layer %d: missing \"tiles\"", tileset, idx);
+		ERROR_RETURN(-1);
+	}
+
+	if (check_number(tiles, "count", &count)) {
+		check_error("%s layer %d: missing tile \"count\"", tileset, idx);
+		ERROR_RETURN(-1);
+	}
+	if (count <= 0 || count % 4) {
+		check_error("%s layer %d: tile count %d is not a multiple of 4",
+				tileset, idx, count);
+		ERROR_RETURN(-1);
+	}
+
+	if (check_size(tiles, &tile_w, &tile_h)) {
+		check_error("%s layer %d: bad tile \"size\"", tileset, idx);
+		ERROR_RETURN(-1);
+	}
+
+	for (i = 0; i < 4; i++) {
+		item = cJSON_GetObjectItem(tiles, al_json_face_name[i]);
+		if (!item || !cJSON_IsArray(item)) {
+			check_error("%s layer %d: missing \"%s\"",
+					tileset, idx, al_json_face_name[i]);
+			ERROR_RETURN(-1);
+		}
+		if (cJSON_GetArraySize(item) != count / 4) {
+			check_error("%s layer %d: \"%s\" has %d tiles, expected %d",
+					tileset, idx, al_json_face_name[i],
+					cJSON_GetArraySize(item), count / 4);
+			ERROR_RETURN(-1);
+		}
+
+		cJSON_ArrayForEach(tile, item) {
+			if (!cJSON_IsObject(tile) ||
+					check_number(tile, "x", &x) ||
+					check_number(tile, "y", &y)) {
+				check_error("%s layer %d: bad tile in \"%s\"",
+						tileset, idx, al_json_face_name[i]);
+				ERROR_RETURN(-1);
+			}
+			if (x < 0 || y < 0 ||
+					x + tile_w > image_w || y + tile_h > image_h) {
+				check_error("%s layer %d: \"%s\" tile (%d, %d) is outside the %dx%d image",
+						tileset, idx, al_json_face_name[i], x, y,
+						image_w, image_h);
+				ERROR_RETURN(-1);
+			}
+		}
+	}
+	return 0;
+}
+
+static int check_sprite(cJSON *json)
+{
+	cJSON *tileset, *layers, *layer;
+	int idx;
+
+	if (!json || !cJSON_IsObject(json)) {
+		check_error("not a JSON object");
+		ERROR_RETURN(-1);
+	}
+	if (!json->child) {
+		check_error("no tilesets");
+		ERROR_RETURN(-1);
+	}
+
+	for (tileset = json->child; tileset; tileset = tileset->next) {
+		if (!cJSON_IsObject(tileset)) {
+			check_error("%s: not an object", tileset->string);
+			ERROR_RETURN(-1);
+		}
+
+		layers = cJSON_GetObjectItem(tileset, "layers");
+		if (!layers || !cJSON_IsArray(layers) ||
+				cJSON_GetArraySize(layers) <= 0) {
+			check_error("%s: missing \"layers\"", tileset->string);
+			ERROR_RETURN(-1);
+		}
+
+		idx = 0;
+		cJSON_ArrayForEach(layer, layers) {
+			if (check_layer(tileset->string, idx++, layer))
+				return -1;
+		}
+	}
+	return 0;
+}
+
+/* Check the declared image sizes against the real images */
+static int check_images(ALLEGRO_SPRITE_DEF *def)
+{
+	ALLEGRO_SPRITE_TILE_LAYER *layer;
+	int i, j, w, h;
+
+	for (i = 0; i < def->tileset_count; i++) {
+		for (j = 0; j < def->tilesets[i].layer_count; j++) {
+			layer = &def->tilesets[i].layers[j];
+			w = al_get_bitmap_width(layer->image->bitmap);
+			h = al_get_bitmap_height(layer->image->bitmap);
+			if (w != layer->image_width || h != layer->image_height) {
+				check_error("%s is %dx%d, descriptor says %dx%d",
+						layer->image_file, w, h,
+						layer->image_width, layer->image_height);
+				ERROR_RETURN(-1);
+			}
+		}
+	}
+	return 0;
+}
+
+static int compile_sprite(const char *fn, const char *out_dir)
+{
+	FILE *fp = NULL;
+	char *data = NULL;
+	char *dir = NULL, *base = NULL, *out = NULL;
+	char *dup1 = NULL, *dup2 = NULL;
+	int size = 0;
+	int ret = -1;
+	cJSON *json = NULL;
+	ALLEGRO_SPRITE_DEF *def = NULL;
+
+	json_file = fn;
+
+	fp = fopen(fn, "r");
+	if (!fp) {
+		fprintf(stderr, "Open file [%s] error!\n", fn);
+		return -1;
+	}
+
+	fseek(fp, 0, SEEK_END);
+	size = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+
+	data = calloc(1, size + 1);
+	if (!data) {
+		fprintf(stderr, "Can't malloc memory, %d bytes\n", size);
+		fclose(fp);
+		return -1;
+	}
+
+	fread(data, 1, size, fp);
+	fclose(fp);
+
+	json = cJSON_Parse(data);
+	if (!json) {
+		fprintf(stderr, "%s: parse json data error!\n", fn);
+		goto exit;
+	}
+
+	if (check_sprite(json))
+		goto exit;
+
+	dup1 = strdup(fn);
+	dup2 = strdup(fn);
+	if (!dup1 || !dup2)
+		goto exit;
+	dir = dirname(dup1);
+	base = basename(dup2);
+
+	def = al_load_sprite_def(dir, base);
+	if (!def) {
+		fprintf(stderr, "%s: failed to load sprite images\n", fn);
+		goto exit;
+	}
+
+	if (check_images(def))
+		goto exit;
+
+	out = malloc(strlen(out_dir ? out_dir : dir) + strlen(base) + 10);
+	if (!out)
+		goto exit;
+	sprintf(out, "%s/%s", out_dir ? out_dir : dir, base);
+	if (strrchr(out, '.') > strrchr(out, '/'))
+		*strrchr(out, '.') = '\0';
+	strcat(out, ".spb");
+
+	ret = al_save_sprite_binary(def, out);
+	if (!ret)
+		printf("%s -> %s\n", fn, out);
+
+exit:
+	if (def)
+		al_destroy_sprite_def(def);
+	if (json)
+		cJSON_Delete(json);
+	free(out);
+	free(dup1);
+	free(dup2);
+	free(data);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	const char *out_dir = NULL;
+	int i = 1, ret = 0;
+
+	if (argc > 2 && !strcmp(argv[1], "-o")) {
+		out_dir = argv[2];
+		i = 3;
+	}
+
+	/* Archives keep the paths they are given, there is no output dir */
+	if (i < argc && !strcmp(argv[i], "-p")) {
+		if (out_dir) {
+			fprintf(stderr, "-o can't be used with -p\n");
+			return -1;
+		}
+		if (argc < 4 || al_save_sprite_pak(argv[2], (const char **)&argv[3], argc - 3))
+			return -1;
+		printf("%d files -> %s\n", argc - 3, argv[2]);
+		return 0;
+	}
+
+	if (i >= argc) {
+		printf("usage: %s [-o dir] fn.json ...\n", argv[0]);
+		printf("       %s -p out.pak file ...\n", argv[0]);
+		return -1;
+	}
+
+	/* Images are only decoded to check them, no display needed */
+	if (!al_init()) {
+		fprintf(stderr, "failed to initialize allegro!\n");
+		return -1;
+	}
+	al_init_image_addon();
+
+	for (; i < argc; i++) {
+		if (compile_sprite(argv[i], out_dir))
+			ret = -1;
+	}
+	return ret;
+}
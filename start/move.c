@@ -1,78 +1,7 @@
 #include <stdio.h>
-#include <math.h>
 #include <allegro5/allegro.h>
 
-static void draw_circle(int x, int y,
-				int r, ALLEGRO_COLOR color)
-{
-	int w = r * 2;
-	int h = r * 2;
-	int i, j;
-
-	for (i = 0; i <= w; i++) {
-		for (j = 0; j <= h; j++) {
-			int x1 = x - r + i;
-			int y1 = y - r + j;
-			int a = sqrt(abs(x1-x)*abs(x1-x)+abs(y1-y)*abs(y1-y));
-			if (a <= r)
-				al_draw_pixel(x1, y1, color);
-		}
-	}
-}
-
-static void draw_rect(int x, int y,
-				int w, int h, ALLEGRO_COLOR color)
-{
-	int i, j;
-
-	for (i = 0; i <= w; i++) {
-		for (j = 0; j <= h; j++)
-			al_draw_pixel(x+i, y+j, color);
-	}
-}
-
-static void draw_rect_xy(int x1, int y1,
-				int x2, int y2, ALLEGRO_COLOR color)
-{
-	int x = (x1 < x2) ? x1 : x2;
-	int y = (y1 < y2) ? y1 : y2;
-	int w = abs(x2 - x1);
-	int h = abs(y2 - y1);
-	draw_rect(x, y, w, h, color);
-}
-
-static void draw_line(int x1, int y1,
-				int x2, int y2, ALLEGRO_COLOR color)
-{
-	int x, y;
-	int x_step, y_step;
-
-	x_step = (x1 < x2) ? 1 : -1;
-	y_step = (y1 < y2) ? 1 : -1;
-
-	if (x1 == x2) {
-		for (y = y1; (y_step > 0) ? (y <= y2) : (y >= y2); y += y_step)
-			al_draw_pixel(x1, y, color);
-		return;
-	}
-
-	if (y1 == y2) {
-		for (x = x1; (x_step > 0) ? (x <= x2) : (x >= x2); x += x_step)
-			al_draw_pixel(x, y1, color);
-		return;
-	}
-
-	for (x = x1; (x_step > 0) ? (x <= x2) : (x >= x2); x += x_step) {
-		y = (x - x1) * (y2 - y1) / (x2 - x1) + y1;
-		al_draw_pixel(x, y, color);
-	}
-
-	for (y = y1; (y_step > 0) ? (y <= y2) : (y >= y2); y += y_step) {
-		x = (y - y1) * (x2 - x1) / (y2 - y1) + x1;
-		al_draw_pixel(x, y, color);
-	}
-}
-
+#include "raster.c"
 
 struct block {
 	int x;
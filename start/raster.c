@@ -0,0 +1,460 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <allegro5/allegro.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define RASTER_X86
+#include <immintrin.h>
+#endif
+
+#include "raster.h"
+
+/*
+ * Each shape locks its bounding box on the target bitmap once and
+ * writes whole rows, instead of calling al_draw_pixel() per pixel.
+ * Colors are stored as is, without blending, like al_put_pixel().
+ */
+
+typedef struct {
+	ALLEGRO_BITMAP *bitmap;
+	uint8_t *data; /* Top left pixel of the locked box */
+	int pitch;
+	int x, y, w, h; /* Locked box, clipped to the clipping rectangle */
+	uint32_t pixel; /* ARGB8888 */
+} RASTER;
+
+typedef struct {
+	void (*fill)(uint32_t *dst, int n, uint32_t pixel);
+	void (*blend)(uint32_t *dst, int n, uint32_t pixel);
+	void (*copy_masked)(uint32_t *dst, const uint32_t *src, int n, uint32_t mask);
+} RASTER_KERNELS;
+
+/***** Row Kernels *****/
+
+/*
+ * Kernels work on ARGB8888 rows, e.g. of a bitmap locked with
+ * ALLEGRO_PIXEL_FORMAT_ARGB_8888. Blending is non premultiplied
+ * "source over" with the alpha of the pixel, rounded the same way by
+ * every kernel level.
+ */
+
+static inline uint32_t raster_div255(uint32_t t)
+{
+	t += 128;
+	return (t + (t >> 8)) >> 8;
+}
+
+static void raster_fill_c(uint32_t *dst, int n, uint32_t pixel)
+{
+	uint8_t b = pixel & 0xff;
+
+	/* Black, white and grays are a single repeated byte */
+	if (pixel == b * 0x01010101u) {
+		memset(dst, b, (size_t)n * 4);
+		return;
+	}
+	while (n--)
+		*dst++ = pixel;
+}
+
+static void raster_blend_c(uint32_t *dst, int n, uint32_t pixel)
+{
+	uint32_t a = pixel >> 24;
+	uint32_t inv = 255 - a;
+	uint32_t sb = (pixel & 0xff) * a;
+	uint32_t sg = (pixel >> 8 & 0xff) * a;
+	uint32_t sr = (pixel >> 16 & 0xff) * a;
+	uint32_t sa = 255 * a;
+	uint32_t d;
+
+	while (n--) {
+		d = *dst;
+		*dst++ = raster_div255(sb + (d & 0xff) * inv)
+			| raster_div255(sg + (d >> 8 & 0xff) * inv) << 8
+			| raster_div255(sr + (d >> 16 & 0xff) * inv) << 16
+			| raster_div255(sa + (d >> 24) * inv) << 24;
+	}
+}
+
+static void raster_copy_masked_c(uint32_t *dst, const uint32_t *src, int n, uint32_t mask)
+{
+	while (n--) {
+		if (*src != mask)
+			*dst = *src;
+		dst++;
+		src++;
+	}
+}
+
+#ifdef RASTER_X86
+__attribute__((target("sse2")))
+static void raster_fill_sse2(uint32_t *dst, int n, uint32_t pixel)
+{
+	__m128i p = _mm_set1_epi32(pixel);
+
+	for (; n >= 4; n -= 4, dst += 4)
+		_mm_storeu_si128((__m128i *)dst, p);
+	while (n--)
+		*dst++ = pixel;
+}
+
+/* Blend 8 channels unpacked to 16 bits, d * inv + s rounded down by 255 */
+__attribute__((target("sse2")))
+static inline __m128i raster_blend16_sse2(__m128i d, __m128i inv, __m128i s)
+{
+	d = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(d, inv), s),
+			_mm_set1_epi16(128));
+	return _mm_srli_epi16(_mm_add_epi16(d, _mm_srli_epi16(d, 8)), 8);
+}
+
+__attribute__((target("sse2")))
+static __m128i raster_blend_src_sse2(uint32_t pixel)
+{
+	short a = pixel >> 24;
+
+	return _mm_set_epi16(255 * a, (pixel >> 16 & 0xff) * a,
+			(pixel >> 8 & 0xff) * a, (pixel & 0xff) * a,
+			255 * a, (pixel >> 16 & 0xff) * a,
+			(pixel >> 8 & 0xff) * a, (pixel & 0xff) * a);
+}
+
+__attribute__((target("sse2")))
+static void raster_blend_sse2(uint32_t *dst, int n, uint32_t pixel)
+{
+	__m128i zero = _mm_setzero_si128();
+	__m128i inv = _mm_set1_epi16(255 - (pixel >> 24));
+	__m128i s = raster_blend_src_sse2(pixel);
+	__m128i d, lo, hi;
+
+	for (; n >= 4; n -= 4, dst += 4) {
+		d = _mm_loadu_si128((__m128i *)dst);
+		lo = raster_blend16_sse2(_mm_unpacklo_epi8(d, zero), inv, s);
+		hi = raster_blend16_sse2(_mm_unpackhi_epi8(d, zero), inv, s);
+		_mm_storeu_si128((__m128i *)dst, _mm_packus_epi16(lo, hi));
+	}
+	raster_blend_c(dst, n, pixel);
+}
+
+__attribute__((target("sse2")))
+static void raster_copy_masked_sse2(uint32_t *dst, const uint32_t *src, int n, uint32_t mask)
+{
+	__m128i key = _mm_set1_epi32(mask);
+	__m128i s, d, m;
+
+	for (; n >= 4; n -= 4, dst += 4, src += 4) {
+		s = _mm_loadu_si128((const __m128i *)src);
+		d = _mm_loadu_si128((__m128i *)dst);
+		m = _mm_cmpeq_epi32(s, key);
+		_mm_storeu_si128((__m128i *)dst,
+				_mm_or_si128(_mm_and_si128(m, d), _mm_andnot_si128(m, s)));
+	}
+	raster_copy_masked_c(dst, src, n, mask);
+}
+
+__attribute__((target("avx2")))
+static void raster_fill_avx2(uint32_t *dst, int n, uint32_t pixel)
+{
+	__m256i p = _mm256_set1_epi32(pixel);
+
+	for (; n >= 8; n -= 8, dst += 8)
+		_mm256_storeu_si256((__m256i *)dst, p);
+	raster_fill_sse2(dst, n, pixel);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i raster_blend16_avx2(__m256i d, __m256i inv, __m256i s)
+{
+	d = _mm256_add_epi16(_mm256_add_epi16(_mm256_mullo_epi16(d, inv), s),
+			_mm256_set1_epi16(128));
+	return _mm256_srli_epi16(_mm256_add_epi16(d, _mm256_srli_epi16(d, 8)), 8);
+}
+
+/* Unpack and pack both stay within 128 bit lanes, so pixel order holds */
+__attribute__((target("avx2")))
+static void raster_blend_avx2(uint32_t *dst, int n, uint32_t pixel)
+{
+	__m256i zero = _mm256_setzero_si256();
+	__m256i inv = _mm256_set1_epi16(255 - (pixel >> 24));
+	__m256i s = _mm256_broadcastsi128_si256(raster_blend_src_sse2(pixel));
+	__m256i d, lo, hi;
+
+	for (; n >= 8; n -= 8, dst += 8) {
+		d = _mm256_loadu_si256((__m256i *)dst);
+		lo = raster_blend16_avx2(_mm256_unpacklo_epi8(d, zero), inv, s);
+		hi = raster_blend16_avx2(_mm256_unpackhi_epi8(d, zero), inv, s);
+		_mm256_storeu_si256((__m256i *)dst, _mm256_packus_epi16(lo, hi));
+	}
+	raster_blend_sse2(dst, n, pixel);
+}
+
+__attribute__((target("avx2")))
+static void raster_copy_masked_avx2(uint32_t *dst, const uint32_t *src, int n, uint32_t mask)
+{
+	__m256i key = _mm256_set1_epi32(mask);
+	__m256i s, d, m;
+
+	for (; n >= 8; n -= 8, dst += 8, src += 8) {
+		s = _mm256_loadu_si256((const __m256i *)src);
+		d = _mm256_loadu_si256((__m256i *)dst);
+		m = _mm256_cmpeq_epi32(s, key);
+		_mm256_storeu_si256((__m256i *)dst,
+				_mm256_or_si256(_mm256_and_si256(m, d), _mm256_andnot_si256(m, s)));
+	}
+	raster_copy_masked_sse2(dst, src, n, mask);
+}
+#endif
+
+static const RASTER_KERNELS raster_kernel_table[] = {
+	[RASTER_SCALAR] = { raster_fill_c, raster_blend_c, raster_copy_masked_c },
+#ifdef RASTER_X86
+	[RASTER_SSE2] = { raster_fill_sse2, raster_blend_sse2, raster_copy_masked_sse2 },
+	[RASTER_AVX2] = { raster_fill_avx2, raster_blend_avx2, raster_copy_masked_avx2 },
+#endif
+};
+
+static const RASTER_KERNELS *raster_kernels = NULL;
+static int raster_kernel_level;
+
+static bool raster_kernels_supported(int level)
+{
+#ifdef RASTER_X86
+	__builtin_cpu_init();
+	if (level == RASTER_SSE2)
+		return __builtin_cpu_supports("sse2");
+	if (level == RASTER_AVX2)
+		return __builtin_cpu_supports("avx2");
+#endif
+	return level == RASTER_SCALAR;
+}
+
+/* Use the given kernel level or the best one below it the CPU has */
+int raster_set_kernels(int level)
+{
+	if (level < RASTER_SCALAR)
+		level = RASTER_SCALAR;
+	if (level > RASTER_AVX2)
+		level = RASTER_AVX2;
+	while (level > RASTER_SCALAR && !raster_kernels_supported(level))
+		level--;
+
+	raster_kernel_level = level;
+	raster_kernels = &raster_kernel_table[level];
+	return level;
+}
+
+int raster_get_kernels(void)
+{
+	if (!raster_kernels)
+		raster_set_kernels(RASTER_AVX2);
+	return raster_kernel_level;
+}
+
+void raster_fill(uint32_t *dst, int n, uint32_t pixel)
+{
+	if (!raster_kernels)
+		raster_set_kernels(RASTER_AVX2);
+	raster_kernels->fill(dst, n, pixel);
+}
+
+void raster_blend(uint32_t *dst, int n, uint32_t pixel)
+{
+	if ((pixel >> 24) == 0)
+		return;
+	if ((pixel >> 24) == 255) {
+		raster_fill(dst, n, pixel);
+		return;
+	}
+	if (!raster_kernels)
+		raster_set_kernels(RASTER_AVX2);
+	raster_kernels->blend(dst, n, pixel);
+}
+
+/* Copy the pixels of src that are not the mask color */
+void raster_copy_masked(uint32_t *dst, const uint32_t *src, int n, uint32_t mask)
+{
+	if (!raster_kernels)
+		raster_set_kernels(RASTER_AVX2);
+	raster_kernels->copy_masked(dst, src, n, mask);
+}
+
+uint32_t raster_pixel(ALLEGRO_COLOR color)
+{
+	unsigned char r, g, b, a;
+
+	al_unmap_rgba(color, &r, &g, &b, &a);
+	return (uint32_t)a << 24 | (uint32_t)r << 16 | (uint32_t)g << 8 | b;
+}
+
+/***** Raster Target *****/
+
+static int raster_lock(RASTER *r, int x, int y, int w, int h,
+				bool covered, ALLEGRO_COLOR color)
+{
+	ALLEGRO_LOCKED_REGION *lr;
+	int cx, cy, cw, ch;
+
+	r->bitmap = al_get_target_bitmap();
+	if (!r->bitmap)
+		return -1;
+
+	al_get_clipping_rectangle(&cx, &cy, &cw, &ch);
+	if (cx < 0) {
+		cw += cx;
+		cx = 0;
+	}
+	if (cy < 0) {
+		ch += cy;
+		cy = 0;
+	}
+	if (cx + cw > al_get_bitmap_width(r->bitmap))
+		cw = al_get_bitmap_width(r->bitmap) - cx;
+	if (cy + ch > al_get_bitmap_height(r->bitmap))
+		ch = al_get_bitmap_height(r->bitmap) - cy;
+
+	r->x = (x > cx) ? x : cx;
+	r->y = (y > cy) ? y : cy;
+	r->w = ((x + w < cx + cw) ? x + w : cx + cw) - r->x;
+	r->h = ((y + h < cy + ch) ? y + h : cy + ch) - r->y;
+	if (r->w <= 0 || r->h <= 0)
+		return -1;
+
+	/* Only a shape covering its whole box may skip reading it back */
+	lr = al_lock_bitmap_region(r->bitmap, r->x, r->y, r->w, r->h,
+			ALLEGRO_PIXEL_FORMAT_ARGB_8888,
+			covered ? ALLEGRO_LOCK_WRITEONLY : ALLEGRO_LOCK_READWRITE);
+	if (!lr) /* Target already locked */
+		return -1;
+
+	r->data = lr->data;
+	r->pitch = lr->pitch;
+
+	r->pixel = raster_pixel(color);
+	return 0;
+}
+
+static void raster_unlock(RASTER *r)
+{
+	al_unlock_bitmap(r->bitmap);
+}
+
+/* Fill x1..x2 of row y, both inclusive */
+static void raster_span(RASTER *r, int y, int x1, int x2)
+{
+	if (y < r->y || y >= r->y + r->h)
+		return;
+	if (x1 < r->x)
+		x1 = r->x;
+	if (x2 >= r->x + r->w)
+		x2 = r->x + r->w - 1;
+	if (x1 > x2)
+		return;
+
+	raster_fill((uint32_t *)(r->data + (y - r->y) * r->pitch) + (x1 - r->x),
+			x2 - x1 + 1, r->pixel);
+}
+
+static void raster_plot(RASTER *r, int x, int y)
+{
+	if (x < r->x || x >= r->x + r->w || y < r->y || y >= r->y + r->h)
+		return;
+
+	((uint32_t *)(r->data + (y - r->y) * r->pitch))[x - r->x] = r->pixel;
+}
+
+/***** Shapes *****/
+
+/* Fill (w + 1) x (h + 1) pixels, both edges inclusive */
+void draw_rect(int x, int y, int w, int h, ALLEGRO_COLOR color)
+{
+	RASTER r;
+	int j;
+
+	if (w < 0 || h < 0)
+		return;
+	if (raster_lock(&r, x, y, w + 1, h + 1, true, color))
+		return;
+
+	for (j = 0; j < r.h; j++)
+		raster_fill((uint32_t *)(r.data + j * r.pitch), r.w, r.pixel);
+
+	raster_unlock(&r);
+}
+
+void draw_rect_xy(int x1, int y1, int x2, int y2, ALLEGRO_COLOR color)
+{
+	int x = (x1 < x2) ? x1 : x2;
+	int y = (y1 < y2) ? y1 : y2;
+	int w = abs(x2 - x1);
+	int h = abs(y2 - y1);
+	draw_rect(x, y, w, h, color);
+}
+
+/* Bresenham, both end points inclusive */
+void draw_line(int x1, int y1, int x2, int y2, ALLEGRO_COLOR color)
+{
+	RASTER r;
+	int dx = abs(x2 - x1);
+	int dy = -abs(y2 - y1);
+	int x_step = (x1 < x2) ? 1 : -1;
+	int y_step = (y1 < y2) ? 1 : -1;
+	int err = dx + dy;
+	int e2;
+
+	if (raster_lock(&r, (x1 < x2) ? x1 : x2, (y1 < y2) ? y1 : y2,
+				dx + 1, -dy + 1, dx == 0 || dy == 0, color))
+		return;
+
+	if (y1 == y2) {
+		raster_span(&r, y1, (x1 < x2) ? x1 : x2, (x1 < x2) ? x2 : x1);
+		raster_unlock(&r);
+		return;
+	}
+
+	while (1) {
+		raster_plot(&r, x1, y1);
+		if (x1 == x2 && y1 == y2)
+			break;
+		e2 = 2 * err;
+		if (e2 >= dy) {
+			err += dy;
+			x1 += x_step;
+		}
+		if (e2 <= dx) {
+			err += dx;
+			y1 += y_step;
+		}
+	}
+
+	raster_unlock(&r);
+}
+
+/*
+ * Filled circle, a pixel is inside while its distance to the center
+ * rounds down to r or less, i.e. dx * dx + dy * dy < (r + 1) * (r + 1).
+ * The half width only shrinks as dy grows, so it is found by stepping
+ * down from the previous row, in integers.
+ */
+void draw_circle(int x, int y, int r, ALLEGRO_COLOR color)
+{
+	RASTER ra;
+	int limit = r * r + 2 * r;
+	int dx = r;
+	int dy;
+
+	if (r < 0)
+		return;
+	if (raster_lock(&ra, x - r, y - r, 2 * r + 1, 2 * r + 1, false, color))
+		return;
+
+	for (dy = 0; dy <= r; dy++) {
+		while (dx * dx + dy * dy > limit)
+			dx--;
+		raster_span(&ra, y - dy, x - dx, x + dx);
+		if (dy)
+			raster_span(&ra, y + dy, x - dx, x + dx);
+	}
+
+	raster_unlock(&ra);
+}
@@ -0,0 +1,26 @@
+#ifndef __RASTER_H__
+#define __RASTER_H__
+
+#include <stdint.h>
+#include <allegro5/allegro.h>
+
+/* Kernel levels for raster_set_kernels() */
+enum {
+	RASTER_SCALAR = 0,
+	RASTER_SSE2 = 1,
+	RASTER_AVX2 = 2,
+};
+
+void draw_rect(int x, int y, int w, int h, ALLEGRO_COLOR color);
+void draw_rect_xy(int x1, int y1, int x2, int y2, ALLEGRO_COLOR color);
+void draw_line(int x1, int y1, int x2, int y2, ALLEGRO_COLOR color);
+void draw_circle(int x, int y, int r, ALLEGRO_COLOR color);
+
+int raster_set_kernels(int level);
+int raster_get_kernels(void);
+uint32_t raster_pixel(ALLEGRO_COLOR color);
+void raster_fill(uint32_t *dst, int n, uint32_t pixel);
+void raster_blend(uint32_t *dst, int n, uint32_t pixel);
+void raster_copy_masked(uint32_t *dst, const uint32_t *src, int n, uint32_t mask);
+
+#endif
@@ -0,0 +1,245 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <allegro5/allegro.h>
+
+#include "raster.c"
+
+/*
+ * Row kernel microbenchmarks on a BENCH_WIDTH x BENCH_HEIGHT bitmap.
+ *
+ * fill:  a solid color, one al_draw_pixel() and one al_put_pixel() per
+ *        pixel against raster_fill() rows at every kernel level.
+ * blend: a translucent color, al_draw_pixel() and al_put_blended_pixel()
+ *        against raster_blend().
+ * mask:  a source with MASK_COLOR holes, al_draw_pixel() and al_put_pixel()
+ *        of the other pixels against raster_copy_masked().
+ *
+ * Levels the CPU lacks are skipped, the others are checked against the
+ * scalar kernels first.
+ *
+ * usage: raster_bench [test ...], runs all tests by default.
+ */
+
+#define BENCH_WIDTH		640
+#define BENCH_HEIGHT	480
+
+#define PIXEL_ROUNDS	4
+#define KERNEL_ROUNDS	200
+#define CHECK_ROUNDS	10000
+
+#define FILL_COLOR	0xff2080c0
+#define BLEND_COLOR	0x80c08020
+#define MASK_COLOR	0xffff00ff
+
+enum {
+	BENCH_FILL,
+	BENCH_BLEND,
+	BENCH_MASK,
+};
+
+static const char *level_names[] = { "scalar", "sse2", "avx2" };
+
+static ALLEGRO_BITMAP *bitmap;
+static uint32_t source[BENCH_WIDTH * BENCH_HEIGHT];
+static ALLEGRO_COLOR source_colors[BENCH_WIDTH * BENCH_HEIGHT];
+
+static ALLEGRO_COLOR pixel_color(uint32_t p)
+{
+	return al_map_rgba(p >> 16 & 0xff, p >> 8 & 0xff, p & 0xff, p >> 24);
+}
+
+/* Wait for queued drawing to land in the bitmap */
+static void sync_bitmap(void)
+{
+	al_lock_bitmap(bitmap, ALLEGRO_PIXEL_FORMAT_ANY, ALLEGRO_LOCK_READONLY);
+	al_unlock_bitmap(bitmap);
+}
+
+static double run_draw_pixel(int test)
+{
+	ALLEGRO_COLOR c = pixel_color(test == BENCH_FILL ? FILL_COLOR : BLEND_COLOR);
+	double t = al_get_time();
+	int r, x, y, i;
+
+	al_set_target_bitmap(bitmap);
+	for (r = 0; r < PIXEL_ROUNDS; r++) {
+		for (y = 0, i = 0; y < BENCH_HEIGHT; y++) {
+			for (x = 0; x < BENCH_WIDTH; x++, i++) {
+				if (test != BENCH_MASK)
+					al_draw_pixel(x + 0.5, y + 0.5, c);
+				else if (source[i] != MASK_COLOR)
+					al_draw_pixel(x + 0.5, y + 0.5, source_colors[i]);
+			}
+		}
+	}
+	sync_bitmap();
+	return (al_get_time() - t) / PIXEL_ROUNDS;
+}
+
+static double run_put_pixel(int test)
+{
+	ALLEGRO_COLOR c = pixel_color(test == BENCH_FILL ? FILL_COLOR : BLEND_COLOR);
+	double t = al_get_time();
+	int r, x, y, i;
+
+	al_set_target_bitmap(bitmap);
+	for (r = 0; r < PIXEL_ROUNDS; r++) {
+		al_lock_bitmap(bitmap, ALLEGRO_PIXEL_FORMAT_ARGB_8888, ALLEGRO_LOCK_READWRITE);
+		for (y = 0, i = 0; y < BENCH_HEIGHT; y++) {
+			for (x = 0; x < BENCH_WIDTH; x++, i++) {
+				if (test == BENCH_FILL)
+					al_put_pixel(x, y, c);
+				else if (test == BENCH_BLEND)
+					al_put_blended_pixel(x, y, c);
+				else if (source[i] != MASK_COLOR)
+					al_put_pixel(x, y, source_colors[i]);
+			}
+		}
+		al_unlock_bitmap(bitmap);
+	}
+	return (al_get_time() - t) / PIXEL_ROUNDS;
+}
+
+static double run_kernel(int test)
+{
+	ALLEGRO_LOCKED_REGION *lr;
+	double t = al_get_time();
+	uint32_t *row;
+	int r, y;
+
+	for (r = 0; r < KERNEL_ROUNDS; r++) {
+		lr = al_lock_bitmap(bitmap, ALLEGRO_PIXEL_FORMAT_ARGB_8888, ALLEGRO_LOCK_READWRITE);
+		for (y = 0; y < BENCH_HEIGHT; y++) {
+			row = (uint32_t *)((uint8_t *)lr->data + y * lr->pitch);
+			if (test == BENCH_FILL)
+				raster_fill(row, BENCH_WIDTH, FILL_COLOR);
+			else if (test == BENCH_BLEND)
+				raster_blend(row, BENCH_WIDTH, BLEND_COLOR);
+			else
+				raster_copy_masked(row, source + y * BENCH_WIDTH,
+						BENCH_WIDTH, MASK_COLOR);
+		}
+		al_unlock_bitmap(bitmap);
+	}
+	return (al_get_time() - t) / KERNEL_ROUNDS;
+}
+
+/* Random rows of random lengths and alignments, against the scalar kernels */
+static int check_kernel(int test)
+{
+	static uint32_t a[BENCH_WIDTH + 8], b[BENCH_WIDTH + 8];
+	const RASTER_KERNELS *scalar = &raster_kernel_table[RASTER_SCALAR];
+	int r, i, n, off;
+
+	for (r = 0; r < CHECK_ROUNDS; r++) {
+		n = rand() % BENCH_WIDTH;
+		off = rand() % 8;
+		for (i = 0; i < BENCH_WIDTH + 8; i++)
+			a[i] = b[i] = (uint32_t)rand() << 16 ^ rand();
+
+		if (test == BENCH_FILL) {
+			raster_fill(a + off, n, FILL_COLOR);
+			scalar->fill(b + off, n, FILL_COLOR);
+		} else if (test == BENCH_BLEND) {
+			raster_blend(a + off, n, BLEND_COLOR);
+			scalar->blend(b + off, n, BLEND_COLOR);
+		} else {
+			raster_copy_masked(a + off, source + r, n, MASK_COLOR);
+			scalar->copy_masked(b + off, source + r, n, MASK_COLOR);
+		}
+		if (memcmp(a, b, sizeof(a)))
+			return -1;
+	}
+	return 0;
+}
+
+static int bench_test(int test, const char *name)
+{
+	double t_draw, t_put, t_kernel;
+	int level, best;
+
+	al_set_target_bitmap(bitmap);
+	al_clear_to_color(al_map_rgb(0x40, 0x40, 0x40));
+
+	printf("%s: %dx%d ARGB8888\n", name, BENCH_WIDTH, BENCH_HEIGHT);
+	t_draw = run_draw_pixel(test);
+	printf("  %-29s %.3f ms/frame\n", "al_draw_pixel", t_draw * 1000);
+	t_put = run_put_pixel(test);
+	printf("  %-29s %.3f ms/frame, %.2fx\n",
+			test == BENCH_BLEND ? "al_put_blended_pixel" : "al_put_pixel",
+			t_put * 1000, t_draw / t_put);
+
+	best = raster_set_kernels(RASTER_AVX2);
+	for (level = RASTER_SCALAR; level <= best; level++) {
+		if (raster_set_kernels(level) != level)
+			continue;
+		if (check_kernel(test)) {
+			fprintf(stderr, "%s: %s kernel differs from scalar!\n",
+					name, level_names[level]);
+			raster_set_kernels(best);
+			return -1;
+		}
+		t_kernel = run_kernel(test);
+		printf("  %-29s %.3f ms/frame, %.2fx\n", level_names[level],
+				t_kernel * 1000, t_draw / t_kernel);
+	}
+	raster_set_kernels(best);
+	return 0;
+}
+
+static bool bench_selected(int argc, char **argv, const char *name)
+{
+	int i;
+
+	if (argc < 2)
+		return true;
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], name))
+			return true;
+	}
+	return false;
+}
+
+int main(int argc, char **argv)
+{
+	ALLEGRO_DISPLAY *display = NULL;
+	int ret = 0;
+	int i;
+
+	if (!al_init()) {
+		fprintf(stderr, "failed to initialize allegro!\n");
+		return -1;
+	}
+
+	display = al_create_display(BENCH_WIDTH, BENCH_HEIGHT);
+	if (!display) {
+		fprintf(stderr, "failed to create display!\n");
+		return -1;
+	}
+
+	bitmap = al_create_bitmap(BENCH_WIDTH, BENCH_HEIGHT);
+	if (!bitmap) {
+		fprintf(stderr, "failed to create bitmap!\n");
+		return -1;
+	}
+
+	/* A quarter of the source is mask */
+	srand(1);
+	for (i = 0; i < BENCH_WIDTH * BENCH_HEIGHT; i++) {
+		source[i] = (rand() % 4) ? 0xff000000 | rand() : MASK_COLOR;
+		source_colors[i] = pixel_color(source[i]);
+	}
+
+	printf("kernels: %s\n", level_names[raster_get_kernels()]);
+	if (bench_selected(argc, argv, "fill") && bench_test(BENCH_FILL, "fill"))
+		ret = -1;
+	if (bench_selected(argc, argv, "blend") && bench_test(BENCH_BLEND, "blend"))
+		ret = -1;
+	if (bench_selected(argc, argv, "mask") && bench_test(BENCH_MASK, "mask"))
+		ret = -1;
+
+	al_destroy_bitmap(bitmap);
+	al_destroy_display(display);
+	return ret;
+}
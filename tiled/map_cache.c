@@ -0,0 +1,150 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <allegro5/allegro.h>
+#include <allegro5/allegro_tiled.h>
+
+#include "map_cache.h"
+
+#define MAP_CACHE_ERROR_RETURN(x) \
+	do{	\
+		fprintf(stderr, "ALLEGRO_MAP_CACHE ERROR [%s(), LINE %d in %s]\n", __func__, __LINE__, __FILE__); \
+		return x; \
+	} while(0)
+
+/*
+ * The tile layers of a map rendered once into a grid of chunk bitmaps.
+ * Drawing a region then takes one blit per chunk it overlaps, instead
+ * of one per tile of every layer. Tiled maps don't animate, so a chunk
+ * never goes stale.
+ */
+struct _ALLEGRO_MAP_CACHE {
+	int width; /* Map size in pixels */
+	int height;
+	int chunk_size;
+	int cols; /* Chunks across and down */
+	int rows;
+	ALLEGRO_BITMAP **chunks; /* cols * rows, row major */
+};
+
+void al_destroy_map_cache(ALLEGRO_MAP_CACHE *cache)
+{
+	int i;
+
+	if (!cache)
+		return;
+	if (cache->chunks) {
+		for (i = 0; i < cache->cols * cache->rows; i++) {
+			if (cache->chunks[i])
+				al_destroy_bitmap(cache->chunks[i]);
+		}
+		free(cache->chunks);
+	}
+	free(cache);
+}
+
+ALLEGRO_MAP_CACHE *al_create_map_cache(ALLEGRO_MAP *map, int chunk_size)
+{
+	ALLEGRO_MAP_CACHE *cache;
+	ALLEGRO_BITMAP *chunk;
+	ALLEGRO_STATE state;
+	int x, y, w, h;
+
+	if (!map || chunk_size <= 0)
+		MAP_CACHE_ERROR_RETURN(NULL);
+
+	cache = calloc(1, sizeof(ALLEGRO_MAP_CACHE));
+	if (!cache)
+		MAP_CACHE_ERROR_RETURN(NULL);
+
+	cache->width = al_get_map_width(map) * al_get_tile_width(map);
+	cache->height = al_get_map_height(map) * al_get_tile_height(map);
+	cache->chunk_size = chunk_size;
+	cache->cols = (cache->width + chunk_size - 1) / chunk_size;
+	cache->rows = (cache->height + chunk_size - 1) / chunk_size;
+	cache->chunks = calloc(cache->cols * cache->rows, sizeof(ALLEGRO_BITMAP *));
+	if (!cache->chunks) {
+		al_destroy_map_cache(cache);
+		MAP_CACHE_ERROR_RETURN(NULL);
+	}
+
+	/* Layers blend as on screen, into premultiplied chunks */
+	al_store_state(&state, ALLEGRO_STATE_TARGET_BITMAP | ALLEGRO_STATE_BLENDER);
+	al_set_blender(ALLEGRO_ADD, ALLEGRO_ONE, ALLEGRO_INVERSE_ALPHA);
+	for (y = 0; y < cache->rows; y++) {
+		for (x = 0; x < cache->cols; x++) {
+			/* Chunks on the right and bottom edge are cut to the map */
+			w = cache->width - x * chunk_size;
+			h = cache->height - y * chunk_size;
+			chunk = al_create_bitmap(w < chunk_size ? w : chunk_size,
+						h < chunk_size ? h : chunk_size);
+			if (!chunk) {
+				al_restore_state(&state);
+				al_destroy_map_cache(cache);
+				MAP_CACHE_ERROR_RETURN(NULL);
+			}
+
+			al_set_target_bitmap(chunk);
+			al_clear_to_color(al_map_rgba(0, 0, 0, 0));
+			al_draw_map_region(map, x * chunk_size, y * chunk_size,
+					al_get_bitmap_width(chunk), al_get_bitmap_height(chunk),
+					0, 0, 0);
+			cache->chunks[y * cache->cols + x] = chunk;
+		}
+	}
+	al_restore_state(&state);
+	return cache;
+}
+
+/* Same as al_draw_map_region() on the cached map */
+void al_draw_map_cache_region(ALLEGRO_MAP_CACHE *cache, float sx, float sy,
+				float sw, float sh, float dx, float dy)
+{
+	ALLEGRO_BITMAP *chunk;
+	float x1, y1, x2, y2; /* Part of a chunk in map coordinates */
+	int col, row, col2, row2;
+	int size = cache->chunk_size;
+
+	/* Clamp to the map, nothing is drawn outside it */
+	if (sx < 0) {
+		dx -= sx;
+		sw += sx;
+		sx = 0;
+	}
+	if (sy < 0) {
+		dy -= sy;
+		sh += sy;
+		sy = 0;
+	}
+	if (sx + sw > cache->width)
+		sw = cache->width - sx;
+	if (sy + sh > cache->height)
+		sh = cache->height - sy;
+	if (sw <= 0 || sh <= 0)
+		return;
+
+	col2 = (int)(sx + sw - 1) / size;
+	row2 = (int)(sy + sh - 1) / size;
+	for (row = (int)sy / size; row <= row2; row++) {
+		for (col = (int)sx / size; col <= col2; col++) {
+			chunk = cache->chunks[row * cache->cols + col];
+			x1 = col * size;
+			y1 = row * size;
+			x2 = x1 + al_get_bitmap_width(chunk);
+			y2 = y1 + al_get_bitmap_height(chunk);
+			if (x1 < sx) x1 = sx;
+			if (y1 < sy) y1 = sy;
+			if (x2 > sx + sw) x2 = sx + sw;
+			if (y2 > sy + sh) y2 = sy + sh;
+
+			al_draw_bitmap_region(chunk, x1 - col * size, y1 - row * size,
+					x2 - x1, y2 - y1, dx + x1 - sx, dy + y1 - sy, 0);
+		}
+	}
+}
+
+/* The view of camera at the top left of the target */
+void al_draw_map_cache_view(ALLEGRO_MAP_CACHE *cache, ALLEGRO_CAMERA *camera)
+{
+	al_draw_map_cache_region(cache, al_camera_get_x(camera), al_camera_get_y(camera),
+			al_camera_get_width(camera), al_camera_get_height(camera), 0, 0);
+}
@@ -0,0 +1,15 @@
+#ifndef __MAP_CACHE_H__
+#define __MAP_CACHE_H__
+
+#include <allegro5/allegro_tiled.h>
+#include "../sprite/sprite.h"
+
+typedef struct _ALLEGRO_MAP_CACHE ALLEGRO_MAP_CACHE;
+
+ALLEGRO_MAP_CACHE *al_create_map_cache(ALLEGRO_MAP *map, int chunk_size);
+void al_destroy_map_cache(ALLEGRO_MAP_CACHE *cache);
+void al_draw_map_cache_region(ALLEGRO_MAP_CACHE *cache, float sx, float sy,
+				float sw, float sh, float dx, float dy);
+void al_draw_map_cache_view(ALLEGRO_MAP_CACHE *cache, ALLEGRO_CAMERA *camera);
+
+#endif
@@ -0,0 +1,621 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <string.h>
+#include <zlib.h>
+#include <allegro5/allegro.h>
+#include <allegro5/allegro_primitives.h>
+
+#include "map_mesh.h"
+
+#define MAP_MESH_ERROR_RETURN(x) \
+	do{	\
+		fprintf(stderr, "ALLEGRO_MAP_MESH ERROR [%s(), LINE %d in %s]\n", __func__, __LINE__, __FILE__); \
+		return x; \
+	} while(0)
+
+#define MAP_MESH_MAX_TILESETS	16
+#define MAP_MESH_MAX_BANDS	8 /* Per tileset */
+
+/* Atlas side used when the display doesn't report its limit */
+#define MAP_MESH_ATLAS_SIZE	2048
+
+/* Flip bits in the high end of a TMX tile id */
+#define TMX_FLIP_H	0x80000000u
+#define TMX_FLIP_V	0x40000000u
+#define TMX_FLIP_D	0x20000000u
+#define TMX_GID_MASK	0x1fffffffu
+
+/*
+ * The tile layers of a map as textured quads, built once at load. Each
+ * layer is one vertex buffer over an atlas of all tilesets, so drawing a
+ * layer is one al_draw_vertex_buffer() call and the tiles cost the GPU,
+ * not the CPU. Quads are stored column by column, the columns in view
+ * are one range of the buffer.
+ *
+ * allegro_tiled doesn't hand out tiles, so the layers are read from the
+ * TMX file here. Only embedded tilesets of one image are supported.
+ */
+typedef struct {
+	ALLEGRO_VERTEX_BUFFER *buffer; /* NULL without vertex buffers */
+	ALLEGRO_VERTEX *vertices; /* Drawn from memory when there is no buffer */
+	int *column_first; /* First vertex of each column, width + 1 entries */
+	int overhang; /* Columns a tile reaches right of its cell */
+} ALLEGRO_MAP_MESH_LAYER;
+
+struct _ALLEGRO_MAP_MESH {
+	ALLEGRO_BITMAP *atlas; /* Bands of tileset rows, see al_build_map_mesh_atlas() */
+	int width; /* In tiles */
+	int height;
+	int tile_width;
+	int tile_height;
+	int layer_count;
+	ALLEGRO_MAP_MESH_LAYER *layers;
+};
+
+typedef struct {
+	uint32_t firstgid;
+	int tile_width;
+	int tile_height;
+	int columns;
+	int margin;
+	int spacing;
+	ALLEGRO_BITMAP *bitmap;
+
+	/* Rows of tiles split into bands that each fit the atlas */
+	int band_rows;
+	int band_count;
+	int band_dx[MAP_MESH_MAX_BANDS]; /* Image to atlas offset of each band */
+	int band_dy[MAP_MESH_MAX_BANDS];
+} ALLEGRO_MAP_MESH_TILESET;
+
+/* Band of a tileset image placed in the atlas */
+typedef struct {
+	ALLEGRO_MAP_MESH_TILESET *ts;
+	int band;
+	int sy; /* Top in the tileset image */
+	int w;
+	int h;
+} ALLEGRO_MAP_MESH_BAND;
+
+/***************************************************************************************/
+/********** TMX Reading ****************************************************************/
+/***************************************************************************************/
+
+/* Next <name ...> tag at or after p, NULL if none */
+static const char *tmx_find_tag(const char *p, const char *name)
+{
+	size_t n = strlen(name);
+
+	while ((p = strchr(p, '<'))) {
+		p++;
+		if (!strncmp(p, name, n) && (p[n] == ' ' || p[n] == '>' || p[n] == '/'))
+			return p - 1;
+	}
+	return NULL;
+}
+
+/* Value of attribute name in the tag at p, copied to buf */
+static bool tmx_attr(const char *p, const char *name, char *buf, size_t size)
+{
+	const char *end = strchr(p, '>');
+	size_t n = strlen(name);
+	const char *v, *q;
+
+	for (v = p; (v = strstr(v, name)) && (!end || v < end); v += n) {
+		if (v[-1] != ' ' || v[n] != '=' || v[n + 1] != '"')
+			continue;
+		v += n + 2;
+		q = strchr(v, '"');
+		if (!q || (size_t)(q - v) >= size)
+			return false;
+		memcpy(buf, v, q - v);
+		buf[q - v] = '\0';
+		return true;
+	}
+	return false;
+}
+
+static int tmx_attr_int(const char *p, const char *name, int def)
+{
+	char buf[32];
+
+	return tmx_attr(p, name, buf, sizeof(buf)) ? (int)strtol(buf, NULL, 10) : def;
+}
+
+static float tmx_attr_float(const char *p, const char *name, float def)
+{
+	char buf[32];
+
+	return tmx_attr(p, name, buf, sizeof(buf)) ? strtof(buf, NULL) : def;
+}
+
+/* Decode base64 text of length n in place, returns the byte count */
+static int tmx_base64_decode(char *text, int n)
+{
+	static const char digits[] =
+		"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	unsigned char *out = (unsigned char *)text;
+	const char *d;
+	uint32_t bits = 0;
+	int i, count = 0, len = 0;
+
+	for (i = 0; i < n && text[i] != '='; i++) {
+		d = strchr(digits, text[i]);
+		if (!d || !text[i])
+			continue; /* Whitespace */
+		bits = bits << 6 | (d - digits);
+		if (++count == 4) {
+			out[len++] = bits >> 16;
+			out[len++] = bits >> 8;
+			out[len++] = bits;
+			bits = count = 0;
+		}
+	}
+	if (count == 3) {
+		out[len++] = bits >> 10;
+		out[len++] = bits >> 2;
+	} else if (count == 2) {
+		out[len++] = bits >> 4;
+	}
+	return len;
+}
+
+/* Tile ids of the layer data between p and end, count of them */
+static bool tmx_read_data(const char *tag, char *p, char *end, uint32_t *gids, int count)
+{
+	char encoding[16] = "", compression[16] = "";
+	unsigned char *bytes = (unsigned char *)p;
+	z_stream z;
+	int i, n;
+
+	tmx_attr(tag, "encoding", encoding, sizeof(encoding));
+	tmx_attr(tag, "compression", compression, sizeof(compression));
+
+	if (!strcmp(encoding, "csv")) {
+		for (i = 0; i < count; i++) {
+			gids[i] = strtoul(p, &p, 10);
+			p += strspn(p, ", \r\n\t");
+		}
+		return p <= end;
+	}
+	if (strcmp(encoding, "base64"))
+		return false;
+
+	n = tmx_base64_decode(p, end - p);
+	if (!compression[0]) {
+		if (n != count * 4)
+			return false;
+	} else {
+		/* zlib or gzip, told apart by the header */
+		memset(&z, 0, sizeof(z));
+		if (inflateInit2(&z, 15 + 32) != Z_OK)
+			return false;
+		z.next_in = bytes;
+		z.avail_in = n;
+		z.next_out = (unsigned char *)gids;
+		z.avail_out = count * 4;
+		i = inflate(&z, Z_FINISH);
+		inflateEnd(&z);
+		if (i != Z_STREAM_END || z.avail_out != 0)
+			return false;
+		bytes = (unsigned char *)gids;
+	}
+
+	/* Little endian on disk */
+	for (i = 0; i < count; i++) {
+		gids[i] = bytes[i * 4] | bytes[i * 4 + 1] << 8 |
+			bytes[i * 4 + 2] << 16 | (uint32_t)bytes[i * 4 + 3] << 24;
+	}
+	return true;
+}
+
+static char *tmx_read_file(const char *path)
+{
+	ALLEGRO_FILE *fp;
+	char *text;
+	int64_t size;
+
+	fp = al_fopen(path, "rb");
+	if (!fp)
+		MAP_MESH_ERROR_RETURN(NULL);
+	size = al_fsize(fp);
+	text = size > 0 ? malloc(size + 1) : NULL;
+	if (!text || al_fread(fp, text, size) != (size_t)size) {
+		free(text);
+		al_fclose(fp);
+		MAP_MESH_ERROR_RETURN(NULL);
+	}
+	text[size] = '\0';
+	al_fclose(fp);
+	return text;
+}
+
+/***************************************************************************************/
+/********** Mesh Building **************************************************************/
+/***************************************************************************************/
+
+void al_destroy_map_mesh(ALLEGRO_MAP_MESH *mesh)
+{
+	int i;
+
+	if (!mesh)
+		return;
+	for (i = 0; i < mesh->layer_count; i++) {
+		if (mesh->layers[i].buffer)
+			al_destroy_vertex_buffer(mesh->layers[i].buffer);
+		free(mesh->layers[i].vertices);
+		free(mesh->layers[i].column_first);
+	}
+	free(mesh->layers);
+	if (mesh->atlas)
+		al_destroy_bitmap(mesh->atlas);
+	free(mesh);
+}
+
+/* Tallest bands first */
+static int al_map_mesh_band_cmp(const void *a, const void *b)
+{
+	return ((const ALLEGRO_MAP_MESH_BAND *)b)->h - ((const ALLEGRO_MAP_MESH_BAND *)a)->h;
+}
+
+/*
+ * Copy the tileset images into one atlas no bigger than the display
+ * allows. Sheets taller than that are cut into bands of whole tile rows,
+ * and the bands are packed on shelves, tallest first. Fails if they
+ * don't fit or the atlas can't be a video bitmap, the map cache draws
+ * such maps instead.
+ */
+static int al_build_map_mesh_atlas(ALLEGRO_MAP_MESH *mesh,
+			ALLEGRO_MAP_MESH_TILESET *tilesets, int count)
+{
+	ALLEGRO_MAP_MESH_BAND bands[MAP_MESH_MAX_TILESETS * MAP_MESH_MAX_BANDS];
+	ALLEGRO_MAP_MESH_TILESET *ts;
+	ALLEGRO_DISPLAY *display;
+	ALLEGRO_STATE state;
+	int i, b, n = 0, max, rows, pitch, h;
+	int x = 0, y = 0, shelf = 0, w = 0;
+
+	display = al_get_current_display();
+	if (!display)
+		MAP_MESH_ERROR_RETURN(-1);
+	max = al_get_display_option(display, ALLEGRO_MAX_BITMAP_SIZE);
+	if (max <= 0)
+		max = MAP_MESH_ATLAS_SIZE;
+
+	for (i = 0; i < count; i++) {
+		ts = &tilesets[i];
+		h = al_get_bitmap_height(ts->bitmap);
+		pitch = ts->tile_height + ts->spacing;
+		rows = (h - ts->margin + ts->spacing) / pitch;
+		ts->band_rows = (max - ts->margin) / pitch;
+		if (rows <= 0 || ts->band_rows <= 0)
+			MAP_MESH_ERROR_RETURN(-1);
+		ts->band_count = (rows + ts->band_rows - 1) / ts->band_rows;
+		if (ts->band_count > MAP_MESH_MAX_BANDS)
+			MAP_MESH_ERROR_RETURN(-1);
+
+		/* The first band keeps the top margin, so an uncut sheet is copied whole */
+		for (b = 0; b < ts->band_count; b++, n++) {
+			bands[n].ts = ts;
+			bands[n].band = b;
+			bands[n].sy = b ? ts->margin + b * ts->band_rows * pitch : 0;
+			bands[n].w = al_get_bitmap_width(ts->bitmap);
+			bands[n].h = b + 1 < ts->band_count ?
+				ts->margin + (b + 1) * ts->band_rows * pitch - bands[n].sy :
+				h - bands[n].sy;
+			if (bands[n].h > max)
+				bands[n].h = max; /* Slack below the last row */
+		}
+	}
+
+	qsort(bands, n, sizeof(ALLEGRO_MAP_MESH_BAND), al_map_mesh_band_cmp);
+	for (i = 0; i < n; i++) {
+		if (bands[i].w > max)
+			MAP_MESH_ERROR_RETURN(-1);
+		if (x + bands[i].w > max) {
+			y += shelf;
+			x = shelf = 0;
+		}
+		bands[i].ts->band_dx[bands[i].band] = x;
+		bands[i].ts->band_dy[bands[i].band] = y - bands[i].sy;
+		x += bands[i].w;
+		if (x > w)
+			w = x;
+		if (bands[i].h > shelf)
+			shelf = bands[i].h;
+	}
+	h = y + shelf;
+	if (h > max)
+		MAP_MESH_ERROR_RETURN(-1);
+
+	/* A memory atlas would make every vertex buffer draw go through the CPU */
+	mesh->atlas = al_create_bitmap(w, h);
+	if (!mesh->atlas)
+		MAP_MESH_ERROR_RETURN(-1);
+	if (al_get_bitmap_flags(mesh->atlas) & ALLEGRO_MEMORY_BITMAP)
+		MAP_MESH_ERROR_RETURN(-1);
+
+	al_store_state(&state, ALLEGRO_STATE_TARGET_BITMAP | ALLEGRO_STATE_BLENDER);
+	al_set_target_bitmap(mesh->atlas);
+	al_set_blender(ALLEGRO_ADD, ALLEGRO_ONE, ALLEGRO_ZERO);
+	al_clear_to_color(al_map_rgba(0, 0, 0, 0));
+	for (i = 0; i < n; i++) {
+		ts = bands[i].ts;
+		al_draw_bitmap_region(ts->bitmap, 0, bands[i].sy, bands[i].w, bands[i].h,
+				ts->band_dx[bands[i].band], ts->band_dy[bands[i].band] + bands[i].sy, 0);
+	}
+	al_restore_state(&state);
+	return 0;
+}
+
+/* Two triangles of one tile, corners of the quad clockwise from top left */
+static void al_map_mesh_quad(ALLEGRO_VERTEX *v, float x1, float y1, float x2, float y2,
+			float u1, float v1, float u2, float v2, uint32_t flags, ALLEGRO_COLOR color)
+{
+	static const int corners[6] = {0, 1, 2, 0, 2, 3};
+	float x[4] = {x1, x2, x2, x1};
+	float y[4] = {y1, y1, y2, y2};
+	float u[4] = {u1, u2, u2, u1};
+	float w[4] = {v1, v1, v2, v2};
+	float t;
+	int i;
+
+	/* Tiled swaps the axes first, then mirrors */
+	if (flags & TMX_FLIP_D) {
+		t = u[1]; u[1] = u[3]; u[3] = t;
+		t = w[1]; w[1] = w[3]; w[3] = t;
+	}
+	if (flags & TMX_FLIP_H) {
+		t = u[0]; u[0] = u[1]; u[1] = t;
+		t = w[0]; w[0] = w[1]; w[1] = t;
+		t = u[2]; u[2] = u[3]; u[3] = t;
+		t = w[2]; w[2] = w[3]; w[3] = t;
+	}
+	if (flags & TMX_FLIP_V) {
+		t = u[0]; u[0] = u[3]; u[3] = t;
+		t = w[0]; w[0] = w[3]; w[3] = t;
+		t = u[1]; u[1] = u[2]; u[2] = t;
+		t = w[1]; w[1] = w[2]; w[2] = t;
+	}
+
+	for (i = 0; i < 6; i++) {
+		v[i].x = x[corners[i]];
+		v[i].y = y[corners[i]];
+		v[i].z = 0;
+		v[i].u = u[corners[i]];
+		v[i].v = w[corners[i]];
+		v[i].color = color;
+	}
+}
+
+/* Quads of the non-empty tiles of a layer, column by column */
+static int al_build_map_mesh_layer(ALLEGRO_MAP_MESH *mesh, ALLEGRO_MAP_MESH_LAYER *layer,
+			const uint32_t *gids, float opacity,
+			const ALLEGRO_MAP_MESH_TILESET *tilesets, int tileset_count)
+{
+	const ALLEGRO_MAP_MESH_TILESET *ts;
+	ALLEGRO_COLOR color = al_map_rgba_f(opacity, opacity, opacity, opacity);
+	uint32_t gid, id;
+	int col, row, i, n = 0, local, band;
+	float x, y, u, v;
+
+	layer->column_first = malloc(sizeof(int) * (mesh->width + 1));
+	layer->vertices = malloc(sizeof(ALLEGRO_VERTEX) * 6 * mesh->width * mesh->height);
+	if (!layer->column_first || !layer->vertices)
+		MAP_MESH_ERROR_RETURN(-1);
+
+	for (col = 0; col < mesh->width; col++) {
+		layer->column_first[col] = n;
+		for (row = 0; row < mesh->height; row++) {
+			gid = gids[row * mesh->width + col];
+			id = gid & TMX_GID_MASK;
+			if (!id)
+				continue;
+
+			for (i = tileset_count - 1; i > 0 && tilesets[i].firstgid > id; i--)
+				;
+			ts = &tilesets[i];
+			if (id < ts->firstgid)
+				continue;
+			local = id - ts->firstgid;
+
+			/* Tiles bigger than a cell grow up and right from its bottom left */
+			x = col * mesh->tile_width;
+			y = (row + 1) * mesh->tile_height - ts->tile_height;
+			band = local / ts->columns / ts->band_rows;
+			if (band >= ts->band_count)
+				continue;
+			u = ts->band_dx[band] + ts->margin + (local % ts->columns) * (ts->tile_width + ts->spacing);
+			v = ts->band_dy[band] + ts->margin + (local / ts->columns) * (ts->tile_height + ts->spacing);
+			al_map_mesh_quad(&layer->vertices[n], x, y, x + ts->tile_width, y + ts->tile_height,
+					u, v, u + ts->tile_width, v + ts->tile_height,
+					gid & ~TMX_GID_MASK, color);
+			n += 6;
+
+			i = (ts->tile_width + mesh->tile_width - 1) / mesh->tile_width - 1;
+			if (i > layer->overhang)
+				layer->overhang = i;
+		}
+	}
+	layer->column_first[mesh->width] = n;
+
+	/* Keep the vertices in memory only if they can't go to the GPU */
+	if (n > 0)
+		layer->buffer = al_create_vertex_buffer(NULL, layer->vertices, n,
+						ALLEGRO_PRIM_BUFFER_STATIC);
+	if (layer->buffer) {
+		free(layer->vertices);
+		layer->vertices = NULL;
+	}
+	return 0;
+}
+
+ALLEGRO_MAP_MESH *al_load_map_mesh(const char *dir, const char *filename)
+{
+	ALLEGRO_MAP_MESH_TILESET tilesets[MAP_MESH_MAX_TILESETS];
+	ALLEGRO_MAP_MESH *mesh = NULL;
+	char path[PATH_MAX], source[PATH_MAX];
+	char *text, *data, *data_end;
+	const char *p, *tag, *image, *layer_end;
+	uint32_t *gids = NULL;
+	int tileset_count = 0, i;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, filename);
+	text = tmx_read_file(path);
+	if (!text)
+		return NULL;
+	memset(tilesets, 0, sizeof(tilesets));
+
+	mesh = calloc(1, sizeof(ALLEGRO_MAP_MESH));
+	tag = tmx_find_tag(text, "map");
+	if (!mesh || !tag)
+		goto fail;
+	mesh->width = tmx_attr_int(tag, "width", 0);
+	mesh->height = tmx_attr_int(tag, "height", 0);
+	mesh->tile_width = tmx_attr_int(tag, "tilewidth", 0);
+	mesh->tile_height = tmx_attr_int(tag, "tileheight", 0);
+	if (mesh->width <= 0 || mesh->height <= 0 ||
+		mesh->tile_width <= 0 || mesh->tile_height <= 0)
+		goto fail;
+
+	for (p = text; (tag = tmx_find_tag(p, "tileset")); p = tag + 1) {
+		ALLEGRO_MAP_MESH_TILESET *ts = &tilesets[tileset_count];
+
+		if (tileset_count == MAP_MESH_MAX_TILESETS)
+			goto fail;
+		ts->firstgid = tmx_attr_int(tag, "firstgid", 1);
+		ts->tile_width = tmx_attr_int(tag, "tilewidth", 0);
+		ts->tile_height = tmx_attr_int(tag, "tileheight", 0);
+		ts->columns = tmx_attr_int(tag, "columns", 0);
+		ts->margin = tmx_attr_int(tag, "margin", 0);
+		ts->spacing = tmx_attr_int(tag, "spacing", 0);
+
+		/* External .tsx files and image collections aren't read */
+		image = tmx_find_tag(tag, "image");
+		if (tmx_attr(tag, "source", source, sizeof(source)) || ts->columns <= 0 ||
+			!image || image > strstr(tag, "</tileset>") ||
+			!tmx_attr(image, "source", source, sizeof(source)))
+			goto fail;
+
+		snprintf(path, sizeof(path), "%s/%s", dir, source);
+		ts->bitmap = al_load_cached_bitmap(path);
+		if (!ts->bitmap)
+			goto fail;
+		tileset_count++;
+	}
+	if (tileset_count == 0 || al_build_map_mesh_atlas(mesh, tilesets, tileset_count))
+		goto fail;
+
+	gids = malloc(sizeof(uint32_t) * mesh->width * mesh->height);
+	if (!gids)
+		goto fail;
+
+	for (p = text; (tag = tmx_find_tag(p, "layer")); p = layer_end) {
+		ALLEGRO_MAP_MESH_LAYER *layers;
+
+		layer_end = strstr(tag, "</layer>");
+		if (!layer_end)
+			goto fail;
+		if (!tmx_attr_int(tag, "visible", 1))
+			continue;
+
+		/* Each layer covers the whole map */
+		if (tmx_attr_int(tag, "width", 0) != mesh->width ||
+			tmx_attr_int(tag, "height", 0) != mesh->height)
+			goto fail;
+
+		p = tmx_find_tag(tag, "data");
+		data = p ? strchr(p, '>') : NULL;
+		data_end = data ? strstr(data, "</data>") : NULL;
+		if (!data_end || data_end > layer_end ||
+			!tmx_read_data(p, data + 1, data_end, gids, mesh->width * mesh->height))
+			goto fail;
+
+		layers = realloc(mesh->layers, sizeof(ALLEGRO_MAP_MESH_LAYER) * (mesh->layer_count + 1));
+		if (!layers)
+			goto fail;
+		mesh->layers = layers;
+		memset(&layers[mesh->layer_count], 0, sizeof(ALLEGRO_MAP_MESH_LAYER));
+		if (al_build_map_mesh_layer(mesh, &layers[mesh->layer_count++], gids,
+					tmx_attr_float(tag, "opacity", 1), tilesets, tileset_count))
+			goto fail;
+	}
+
+	for (i = 0; i < tileset_count; i++)
+		al_destroy_bitmap(tilesets[i].bitmap);
+	free(gids);
+	free(text);
+	return mesh;
+
+fail:
+	for (i = 0; i < tileset_count; i++)
+		al_destroy_bitmap(tilesets[i].bitmap);
+	al_destroy_map_mesh(mesh);
+	free(gids);
+	free(text);
+	MAP_MESH_ERROR_RETURN(NULL);
+}
+
+/***************************************************************************************/
+/********** Mesh Drawing ***************************************************************/
+/***************************************************************************************/
+
+/*
+ * Same as al_draw_map_region(), one draw call per layer. Not to be used
+ * while bitmap drawing is held.
+ */
+void al_draw_map_mesh_region(ALLEGRO_MAP_MESH *mesh, float sx, float sy,
+				float sw, float sh, float dx, float dy)
+{
+	ALLEGRO_MAP_MESH_LAYER *layer;
+	ALLEGRO_TRANSFORM transform, old;
+	int cx, cy, cw, ch;
+	int col1, col2, first, last, i;
+
+	al_copy_transform(&old, al_get_current_transform());
+	al_identity_transform(&transform);
+	al_translate_transform(&transform, dx - sx, dy - sy);
+	al_compose_transform(&transform, &old);
+	al_use_transform(&transform);
+	al_get_clipping_rectangle(&cx, &cy, &cw, &ch);
+	al_set_clipping_rectangle(dx, dy, sw, sh);
+
+	col1 = sx / mesh->tile_width;
+	col2 = (sx + sw + mesh->tile_width - 1) / mesh->tile_width;
+	for (i = 0; i < mesh->layer_count; i++) {
+		layer = &mesh->layers[i];
+
+		/* Only the columns in view, and those reaching into it */
+		first = col1 - layer->overhang;
+		last = col2;
+		if (first < 0)
+			first = 0;
+		if (last > mesh->width)
+			last = mesh->width;
+		if (first >= last)
+			continue;
+		first = layer->column_first[first];
+		last = layer->column_first[last];
+		if (first == last)
+			continue;
+
+		if (layer->buffer)
+			al_draw_vertex_buffer(layer->buffer, mesh->atlas, first, last,
+					ALLEGRO_PRIM_TRIANGLE_LIST);
+		else
+			al_draw_prim(layer->vertices, NULL, mesh->atlas, first, last,
+					ALLEGRO_PRIM_TRIANGLE_LIST);
+	}
+
+	al_set_clipping_rectangle(cx, cy, cw, ch);
+	al_use_transform(&old);
+}
+
+/* The view of camera at the top left of the target */
+void al_draw_map_mesh_view(ALLEGRO_MAP_MESH *mesh, ALLEGRO_CAMERA *camera)
+{
+	al_draw_map_mesh_region(mesh, al_camera_get_x(camera), al_camera_get_y(camera),
+			al_camera_get_width(camera), al_camera_get_height(camera), 0, 0);
+}
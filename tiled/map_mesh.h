@@ -0,0 +1,15 @@
+#ifndef __MAP_MESH_H__
+#define __MAP_MESH_H__
+
+#include <allegro5/allegro_primitives.h>
+#include "../sprite/sprite.h"
+
+typedef struct _ALLEGRO_MAP_MESH ALLEGRO_MAP_MESH;
+
+ALLEGRO_MAP_MESH *al_load_map_mesh(const char *dir, const char *filename);
+void al_destroy_map_mesh(ALLEGRO_MAP_MESH *mesh);
+void al_draw_map_mesh_region(ALLEGRO_MAP_MESH *mesh, float sx, float sy,
+				float sw, float sh, float dx, float dy);
+void al_draw_map_mesh_view(ALLEGRO_MAP_MESH *mesh, ALLEGRO_CAMERA *camera);
+
+#endif
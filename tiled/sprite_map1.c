@@ -5,6 +5,8 @@
 #include <allegro5/allegro_tiled.h>
 
 #include "../sprite/sprite.c"
+#include "map_cache.c"
+#include "map_mesh.c"
 
 #define FPS	60
 
@@ -13,6 +15,7 @@
 
 #define MAP_DIR		"../assets"
 #define MAP_FILE	"map1.tmx"
+#define MAP_CHUNK_SIZE	256
 
 #define BG_WIDTH		640
 #define BG_HEIGHT		480
@@ -34,8 +37,10 @@ static bool running = true;
 static bool redraw = true;
 
 static ALLEGRO_MAP *map = NULL;
-static int map_x = 0;
-static int map_y = 0;
+static ALLEGRO_MAP_CACHE *map_cache = NULL;
+static ALLEGRO_MAP_MESH *map_mesh = NULL;
+static bool use_mesh = false; /* -v, draw the map from vertex buffers */
+static ALLEGRO_CAMERA *camera = NULL;
 static int map_w = 0;
 static int map_h = 0;
 
@@ -197,6 +202,25 @@ static int game_init_map(void)
 	}
 	map_w = al_get_map_width(map) * al_get_tile_width(map);
 	map_h = al_get_map_height(map) * al_get_tile_height(map);
+
+	/* Render the layers once, drawing takes a few chunk blits or
+	 * one vertex buffer per layer. The cache also takes maps whose
+	 * tilesets don't fit a mesh atlas */
+	if (use_mesh)
+		map_mesh = al_load_map_mesh(MAP_DIR, MAP_FILE);
+	if (!map_mesh)
+		map_cache = al_create_map_cache(map, MAP_CHUNK_SIZE);
+	if (!map_cache && !map_mesh) {
+		fprintf(stderr, "failed to cache map "MAP_FILE"!\n");
+		return -1;
+	}
+
+	/* Sprites and map are drawn through one view */
+	camera = al_create_camera(BG_WIDTH, BG_HEIGHT);
+	if (!camera)
+		return -1;
+	al_camera_set_map_size(camera, map_w, map_h);
+	al_use_sprite_camera(camera);
 	return 0;
 }
 
@@ -266,6 +290,9 @@ static int game_init(void)
 	/* Init image addon */
 	al_init_image_addon();
 
+	/* Init primitives addon, for vertex buffers */
+	al_init_primitives_addon();
+
 	/* Create a window */
 	display = al_create_display(BG_WIDTH, BG_HEIGHT);
 	if (!display) {
@@ -302,6 +329,10 @@ static int game_init(void)
 		return -1;
 	}
 
+	/* Pack all sprite sheets into one texture */
+	if (al_build_sprite_atlas(1024, 1024) < 0)
+		fprintf(stderr, "failed to build sprite atlas!\n");
+
 	/* Set window title */
 	al_set_window_title(display, "SPRITE!");
 
@@ -316,8 +347,6 @@ static int game_init(void)
 
 static void game_exit(void)
 {
-	if (display)
-		al_destroy_display(display);
 	if (timer)
 		al_destroy_timer(timer);
 	if (sprite)
@@ -329,8 +358,17 @@ static void game_exit(void)
 				al_destroy_sprite(npc[i]);
 		}
 	}
+	if (camera)
+		al_destroy_camera(camera);
+	if (map_cache)
+		al_destroy_map_cache(map_cache);
+	if (map_mesh)
+		al_destroy_map_mesh(map_mesh);
 	if (map)
 		al_free_map(map);
+	/* Bitmaps and vertex buffers above need its context */
+	if (display)
+		al_destroy_display(display);
 	if (eventq)
 		al_destroy_event_queue(eventq);
 
@@ -597,6 +635,13 @@ static void game_handle_timer_event(ALLEGRO_EVENT *event)
 	}
 }
 
+static void game_update_camera(void)
+{
+	if (al_camera_follow(camera, al_sprite_get_x(sprite), al_sprite_get_y(sprite),
+			al_sprite_get_width(sprite), al_sprite_get_height(sprite)))
+		redraw = true;
+}
+
 static void game_handle_key_down_event(int keycode)
 {
 	/* Start to jump */
@@ -655,6 +700,7 @@ static void game_handle_event(ALLEGRO_EVENT *event)
 	switch (event->type) {
 		case ALLEGRO_EVENT_TIMER:
 			game_handle_timer_event(event);
+			game_update_camera();
 			break;
 		case ALLEGRO_EVENT_KEY_DOWN:
 			game_handle_key_down_event(event->keyboard.keycode);
@@ -676,8 +722,10 @@ static void game_handle_event(ALLEGRO_EVENT *event)
 
 static int game_draw_map(void)
 {
-	al_draw_map_region(map, map_x, map_y,
-					BG_WIDTH, BG_HEIGHT, 0, 0, 0);
+	if (map_mesh)
+		al_draw_map_mesh_view(map_mesh, camera);
+	else
+		al_draw_map_cache_view(map_cache, camera);
 	return 0;
 }
 
@@ -699,9 +747,12 @@ static int game_display_refresh(void)
 {
 	al_clear_to_color(BG_COLOR);
 	game_draw_map();
+	al_hold_bitmap_drawing(true);
 	game_draw_npc();
 	game_draw_sprite();
+	al_hold_bitmap_drawing(false);
 	al_flip_display();
+	al_update_sprite_memory();
 	redraw = false;
 	return 0;
 }
@@ -728,6 +779,9 @@ static void game_loop(void)
 
 int main(int argc, char **argv)
 {
+	if (argc > 1 && !strcmp(argv[1], "-v"))
+		use_mesh = true;
+
 	if (!game_init()) {
 		game_loop();
 	}
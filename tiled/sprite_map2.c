@@ -5,6 +5,8 @@
 #include <allegro5/allegro_tiled.h>
 
 #include "../sprite/sprite.c"
+#include "map_cache.c"
+#include "map_mesh.c"
 
 #define FPS	60
 
@@ -13,6 +15,7 @@
 
 #define MAP_DIR		"../assets"
 #define MAP_FILE	"map2.tmx"
+#define MAP_CHUNK_SIZE	256
 
 #define BG_WIDTH		640
 #define BG_HEIGHT		480
@@ -35,8 +38,10 @@ static bool running = true;
 static bool redraw = true;
 
 static ALLEGRO_MAP *map = NULL;
-static int map_x = 0;
-static int map_y = 0;
+static ALLEGRO_MAP_CACHE *map_cache = NULL;
+static ALLEGRO_MAP_MESH *map_mesh = NULL;
+static bool use_mesh = false; /* -v, draw the map from vertex buffers */
+static ALLEGRO_CAMERA *camera = NULL;
 static int map_w = 0;
 static int map_h = 0;
 
@@ -172,8 +177,28 @@ static int game_init_map(void)
 	}
 	map_w = al_get_map_width(map) * al_get_tile_width(map);
 	map_h = al_get_map_height(map) * al_get_tile_height(map);
-	map_x = 0;
-	map_y = map_h - BG_HEIGHT;
+
+	/* Render the layers once, drawing takes a few chunk blits or
+	 * one vertex buffer per layer. The cache also takes maps whose
+	 * tilesets don't fit a mesh atlas */
+	if (use_mesh)
+		map_mesh = al_load_map_mesh(MAP_DIR, MAP_FILE);
+	if (!map_mesh)
+		map_cache = al_create_map_cache(map, MAP_CHUNK_SIZE);
+	if (!map_cache && !map_mesh) {
+		fprintf(stderr, "failed to cache map "MAP_FILE"!\n");
+		return -1;
+	}
+
+	/* Scroll once the player leaves the middle third, easing in */
+	camera = al_create_camera(BG_WIDTH, BG_HEIGHT);
+	if (!camera)
+		return -1;
+	al_camera_set_map_size(camera, map_w, map_h);
+	al_camera_set_dead_zone(camera, BG_WIDTH/3, 0, BG_WIDTH/3, BG_HEIGHT);
+	al_camera_set_follow_speed(camera, 0.125);
+	al_camera_move_to(camera, 0, map_h - BG_HEIGHT);
+	al_use_sprite_camera(camera);
 	return 0;
 }
 
@@ -185,7 +210,6 @@ static int game_init_sprite(void)
 		return -1;
 	}
 
-	al_sprite_set_map_pos(sprite, map_x, map_y);
 	al_sprite_set_map_size(sprite, map_w, map_h);
 	al_sprite_move_to(sprite, 20, 230);
 
@@ -216,6 +240,9 @@ static int game_init(void)
 	/* Init image addon */
 	al_init_image_addon();
 
+	/* Init primitives addon, for vertex buffers */
+	al_init_primitives_addon();
+
 	/* Create a window */
 	display = al_create_display(BG_WIDTH, BG_HEIGHT);
 	if (!display) {
@@ -261,14 +288,26 @@ static int game_init(void)
 
 static void game_exit(void)
 {
-	if (display)
-		al_destroy_display(display);
+	ALLEGRO_SPRITE_DRAW_STATS stats;
+
+	al_get_sprite_draw_stats(&stats);
+	printf("Sprites drawn %lu, culled %lu\n", stats.drawn, stats.culled);
+
 	if (timer)
 		al_destroy_timer(timer);
 	if (sprite)
 		al_destroy_sprite(sprite);
+	if (camera)
+		al_destroy_camera(camera);
+	if (map_cache)
+		al_destroy_map_cache(map_cache);
+	if (map_mesh)
+		al_destroy_map_mesh(map_mesh);
 	if (map)
 		al_free_map(map);
+	/* Bitmaps and vertex buffers above need its context */
+	if (display)
+		al_destroy_display(display);
 	if (eventq)
 		al_destroy_event_queue(eventq);
 
@@ -530,6 +569,13 @@ static void game_handle_timer_event(ALLEGRO_EVENT *event)
 	}
 }
 
+static void game_update_camera(void)
+{
+	if (al_camera_follow(camera, al_sprite_get_x(sprite), al_sprite_get_y(sprite),
+			al_sprite_get_width(sprite), al_sprite_get_height(sprite)))
+		redraw = true;
+}
+
 static void game_handle_key_down_event(int keycode)
 {
 	/* Start to jump */
@@ -582,6 +628,7 @@ static void game_handle_event(ALLEGRO_EVENT *event)
 	switch (event->type) {
 		case ALLEGRO_EVENT_TIMER:
 			game_handle_timer_event(event);
+			game_update_camera();
 			break;
 		case ALLEGRO_EVENT_KEY_DOWN:
 			game_handle_key_down_event(event->keyboard.keycode);
@@ -603,8 +650,10 @@ static void game_handle_event(ALLEGRO_EVENT *event)
 
 static int game_draw_map(void)
 {
-	al_draw_map_region(map, map_x, map_y,
-					BG_WIDTH, BG_HEIGHT, 0, 0, 0);
+	if (map_mesh)
+		al_draw_map_mesh_view(map_mesh, camera);
+	else
+		al_draw_map_cache_view(map_cache, camera);
 	return 0;
 }
 
@@ -620,6 +669,7 @@ static int game_display_refresh(void)
 	game_draw_map();
 	game_draw_sprite();
 	al_flip_display();
+	al_update_sprite_memory();
 	redraw = false;
 	return 0;
 }
@@ -646,6 +696,9 @@ static void game_loop(void)
 
 int main(int argc, char **argv)
 {
+	if (argc > 1 && !strcmp(argv[1], "-v"))
+		use_mesh = true;
+
 	if (!game_init()) {
 		game_loop();
 	}